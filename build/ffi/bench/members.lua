@@ -0,0 +1,65 @@
+-- struct member reads and writes, run from the ffi directory:
+--   lua bench/members.lua [particles]
+local ffi = require "ffi"
+
+ffi.cdef [[
+struct particle {
+    float x, y, z;
+    float vx, vy, vz;
+    int32_t alive;
+    uint8_t flags;
+};
+]]
+
+local n = tonumber(arg and arg[1]) or 10000
+local steps = 100
+
+local function best(f)
+    local t = math.huge
+    for _ = 1, 5 do
+        local c = os.clock()
+        f()
+        t = math.min(t, os.clock() - c)
+    end
+    return t
+end
+
+-- each particle costs the p = ps[i] reference, 6 reads and 3 writes
+local ps = ffi.new("struct particle[?]", n)
+for i = 0, n - 1 do
+    local p = ps[i]
+    p.vx, p.vy, p.vz, p.alive = i % 7, i % 5, 1, 1
+end
+
+local function update(dt)
+    for i = 0, n - 1 do
+        local p = ps[i]
+        if p.alive ~= 0 then
+            p.x = p.x + p.vx * dt
+            p.y = p.y + p.vy * dt
+            p.z = p.z + p.vz * dt
+        end
+    end
+end
+
+local t = best(function ()
+    for _ = 1, steps do update(0.5) end
+end)
+print(("particle update   %7.1f ns/particle"):format(t / (n * steps) * 1e9))
+
+local s = ffi.new("struct particle")
+local m = 1000000
+local v
+
+t = best(function ()
+    for _ = 1, m do v = s.y end
+end)
+print(("v = s.y           %7.1f ns"):format(t / m * 1e9))
+t = best(function ()
+    for _ = 1, m do s.x = 1 end
+end)
+print(("s.x = 1           %7.1f ns"):format(t / m * 1e9))
+t = best(function ()
+    for _ = 1, m do s.x = s.y + 1 end
+end)
+print(("s.x = s.y + 1     %7.1f ns"):format(t / m * 1e9))
@@ -0,0 +1,41 @@
+-- cost of passing type strings to ffi.new, ffi.cast and ffi.sizeof
+-- against a ctype from ffi.typeof, run from the ffi directory:
+--   lua bench/typestr.lua [calls]
+local ffi = require "ffi"
+
+ffi.cdef [[struct vec3 { double x, y, z; };]]
+
+local n = tonumber(arg and arg[1]) or 1000000
+
+local function bench(name, f)
+    local best = math.huge
+    for _ = 1, 5 do
+        local c = os.clock()
+        f()
+        best = math.min(best, os.clock() - c)
+    end
+    print(("%-28s %7.1f ns/call"):format(name, best / n * 1e9))
+end
+
+local vec3 = ffi.typeof("struct vec3")
+local bytes = ffi.typeof("uint8_t[16]")
+local p = ffi.new(bytes)
+
+bench('ffi.new("struct vec3")', function()
+    for _ = 1, n do ffi.new("struct vec3") end
+end)
+bench("ffi.new(vec3_t)", function()
+    for _ = 1, n do ffi.new(vec3) end
+end)
+bench('ffi.new("uint8_t[16]")', function()
+    for _ = 1, n do ffi.new("uint8_t[16]") end
+end)
+bench("ffi.new(uint8_t[16] ctype)", function()
+    for _ = 1, n do ffi.new(bytes) end
+end)
+bench('ffi.cast("uint8_t*", p)', function()
+    for _ = 1, n do ffi.cast("uint8_t*", p) end
+end)
+bench('ffi.sizeof("struct vec3")', function()
+    for _ = 1, n do ffi.sizeof("struct vec3") end
+end)
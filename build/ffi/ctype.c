@@ -9,6 +9,10 @@
 #include "ffi.h"
 
 static int to_define_key;
+static int ctype_cache_key;
+
+/* maximum number of type strings cached by check_ctype */
+#define CTYPE_CACHE_MAX 512
 
 static void update_on_definition(lua_State* L, int ct_usr, int ct_idx)
 {
@@ -182,11 +186,40 @@ void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct)
     return cd+1;
 }
 
-/* returns the value as a ctype, pushes the user value onto the stack */
+/* clear_ctype_cache drops the types check_ctype has cached for type
+ * strings. It is called whenever declarations are added as a string may
+ * then resolve to a different type (eg a typedef or an array size using a
+ * new constant). */
+void clear_ctype_cache(lua_State* L)
+{
+    lua_newtable(L);
+    set_upval(L, &ctype_cache_key);
+}
+
+/* returns the value as a ctype, pushes the user value onto the stack. Type
+ * strings are parsed once and then looked up in a per state cache of ctype
+ * objects, except for those declaring a struct, union or enum inline. */
 void check_ctype(lua_State* L, int idx, struct ctype* ct)
 {
     if (lua_isstring(L, idx)) {
         struct parser P;
+        int cache;
+
+        idx = lua_absindex(L, idx);
+        push_upval(L, &ctype_cache_key);
+        cache = lua_gettop(L);
+
+        lua_pushvalue(L, idx);
+        lua_rawget(L, cache);
+        if (lua_type(L, -1) == LUA_TUSERDATA) {
+            *ct = *(struct ctype*) lua_touserdata(L, -1);
+            lua_getuservalue(L, -1);
+            lua_replace(L, cache);
+            lua_pop(L, 1); /* cached ctype */
+            return;
+        }
+        lua_pop(L, 1); /* nil */
+
         P.line = 1;
         P.prev = P.next = lua_tostring(L, idx);
         P.align_mask = DEFAULT_ALIGN_MASK;
@@ -194,6 +227,34 @@ void check_ctype(lua_State* L, int idx, struct ctype* ct)
         parse_argument(L, &P, -1, ct, NULL, NULL);
         lua_remove(L, -2); /* remove the user value from parse_type */
 
+        if (strchr(lua_tostring(L, idx), '{') != NULL) {
+            /* the string declared a type */
+            clear_ctype_cache(L);
+        } else {
+            int count;
+            lua_rawgeti(L, cache, 0);
+            count = (int) lua_tointeger(L, -1) + 1;
+            lua_pop(L, 1);
+
+            if (count > CTYPE_CACHE_MAX) {
+                /* strings are being generated, start again rather than
+                 * growing without bound */
+                clear_ctype_cache(L);
+                push_upval(L, &ctype_cache_key);
+                lua_replace(L, cache);
+                count = 1;
+            }
+
+            lua_pushinteger(L, count);
+            lua_rawseti(L, cache, 0);
+
+            lua_pushvalue(L, idx);
+            push_ctype(L, -2, ct);
+            lua_rawset(L, cache);
+        }
+
+        lua_remove(L, cache);
+
     } else if (lua_getmetatable(L, idx)) {
         if (!equals_upval(L, -1, &ctype_mt_key)
                 && !equals_upval(L, -1, &cdata_mt_key)) {
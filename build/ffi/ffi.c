@@ -10,6 +10,11 @@
 #include <math.h>
 #include <inttypes.h>
 
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 /* Set to 1 to get extra debugging on print */
 #define DEBUG_TOSTRING 0
 
@@ -1317,6 +1322,254 @@ static int ffi_gc(lua_State* L)
     return 1;
 }
 
+/* The scalar members of a struct or union are also kept in a native open
+ * addressed hash, stored in the struct user value at MEMBER_TABLE_IDX, so
+ * that cdata_index and cdata_newindex can access them without going through
+ * the member ctypes. The hash is keyed by the address of the member name
+ * string, which is the same for every equal short string as they are
+ * interned and the usr table keeps the names alive. Other strings simply
+ * miss and take the normal path.
+ *
+ * Members are stored from index 1 so index 0 is free. An integer key is used
+ * rather than a light userdata one as it avoids hashing a pointer on every
+ * access.
+ */
+#define MEMBER_TABLE_IDX 0
+
+struct member {
+    const char* name;
+    size_t offset;
+    unsigned type : 5; /* ctype type enum */
+    unsigned is_unsigned : 1;
+    unsigned is_const : 1;
+};
+
+struct member_table {
+    size_t mask;
+    struct member m[1];
+};
+
+#define MEMBER_HASH(name) (((uintptr_t) (name) >> 3) ^ ((uintptr_t) (name) >> 11))
+
+static int is_fast_member(const struct ctype* mt)
+{
+    if (mt->pointers || mt->is_array || mt->is_bitfield || mt->is_variable_array) {
+        return 0;
+    }
+
+    switch (mt->type) {
+    case BOOL_TYPE:
+    case INT8_TYPE:
+    case INT16_TYPE:
+    case INT32_TYPE:
+    case ENUM_TYPE:
+    case FLOAT_TYPE:
+    case DOUBLE_TYPE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* set_member_table builds the member hash for a newly defined struct or
+ * union from its usr table */
+void set_member_table(lua_State* L, int ct_usr)
+{
+    struct member_table* tbl;
+    size_t num = 0, size = 4;
+
+    ct_usr = lua_absindex(L, ct_usr);
+
+    lua_pushnil(L);
+    while (lua_next(L, ct_usr)) {
+        if (lua_type(L, -2) == LUA_TSTRING && is_fast_member((const struct ctype*) lua_touserdata(L, -1))) {
+            num++;
+        }
+        lua_pop(L, 1);
+    }
+
+    if (num == 0) {
+        return;
+    }
+
+    while (size < num * 2) {
+        size *= 2;
+    }
+
+    tbl = (struct member_table*) lua_newuserdata(L, sizeof(struct member_table) + (size - 1) * sizeof(struct member));
+    memset(tbl, 0, sizeof(struct member_table) + (size - 1) * sizeof(struct member));
+    tbl->mask = size - 1;
+
+    lua_pushnil(L);
+    while (lua_next(L, ct_usr)) {
+        const struct ctype* mt = (const struct ctype*) lua_touserdata(L, -1);
+
+        if (lua_type(L, -2) == LUA_TSTRING && is_fast_member(mt)) {
+            const char* name = lua_tostring(L, -2);
+            size_t i = MEMBER_HASH(name) & tbl->mask;
+
+            while (tbl->m[i].name) {
+                i = (i + 1) & tbl->mask;
+            }
+
+            tbl->m[i].name = name;
+            tbl->m[i].offset = mt->offset;
+            tbl->m[i].type = mt->type;
+            tbl->m[i].is_unsigned = mt->is_unsigned;
+            tbl->m[i].is_const = mt->const_mask & 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_rawseti(L, ct_usr, 0);
+}
+
+/* find_member returns the scalar member of the struct cdata at index 1
+ * named by the string at index 2 and sets *pdata to the struct data, or
+ * returns NULL if there is no such member. The cdata metatable is checked
+ * against upvalue 3 of cdata_index/cdata_newindex and the ctype is read in
+ * place to keep this path free of registry lookups and ctype copies. */
+static const struct member* find_member(lua_State* L, char** pdata)
+{
+    const struct cdata* cd;
+    const struct ctype* ct;
+    const struct member_table* tbl;
+    const char* name;
+    size_t i;
+
+    if (lua_type(L, 2) != LUA_TSTRING || !lua_getmetatable(L, 1)) {
+        return NULL;
+    }
+
+    if (!lua_rawequal(L, -1, lua_upvalueindex(3))) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    lua_pop(L, 1); /* mt */
+
+    cd = (const struct cdata*) lua_touserdata(L, 1);
+    ct = &cd->type;
+
+    if ((ct->type != STRUCT_TYPE && ct->type != UNION_TYPE) || ct->is_array || ct->pointers > 1) {
+        return NULL;
+    }
+
+    lua_getuservalue(L, 1);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+
+    lua_rawgeti(L, -1, MEMBER_TABLE_IDX);
+    tbl = (const struct member_table*) lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    if (tbl == NULL) {
+        return NULL;
+    }
+
+    name = lua_tostring(L, 2);
+    for (i = MEMBER_HASH(name) & tbl->mask; tbl->m[i].name; i = (i + 1) & tbl->mask) {
+        if (tbl->m[i].name == name) {
+            /* as to_cdata */
+            if (ct->is_reference || ct->pointers) {
+                *pdata = *(char**) (cd+1);
+            } else {
+                *pdata = (char*) (cd+1);
+            }
+            return &tbl->m[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void push_member(lua_State* L, const struct member* m, const char* data)
+{
+    union {
+        _Bool b;
+        int8_t i8;
+        uint8_t u8;
+        int16_t i16;
+        uint16_t u16;
+        int32_t i32;
+        uint32_t u32;
+        float f;
+        double d;
+    } v;
+
+    switch (m->type) {
+    case BOOL_TYPE:
+        memcpy(&v.b, data, sizeof(v.b));
+        lua_pushboolean(L, v.b);
+        break;
+    case INT8_TYPE:
+        memcpy(&v.u8, data, sizeof(v.u8));
+        lua_pushinteger(L, m->is_unsigned ? (lua_Integer) v.u8 : (lua_Integer) v.i8);
+        break;
+    case INT16_TYPE:
+        memcpy(&v.u16, data, sizeof(v.u16));
+        lua_pushinteger(L, m->is_unsigned ? (lua_Integer) v.u16 : (lua_Integer) v.i16);
+        break;
+    case ENUM_TYPE:
+    case INT32_TYPE:
+        memcpy(&v.u32, data, sizeof(v.u32));
+        lua_pushinteger(L, m->is_unsigned ? (lua_Integer) v.u32 : (lua_Integer) v.i32);
+        break;
+    case FLOAT_TYPE:
+        memcpy(&v.f, data, sizeof(v.f));
+        lua_pushnumber(L, v.f);
+        break;
+    case DOUBLE_TYPE:
+        memcpy(&v.d, data, sizeof(v.d));
+        lua_pushnumber(L, v.d);
+        break;
+    }
+}
+
+/* set_member converts the value at idx as set_value does. Enums are left to
+ * set_value as they can be set by name. */
+static int set_member(lua_State* L, int idx, const struct member* m, char* data)
+{
+    union {
+        _Bool b;
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        float f;
+        double d;
+    } v;
+
+    switch (m->type) {
+    case BOOL_TYPE:
+        v.b = (cast_int64(L, idx, 0) != 0);
+        memcpy(data, &v.b, sizeof(v.b));
+        return 1;
+    case INT8_TYPE:
+        v.u8 = m->is_unsigned ? (uint8_t) cast_uint64(L, idx, 0) : (uint8_t) (int8_t) cast_int64(L, idx, 0);
+        memcpy(data, &v.u8, sizeof(v.u8));
+        return 1;
+    case INT16_TYPE:
+        v.u16 = m->is_unsigned ? (uint16_t) cast_uint64(L, idx, 0) : (uint16_t) (int16_t) cast_int64(L, idx, 0);
+        memcpy(data, &v.u16, sizeof(v.u16));
+        return 1;
+    case INT32_TYPE:
+        v.u32 = m->is_unsigned ? (uint32_t) cast_uint64(L, idx, 0) : (uint32_t) (int32_t) cast_int64(L, idx, 0);
+        memcpy(data, &v.u32, sizeof(v.u32));
+        return 1;
+    case FLOAT_TYPE:
+        v.f = (float) check_double(L, idx);
+        memcpy(data, &v.f, sizeof(v.f));
+        return 1;
+    case DOUBLE_TYPE:
+        v.d = check_double(L, idx);
+        memcpy(data, &v.d, sizeof(v.d));
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 /* lookup_cdata_index returns the offset of the found type and user value on
  * the stack if valid. Otherwise returns -ve and doesn't touch the stack.
  */
@@ -1381,10 +1634,17 @@ static int cdata_newindex(lua_State* L)
     struct ctype tt;
     char* to;
     ptrdiff_t off;
+    const struct member* m;
 
     lua_settop(L, 3);
 
+    m = find_member(L, &to);
+    if (m && !m->is_const && set_member(L, 3, m, to + m->offset)) {
+        return 0;
+    }
+
     to = (char*) check_cdata(L, 1, &tt);
+
     off = lookup_cdata_index(L, 2, -1, &tt);
 
     if (off < 0) {
@@ -1423,8 +1683,16 @@ static int cdata_index(lua_State* L)
     struct ctype ct;
     char* data;
     ptrdiff_t off;
+    const struct member* m;
 
     lua_settop(L, 2);
+
+    m = find_member(L, &data);
+    if (m) {
+        push_member(L, m, data + m->offset);
+        return 1;
+    }
+
     data = (char*) check_cdata(L, 1, &ct);
     assert(lua_gettop(L) == 3);
 
@@ -2416,6 +2684,369 @@ static int ffi_fill(lua_State* L)
     return 0;
 }
 
+/* Bulk conversions between arrays of numbers and Lua tables or other arrays.
+ * These work on pointers to or arrays of the integer and floating point
+ * types, with the element kind picked once per call rather than per
+ * element. */
+enum {
+    NUM_INT8,
+    NUM_UINT8,
+    NUM_INT16,
+    NUM_UINT16,
+    NUM_INT32,
+    NUM_UINT32,
+    NUM_INT64,
+    NUM_UINT64,
+    NUM_FLOAT,
+    NUM_DOUBLE,
+};
+
+/* number of elements converted at a time by ffi.convert */
+#define CONVERT_CHUNK 256
+
+/* num_kind returns the element kind of a pointer or array type or -1 if the
+ * elements aren't numbers */
+static int num_kind(const struct ctype* ct)
+{
+    if (ct->pointers != 1 || ct->is_bitfield) {
+        return -1;
+    }
+
+    switch (ct->type) {
+    case INT8_TYPE:
+        return ct->is_unsigned ? NUM_UINT8 : NUM_INT8;
+    case INT16_TYPE:
+        return ct->is_unsigned ? NUM_UINT16 : NUM_INT16;
+    case ENUM_TYPE:
+    case INT32_TYPE:
+        return ct->is_unsigned ? NUM_UINT32 : NUM_INT32;
+    case INT64_TYPE:
+        return ct->is_unsigned ? NUM_UINT64 : NUM_INT64;
+    case FLOAT_TYPE:
+        return NUM_FLOAT;
+    case DOUBLE_TYPE:
+        return NUM_DOUBLE;
+    default:
+        return -1;
+    }
+}
+
+/* check_num_array returns the data of the number array or pointer at idx and
+ * its element kind. The user value is popped. */
+static char* check_num_array(lua_State* L, int idx, struct ctype* ct, int* kind)
+{
+    char* p = (char*) check_cdata(L, idx, ct);
+    *kind = num_kind(ct);
+
+    if (*kind < 0) {
+        push_type_name(L, -1, ct);
+        luaL_error(L, "expected a pointer to or array of numbers for arg #%d, got %s", idx, lua_tostring(L, -1));
+    }
+
+    lua_pop(L, 1); /* user value */
+    return p;
+}
+
+/* check_num_count returns the element count at idx, which can be omitted for
+ * arrays of known size */
+static size_t check_num_count(lua_State* L, int idx, const struct ctype* ct)
+{
+    if (!lua_isnoneornil(L, idx)) {
+        lua_Integer n = luaL_checkinteger(L, idx);
+        luaL_argcheck(L, n >= 0, idx, "negative element count");
+        return (size_t) n;
+
+    } else if (ct->is_array && !ct->is_variable_array) {
+        return ct->array_size;
+
+    } else {
+        return luaL_argerror(L, idx, "element count required for pointers");
+    }
+}
+
+/* ffi.totable(cdata [, n]) returns a new table holding the first n elements
+ * (all elements for arrays) of a number array. 64 bit integers are returned
+ * as Lua integers. */
+static int ffi_totable(lua_State* L)
+{
+    struct ctype ct;
+    int kind;
+    size_t i, n;
+    char* p;
+
+    lua_settop(L, 2);
+    p = check_num_array(L, 1, &ct, &kind);
+    n = check_num_count(L, 2, &ct);
+    luaL_argcheck(L, n <= INT_MAX, 2, "too many elements");
+
+    if (ct.is_array && n > ct.array_size) {
+        return luaL_error(L, "element count out of range");
+    }
+
+    lua_createtable(L, (int) n, 0);
+
+#define TO_TABLE(TYPE, PUSH, LUATYPE)                                       \
+    for (i = 0; i < n; i++) {                                               \
+        PUSH(L, (LUATYPE) ((const TYPE*) p)[i]);                            \
+        lua_rawseti(L, -2, (lua_Integer) i + 1);                            \
+    }                                                                       \
+    break;
+
+    switch (kind) {
+    case NUM_INT8: TO_TABLE(int8_t, lua_pushinteger, lua_Integer)
+    case NUM_UINT8: TO_TABLE(uint8_t, lua_pushinteger, lua_Integer)
+    case NUM_INT16: TO_TABLE(int16_t, lua_pushinteger, lua_Integer)
+    case NUM_UINT16: TO_TABLE(uint16_t, lua_pushinteger, lua_Integer)
+    case NUM_INT32: TO_TABLE(int32_t, lua_pushinteger, lua_Integer)
+    case NUM_UINT32: TO_TABLE(uint32_t, lua_pushinteger, lua_Integer)
+    case NUM_INT64: TO_TABLE(int64_t, lua_pushinteger, lua_Integer)
+    case NUM_UINT64: TO_TABLE(uint64_t, lua_pushinteger, lua_Integer)
+    case NUM_FLOAT: TO_TABLE(float, lua_pushnumber, lua_Number)
+    case NUM_DOUBLE: TO_TABLE(double, lua_pushnumber, lua_Number)
+    }
+
+#undef TO_TABLE
+
+    return 1;
+}
+
+/* ffi.fromtable(ctype, tbl) returns a new array holding the elements of tbl.
+ * The ctype is either the element type or an array of it. Variable and
+ * scalar types give an array of #tbl elements. Integer elements must be
+ * numbers with an integer value. */
+static int ffi_fromtable(lua_State* L)
+{
+    struct ctype ct;
+    int kind;
+    size_t i, n;
+    char* p;
+
+    lua_settop(L, 2);
+    check_ctype(L, 1, &ct);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+
+    if (!ct.is_array) {
+        if (ct.pointers == POINTER_MAX) {
+            return luaL_error(L, "maximum number of pointer derefs reached");
+        }
+        ct.is_array = 1;
+        ct.pointers++;
+        ct.const_mask <<= 1;
+        ct.array_size = n;
+
+    } else if (ct.is_variable_array) {
+        ct.is_variable_array = 0;
+        ct.array_size = n;
+
+    } else if (n > ct.array_size) {
+        return luaL_error(L, "too many initializers");
+    }
+
+    kind = num_kind(&ct);
+    if (kind < 0) {
+        push_type_name(L, 3, &ct);
+        return luaL_error(L, "expected an array of numbers type, got %s", lua_tostring(L, -1));
+    }
+
+    p = (char*) push_cdata(L, 3, &ct);
+
+#define FROM_TABLE(TYPE, TO, LUATYPE, EXPECTED)                             \
+    for (i = 0; i < n; i++) {                                               \
+        int isnum;                                                          \
+        LUATYPE v;                                                          \
+        lua_rawgeti(L, 2, (lua_Integer) i + 1);                             \
+        v = TO(L, -1, &isnum);                                              \
+        if (!isnum) {                                                       \
+            return luaL_error(L, "bad element #%d (%s expected, got %s)",   \
+                              (int) i + 1, EXPECTED, luaL_typename(L, -1)); \
+        }                                                                   \
+        ((TYPE*) p)[i] = (TYPE) v;                                          \
+        lua_pop(L, 1);                                                      \
+    }                                                                       \
+    break;
+
+    switch (kind) {
+    case NUM_INT8: FROM_TABLE(int8_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_UINT8: FROM_TABLE(uint8_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_INT16: FROM_TABLE(int16_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_UINT16: FROM_TABLE(uint16_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_INT32: FROM_TABLE(int32_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_UINT32: FROM_TABLE(uint32_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_INT64: FROM_TABLE(int64_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_UINT64: FROM_TABLE(uint64_t, lua_tointegerx, lua_Integer, "integer")
+    case NUM_FLOAT: FROM_TABLE(float, lua_tonumberx, lua_Number, "number")
+    case NUM_DOUBLE: FROM_TABLE(double, lua_tonumberx, lua_Number, "number")
+    }
+
+#undef FROM_TABLE
+
+    return 1;
+}
+
+/* The ffi.convert kernels go through a chunk of doubles, which holds all the
+ * supported element types exactly. Each loop is over a single pair of types
+ * so that the compiler can vectorize it. */
+static void load_chunk(double* buf, const char* from, int kind, size_t n, double scale)
+{
+    size_t i;
+
+#define LOAD(TYPE)                                                          \
+    for (i = 0; i < n; i++) {                                               \
+        buf[i] = (double) ((const TYPE*) from)[i] * scale;                  \
+    }                                                                       \
+    break;
+
+    switch (kind) {
+    case NUM_INT8: LOAD(int8_t)
+    case NUM_UINT8: LOAD(uint8_t)
+    case NUM_INT16: LOAD(int16_t)
+    case NUM_UINT16: LOAD(uint16_t)
+    case NUM_INT32: LOAD(int32_t)
+    case NUM_UINT32: LOAD(uint32_t)
+    case NUM_FLOAT: LOAD(float)
+    case NUM_DOUBLE: LOAD(double)
+    }
+
+#undef LOAD
+}
+
+#ifdef HAVE_SSE2
+/* round_4 rounds and saturates 4 doubles to int32 as store_chunk does */
+static __m128i round_4(const double* p, __m128d min, __m128d max)
+{
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d a = _mm_loadu_pd(p);
+    __m128d b = _mm_loadu_pd(p + 2);
+
+    /* NaN to 0 */
+    a = _mm_and_pd(a, _mm_cmpord_pd(a, a));
+    b = _mm_and_pd(b, _mm_cmpord_pd(b, b));
+
+    a = _mm_min_pd(_mm_max_pd(a, min), max);
+    b = _mm_min_pd(_mm_max_pd(b, min), max);
+
+    /* add 0.5 with the sign of the value and truncate */
+    a = _mm_add_pd(a, _mm_or_pd(_mm_and_pd(a, sign), half));
+    b = _mm_add_pd(b, _mm_or_pd(_mm_and_pd(b, sign), half));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(a), _mm_cvttpd_epi32(b));
+}
+#endif
+
+/* integers are rounded to nearest and saturated, NaN gives 0 */
+static void store_chunk(char* to, const double* buf, int kind, size_t n)
+{
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    /* 8 elements at a time, a and b hold them as int32 for STORE8 */
+#define STORE_INT(TYPE, MIN, MAX, STORE8)                                   \
+    {                                                                       \
+        const __m128d min = _mm_set1_pd(MIN);                               \
+        const __m128d max = _mm_set1_pd(MAX);                               \
+        for (; i + 8 <= n; i += 8) {                                        \
+            __m128i a = round_4(buf + i, min, max);                         \
+            __m128i b = round_4(buf + i + 4, min, max);                     \
+            TYPE* t = (TYPE*) to + i;                                       \
+            STORE8;                                                         \
+        }                                                                   \
+    }                                                                       \
+    STORE_INT_TAIL(TYPE, MIN, MAX)
+#else
+#define STORE_INT(TYPE, MIN, MAX, STORE8) STORE_INT_TAIL(TYPE, MIN, MAX)
+#endif
+
+#define STORE_INT_TAIL(TYPE, MIN, MAX)                                      \
+    for (; i < n; i++) {                                                    \
+        double v = buf[i];                                                  \
+        v = v < MIN ? MIN : v;                                              \
+        v = v > MAX ? MAX : v;                                              \
+        v = v < 0 ? v - 0.5 : v + 0.5;                                      \
+        ((TYPE*) to)[i] = v == v ? (TYPE) v : 0;                            \
+    }                                                                       \
+    break;
+
+#define STORE_FLOAT(TYPE)                                                   \
+    for (i = 0; i < n; i++) {                                               \
+        ((TYPE*) to)[i] = (TYPE) buf[i];                                    \
+    }                                                                       \
+    break;
+
+    switch (kind) {
+    case NUM_INT8:
+        STORE_INT(int8_t, INT8_MIN, INT8_MAX,
+            _mm_storel_epi64((__m128i*) t, _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_setzero_si128())))
+    case NUM_UINT8:
+        STORE_INT(uint8_t, 0, UINT8_MAX,
+            _mm_storel_epi64((__m128i*) t, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_setzero_si128())))
+    case NUM_INT16:
+        STORE_INT(int16_t, INT16_MIN, INT16_MAX,
+            _mm_storeu_si128((__m128i*) t, _mm_packs_epi32(a, b)))
+    case NUM_UINT16:
+        /* SSE2 only has a signed 32 to 16 bit pack, so bias the values */
+        STORE_INT(uint16_t, 0, UINT16_MAX,
+            _mm_storeu_si128((__m128i*) t, _mm_xor_si128(_mm_set1_epi16((short) 0x8000),
+                _mm_packs_epi32(_mm_sub_epi32(a, _mm_set1_epi32(0x8000)), _mm_sub_epi32(b, _mm_set1_epi32(0x8000))))))
+    case NUM_INT32:
+        STORE_INT(int32_t, INT32_MIN, INT32_MAX,
+            _mm_storeu_si128((__m128i*) t, a); _mm_storeu_si128((__m128i*) t + 1, b))
+    case NUM_UINT32:
+        /* out of range for the int32 conversion */
+        STORE_INT_TAIL(uint32_t, 0, UINT32_MAX)
+    case NUM_FLOAT: STORE_FLOAT(float)
+    case NUM_DOUBLE: STORE_FLOAT(double)
+    }
+
+#undef STORE_INT
+#undef STORE_INT_TAIL
+#undef STORE_FLOAT
+}
+
+/* ffi.convert(to, from, n [, scale]) converts n elements between number
+ * arrays of different types, multiplying by scale (default 1) on the way.
+ * 64 bit integers are not supported. to and from may be the same array but
+ * must not otherwise overlap. */
+static int ffi_convert(lua_State* L)
+{
+    struct ctype tt, ft;
+    int tkind, fkind;
+    size_t i, n, tsz, fsz;
+    double scale;
+    double buf[CONVERT_CHUNK];
+    char *to, *from;
+
+    lua_settop(L, 4);
+    to = check_num_array(L, 1, &tt, &tkind);
+    from = check_num_array(L, 2, &ft, &fkind);
+    luaL_argcheck(L, luaL_checkinteger(L, 3) >= 0, 3, "negative element count");
+    n = (size_t) lua_tointeger(L, 3);
+    scale = luaL_optnumber(L, 4, 1);
+
+    if (tkind == NUM_INT64 || tkind == NUM_UINT64 || fkind == NUM_INT64 || fkind == NUM_UINT64) {
+        return luaL_error(L, "64 bit integer arrays can't be converted");
+    }
+
+    if (tt.const_mask & 2) {
+        return luaL_error(L, "can't set const data");
+    }
+
+    if ((tt.is_array && n > tt.array_size) || (ft.is_array && n > ft.array_size)) {
+        return luaL_error(L, "element count out of range");
+    }
+
+    tsz = tt.base_size;
+    fsz = ft.base_size;
+
+    for (i = 0; i < n; i += CONVERT_CHUNK) {
+        size_t num = (n - i < CONVERT_CHUNK) ? n - i : CONVERT_CHUNK;
+        load_chunk(buf, from + i * fsz, fkind, num, scale);
+        store_chunk(to + i * tsz, buf, tkind, num);
+    }
+
+    return 0;
+}
+
 static int ffi_abi(lua_State* L)
 {
     luaL_checkstring(L, 1);
@@ -2593,6 +3224,9 @@ static const luaL_Reg ffi_reg[] = {
     {"string", &ffi_string},
     {"copy", &ffi_copy},
     {"fill", &ffi_fill},
+    {"totable", &ffi_totable},
+    {"fromtable", &ffi_fromtable},
+    {"convert", &ffi_convert},
     {"abi", &ffi_abi},
     {"debug", &ffi_debug},
     {"i64", &ffi_i64},
@@ -2884,7 +3518,8 @@ LUA_API int luaopen_ffi(lua_State* L)
     lua_newtable(L);
     push_upval(L, &callbacks_key);
     push_upval(L, &gc_key);
-    setup_mt(L, cdata_mt, 2);
+    lua_pushvalue(L, -3); /* for the metatable check in find_member */
+    setup_mt(L, cdata_mt, 3);
     set_upval(L, &cdata_mt_key);
 
     lua_newtable(L);
@@ -2893,6 +3528,8 @@ LUA_API int luaopen_ffi(lua_State* L)
     lua_newtable(L);
     set_upval(L, &types_key);
 
+    clear_ctype_cache(L);
+
     lua_newtable(L);
     set_upval(L, &functions_key);
 
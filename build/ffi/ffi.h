@@ -333,13 +333,16 @@ struct ctype {
     unsigned is_unsigned : 1;
 };
 
+/* cdata live in Lua userdata, which is only aligned for a double or a
+ * pointer. Asking for more lets the compiler use aligned vector loads on
+ * the header, which fault at -O3. */
 #ifdef _MSC_VER
-__declspec(align(16))
+__declspec(align(8))
 #endif
 struct cdata {
     const struct ctype type
 #ifdef __GNUC__
-      __attribute__ ((aligned(16)))
+      __attribute__ ((aligned(8)))
 #endif
       ;
 };
@@ -391,6 +394,8 @@ void set_defined(lua_State* L, int ct_usr, struct ctype* ct);
 struct ctype* push_ctype(lua_State* L, int ct_usr, const struct ctype* ct);
 void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct); /* called from asm */
 void check_ctype(lua_State* L, int idx, struct ctype* ct);
+void clear_ctype_cache(lua_State* L);
+void set_member_table(lua_State* L, int ct_usr);
 void* to_cdata(lua_State* L, int idx, struct ctype* ct);
 void* check_cdata(lua_State* L, int idx, struct ctype* ct);
 size_t ctype_size(lua_State* L, const struct ctype* ct);
@@ -834,6 +834,7 @@ static int parse_record(lua_State* L, struct parser* P, struct ctype* ct)
         calculate_struct_offsets(L, P, -2, ct, -1);
         assert(lua_gettop(L) == top + 2 && lua_istable(L, -1));
         lua_pop(L, 1);
+        set_member_table(L, -1);
     }
 
     assert(lua_gettop(L) == top + 1 && lua_istable(L, -1));
@@ -2194,6 +2195,9 @@ int ffi_cdef(lua_State* L)
     P.prev = P.next = luaL_checkstring(L, 1);
     P.align_mask = DEFAULT_ALIGN_MASK;
 
+    /* cached type strings may resolve differently with the new declarations */
+    clear_ctype_cache(L);
+
     if (parse_root(L, &P) == PRAGMA_POP) {
         luaL_error(L, "pragma pop without an associated push on line %d", P.line);
     }
@@ -0,0 +1,380 @@
+-- plain assert tests for the ffi module, run from this directory:
+--   lua test.lua
+
+local ffi = require "ffi"
+
+local function deepeq(x, y)
+    if type(x) ~= "table" or type(y) ~= "table" then return x == y end
+    for k, v in pairs(x) do
+        if not deepeq(v, y[k]) then return false end
+    end
+    for k in pairs(y) do
+        if x[k] == nil then return false end
+    end
+    return true
+end
+
+
+print("testing type string cache")
+
+-- a typedef changed by ffi.cdef is seen by every entry point
+ffi.cdef [[typedef int cache_t;]]
+assert(ffi.sizeof("cache_t") == 4)
+assert(ffi.sizeof("cache_t[2]") == 8)
+local c = ffi.new("cache_t[1]")
+ffi.cdef [[typedef short cache_t;]]
+assert(ffi.sizeof("cache_t") == 2)
+assert(ffi.sizeof("cache_t[2]") == 4)
+assert(ffi.sizeof(ffi.new("cache_t[1]")) == 2)
+assert(ffi.sizeof(c) == 4)
+assert(ffi.istype("cache_t", ffi.new("short")))
+assert(not ffi.istype("cache_t", ffi.new("int")))
+
+-- a struct looked up while incomplete picks up its definition
+ffi.cdef [[struct cache_s;]]
+assert(not pcall(ffi.sizeof, "struct cache_s"))
+assert(not pcall(ffi.new, "struct cache_s"))
+local sp = ffi.typeof("struct cache_s*")
+ffi.cdef [[struct cache_s { int a; double b; };]]
+assert(ffi.sizeof("struct cache_s") == 16)
+local s = ffi.new("struct cache_s", 3, 1.5)
+assert(s.a == 3 and s.b == 1.5)
+assert(ffi.cast(sp, s).b == 1.5)
+assert(ffi.cast("struct cache_s*", s).a == 3)
+assert(not pcall(ffi.cdef, [[struct cache_s { char c; };]]))
+assert(ffi.sizeof("struct cache_s") == 16)
+
+-- metatypes and typedefs added later apply to cached strings
+ffi.cdef [[struct cache_m { int x; };]]
+local m1 = ffi.new("struct cache_m", 1)
+ffi.metatype("struct cache_m", {__index = {get = function (self) return self.x end}})
+assert(ffi.new("struct cache_m", 2):get() == 2)
+assert(m1:get() == 1)
+ffi.cdef [[typedef struct cache_m cache_m_t;]]
+assert(ffi.new("cache_m_t", 3):get() == 3)
+
+-- enum constants used in array sizes follow their latest value
+ffi.cdef [[enum cache_e { CACHE_A = 1, CACHE_B = 2 };]]
+assert(ffi.sizeof("char[CACHE_B]") == 2)
+assert(ffi.sizeof("char[CACHE_B]") == 2)
+ffi.cdef [[enum cache_e2 { CACHE_B = 5 };]]
+assert(ffi.sizeof("char[CACHE_B]") == 5)
+ffi.cdef [[static const int CACHE_N = 7;]]
+assert(ffi.sizeof("short[CACHE_N]") == 14)
+assert(ffi.sizeof("short[CACHE_N]") == 14)
+
+-- strings declaring a type inline are parsed every time
+assert(ffi.sizeof("struct {int x; int y;}") == 8)
+assert(ffi.sizeof("struct {int x; int y;}") == 8)
+assert(ffi.sizeof("struct {int x; int y; int z;}") == 12)
+assert(ffi.sizeof("struct cache_in {int x;}") == 4)
+assert(ffi.sizeof("struct cache_in") == 4)
+assert(not pcall(ffi.sizeof, "struct cache_in {char x[3];}"))
+assert(ffi.sizeof("struct cache_in") == 4)
+assert(ffi.sizeof("union {int x; double y;}") == 8)
+assert(ffi.sizeof("enum {CACHE_X = 9}") == 4)
+assert(ffi.sizeof("char[CACHE_X]") == 9)
+
+-- variable length arrays take their size per call
+assert(ffi.sizeof("int[?]", 10) == 40)
+assert(ffi.sizeof("int[?]", 3) == 12)
+assert(ffi.sizeof(ffi.new("int[?]", 5)) == 20)
+
+-- generated strings past the 512 entry limit reset the cache and still
+-- resolve, as do the strings cached before the reset
+for round = 1, 2 do
+    for i = 1, 1500 do
+        assert(ffi.sizeof("char[" .. i .. "]") == i)
+    end
+    assert(ffi.sizeof("cache_t") == 2)
+    assert(ffi.sizeof("struct cache_s") == 16)
+    assert(ffi.new("struct cache_m", round):get() == round)
+end
+ffi.cdef [[typedef double cache_t;]]
+assert(ffi.sizeof("cache_t") == 8)
+
+-- errors are not cached as types
+for _ = 1, 3 do
+    assert(not pcall(ffi.new, "cache_unknown_t"))
+end
+ffi.cdef [[typedef char cache_unknown_t;]]
+assert(ffi.sizeof("cache_unknown_t") == 1)
+assert(not pcall(ffi.new, 12))
+
+
+print("testing struct member access")
+
+ffi.cdef [[
+enum member_e { MEMBER_A = 1, MEMBER_B = 2 };
+struct member_s {
+    int8_t i8; uint8_t u8; int16_t i16; uint16_t u16;
+    int32_t i32; uint32_t u32; bool b; enum member_e e;
+    float f; double d; const int ci;
+    int64_t i64; uint64_t u64; int arr[2]; struct member_s* next;
+    struct { int na; double nb; };
+    union { int ua; float uf; };
+    struct { short x, y; } pt;
+    int bits : 3;
+};
+union member_u { uint32_t u; float f; uint8_t b; };
+]]
+
+local scalars = {
+    i8 = "int8_t", u8 = "uint8_t", i16 = "int16_t", u16 = "uint16_t",
+    i32 = "int32_t", u32 = "uint32_t", b = "bool", f = "float", d = "double",
+}
+local values = {
+    0, 1, -1, 127, 128, 255, 256, -128, -129, 32767, 32768, 65535, 65536,
+    -32769, 0x7fffffff, 0x80000000, 0xffffffff, 0x100000000, -0x80000000,
+    math.maxinteger, math.mininteger, 0.5, 1.5, -1.5, 0.1, true, false,
+}
+
+-- every scalar member reads and writes like an array element of its type
+local s = ffi.new("struct member_s")
+for name, ctype in pairs(scalars) do
+    local a = ffi.new(ctype .. "[1]")
+    for _, v in ipairs(values) do
+        local ok1 = pcall(function () s[name] = v end)
+        local ok2 = pcall(function () a[0] = v end)
+        assert(ok1 == ok2, name)
+        if ok1 then
+            assert(s[name] == a[0], name)
+            assert(math.type(s[name]) == math.type(a[0]), name)
+        end
+    end
+end
+s.i8 = 200
+assert(s.i8 == -56)
+s.u8 = -1
+assert(s.u8 == 255)
+s.u16 = -1
+assert(s.u16 == 65535)
+s.i16 = 0x8000
+assert(s.i16 == -32768)
+s.u32 = -1
+assert(s.u32 == 0xffffffff)
+s.i32 = 0x80000000
+assert(s.i32 == -0x80000000)
+s.b = true
+assert(s.b == true)
+s.b = 0
+assert(s.b == false)
+s.f = 0.1
+assert(s.f ~= 0.1 and math.abs(s.f - 0.1) < 1e-7)
+s.d = 0.1
+assert(s.d == 0.1)
+
+-- enums take numbers on the fast path and names on the normal one
+s.e = 2
+assert(s.e == 2)
+s.e = "MEMBER_A"
+assert(s.e == 1)
+
+-- const members refuse assignment
+local ok, err = pcall(function () s.ci = 1 end)
+assert(not ok and err:find("can't set const data"))
+assert(s.ci == 0)
+
+-- pointers to the struct and references see the same memory
+local p = ffi.cast("struct member_s*", s)
+p.i32 = 9
+assert(s.i32 == 9 and p.i32 == 9)
+p.d = 2.5
+assert(s.d == 2.5)
+local arr = ffi.new("struct member_s[2]")
+local r = arr[1]
+r.u16 = 65535
+r.f = 1.5
+assert(arr[1].u16 == 65535 and arr[1].f == 1.5 and arr[0].u16 == 0)
+local pp = ffi.new("struct member_s*[1]")
+pp[0] = p
+assert(pp[0].i32 == 9)
+pp[0].i32 = 10
+assert(s.i32 == 10)
+s.next = s
+assert(s.next.next.i32 == 10)
+
+-- anonymous struct and union members and unions themselves
+s.na, s.nb, s.ua = 5, 2.5, 7
+assert(s.na == 5 and s.nb == 2.5 and s.ua == 7)
+local raw = ffi.cast("char*", s)
+assert(ffi.cast("int*", raw + ffi.offsetof("struct member_s", "na"))[0] == 5)
+assert(ffi.cast("double*", raw + ffi.offsetof("struct member_s", "nb"))[0] == 2.5)
+s.uf = 1
+assert(s.ua == 0x3f800000)
+local u = ffi.new("union member_u")
+u.f = 1
+assert(u.u == 0x3f800000 and u.b == 0)
+u.b = 0xff
+assert(u.u == 0x3f8000ff)
+
+-- everything else takes the normal path
+s.i64 = 5
+assert(tonumber(s.i64) == 5 and ffi.istype("int64_t", s.i64))
+s.u64 = -1
+assert(s.u64 == ffi.new("uint64_t", -1))
+s.arr[1] = 3
+assert(s.arr[1] == 3 and s.arr[0] == 0)
+s.pt.y = 4
+assert(s.pt.y == 4 and s.pt.x == 0)
+s.bits = 3
+assert(s.bits == 3)
+ok, err = pcall(function () s.nope = 1 end)
+assert(not ok and err:find("has no member nope"))
+ok, err = pcall(function () return s.nope end)
+assert(not ok and err:find("has no member nope"))
+assert(not pcall(function () s.i32 = "x" end))
+assert(not pcall(function () s.i32 = {} end))
+local long = ("m"):rep(50)
+ffi.cdef("struct member_long { int " .. long .. "; };")
+local l = ffi.new("struct member_long")
+l[long] = 6
+assert(l[long] == 6)
+
+-- metatype methods are found after the members
+ffi.cdef [[struct member_mt { int x; };]]
+ffi.metatype("struct member_mt", {__index = {twice = function (self) return self.x * 2 end}})
+local mt = ffi.new("struct member_mt", 21)
+assert(mt.x == 21 and mt:twice() == 42)
+
+
+print("testing bulk conversions")
+
+local limits = {
+    int8_t = {-128, 127}, uint8_t = {0, 255},
+    int16_t = {-32768, 32767}, uint16_t = {0, 65535},
+    int32_t = {-0x80000000, 0x7fffffff}, uint32_t = {0, 0xffffffff},
+}
+
+-- what ffi.convert stores in an integer element: rounded half away from
+-- zero, saturated, and NaN as 0
+local function saturate(v, lo, hi)
+    if v ~= v then return 0 end
+    v = math.max(lo, math.min(hi, v))
+    v = v < 0 and v - 0.5 or v + 0.5
+    return v < 0 and math.ceil(v) or math.floor(v)
+end
+
+local seed = 7
+local function rand(n)
+    seed = (seed * 1103515245 + 12345) % 0x80000000
+    return seed % n
+end
+local values = {0.5, -0.5, 1.5, -1.5, 2.5, -2.5, 0 / 0, 1 / 0, -1 / 0, 127.5,
+                -128.5, 255.5, 32767.5, -32768.5, 65535.5, 2147483647.5,
+                -2147483648.5, 4294967295.5, 1e300, -1e300}
+for i = #values + 1, 999 do
+    local r = rand(5)
+    if r == 0 then values[i] = (rand(200000) - 100000) / 7
+    elseif r == 1 then values[i] = rand(1000) - 500 + 0.5
+    elseif r == 2 then values[i] = rand(0x80000000) * (rand(3) - 1) * 3.0
+    elseif r == 3 then values[i] = ({0 / 0, 1 / 0, -1 / 0})[rand(3) + 1]
+    else values[i] = rand(70000) - 35000
+    end
+end
+local src = ffi.new("double[?]", #values)
+for i = 1, #values do src[i - 1] = values[i] end
+
+-- counts around the 8 element vector loop and the 256 element chunks, so
+-- both the vector loop and the scalar tail are covered
+for ctype, r in pairs(limits) do
+    for _, n in ipairs{0, 1, 7, 8, 9, 15, 16, 17, 255, 256, 257, 999} do
+        local dst = ffi.new(ctype .. "[?]", #values)
+        ffi.convert(dst, src, n)
+        for i = 0, #values - 1 do
+            local want = i < n and saturate(values[i + 1], r[1], r[2]) or 0
+            assert(tonumber(dst[i]) == want, ctype .. " " .. n .. " " .. i)
+        end
+    end
+end
+
+-- float and double destinations are plain casts
+local f = ffi.new("float[?]", #values)
+local one = ffi.new("float[1]")
+ffi.convert(f, src, #values)
+for i = 0, #values - 1 do
+    one[0] = values[i + 1]
+    assert(f[i] == one[0] or (f[i] ~= f[i] and one[0] ~= one[0]))
+end
+local d = ffi.new("double[?]", #values)
+ffi.convert(d, f, #values)
+for i = 0, #values - 1 do
+    assert(d[i] == f[i] or (d[i] ~= d[i] and f[i] ~= f[i]))
+end
+
+-- the scale applies before rounding, in both directions
+local pcm = ffi.fromtable("float", {1, -1, 0.5, -0.25, 2, 0 / 0})
+local s16 = ffi.new("int16_t[6]")
+ffi.convert(s16, pcm, 6, 32767)
+assert(deepeq(ffi.totable(s16), {32767, -32767, 16384, -8192, 32767, 0}))
+local back = ffi.new("float[6]")
+ffi.convert(back, s16, 6, 1 / 32767)
+assert(back[0] == 1 and back[1] == -1)
+ffi.convert(s16, s16, 6, 2)
+assert(deepeq(ffi.totable(s16), {32767, -32768, 32767, -16384, 32767, 0}))
+
+-- totable and fromtable keep values and types
+local t = ffi.totable(ffi.fromtable("uint8_t", {0, 255, 7}))
+assert(deepeq(t, {0, 255, 7}) and math.type(t[1]) == "integer")
+t = ffi.totable(ffi.fromtable("float", {1, 0.5}))
+assert(deepeq(t, {1, 0.5}) and math.type(t[1]) == "float")
+assert(ffi.totable(ffi.fromtable("int64_t", {math.maxinteger}))[1] == math.maxinteger)
+assert(ffi.totable(ffi.fromtable("uint64_t", {-1}))[1] == -1)
+assert(ffi.sizeof(ffi.fromtable("double[?]", {1, 2, 3})) == 24)
+assert(ffi.sizeof(ffi.fromtable("double", {})) == 0)
+assert(deepeq(ffi.totable(ffi.fromtable("int[4]", {1, 2})), {1, 2, 0, 0}))
+local ok, err = pcall(ffi.fromtable, "int[2]", {1, 2, 3})
+assert(not ok and err:find("too many initializers"))
+ok, err = pcall(ffi.fromtable, "int", {1, 2.5})
+assert(not ok and err:find("bad element #2"))
+assert(not pcall(ffi.fromtable, "int", {1, "x"}))
+assert(not pcall(ffi.fromtable, "float", {{}}))
+assert(not pcall(ffi.fromtable, "int*", {1}))
+assert(not pcall(ffi.fromtable, "struct member_s", {}))
+
+-- counts are bounded by fixed size and variable length arrays, pointers
+-- need one
+local fixed = ffi.new("int[4]", 1, 2, 3, 4)
+assert(#ffi.totable(fixed) == 4 and #ffi.totable(fixed, 2) == 2)
+assert(#ffi.totable(fixed, 0) == 0)
+ok, err = pcall(ffi.totable, fixed, 5)
+assert(not ok and err:find("element count out of range"))
+local vla = ffi.new("int[?]", 3, {1, 2, 3})
+assert(deepeq(ffi.totable(vla), {1, 2, 3}))
+ok, err = pcall(ffi.totable, vla, 4)
+assert(not ok and err:find("element count out of range"))
+local ptr = ffi.cast("int*", fixed)
+assert(deepeq(ffi.totable(ptr, 3), {1, 2, 3}))
+ok, err = pcall(ffi.totable, ptr)
+assert(not ok and err:find("element count required"))
+assert(not pcall(ffi.totable, fixed, -1))
+local fl = ffi.new("float[?]", 5)
+ok, err = pcall(ffi.convert, fl, vla, 4)
+assert(not ok and err:find("element count out of range"))
+ok, err = pcall(ffi.convert, vla, fl, 5)
+assert(not ok and err:find("element count out of range"))
+ffi.convert(fl, vla, 3)
+assert(deepeq(ffi.totable(fl), {1, 2, 3, 0, 0}))
+ffi.convert(ffi.cast("float*", fl), ptr, 4)
+assert(deepeq(ffi.totable(fl), {1, 2, 3, 4, 0}))
+assert(not pcall(ffi.convert, fl, vla, -1))
+
+-- const destinations are refused, const sources are fine
+ok, err = pcall(ffi.convert, ffi.cast("const float*", fl), vla, 3)
+assert(not ok and err:find("can't set const data"))
+ok, err = pcall(ffi.convert, ffi.new("const float[3]"), vla, 3)
+assert(not ok and err:find("can't set const data"))
+ffi.convert(fl, ffi.cast("const int*", fixed), 2)
+
+-- 64 bit elements and non number arrays are refused
+ok, err = pcall(ffi.convert, ffi.new("int64_t[2]"), vla, 2)
+assert(not ok and err:find("64 bit"))
+ok, err = pcall(ffi.convert, fl, ffi.new("uint64_t[2]"), 2)
+assert(not ok and err:find("64 bit"))
+ok, err = pcall(ffi.totable, ffi.new("struct member_s[2]"))
+assert(not ok and err:find("expected a pointer to or array of numbers"))
+assert(not pcall(ffi.totable, ffi.new("int")))
+assert(not pcall(ffi.convert, fl, ffi.new("bool[2]"), 2))
+
+
+print("OK")
@@ -0,0 +1,257 @@
+#!/usr/bin/env lua
+
+-- Timings for common grammars over multi-MB subjects.
+-- usage: lua bench.lua [MB] [rounds]
+
+local m = require"lpeg"
+
+local MB = tonumber(arg and arg[1]) or 4
+local ROUNDS = tonumber(arg and arg[2]) or 5
+local SIZE = MB * 1024 * 1024
+
+
+local function fill (unit)
+  local n = math.ceil(SIZE / #unit)
+  return string.rep(unit, n)
+end
+
+
+local function benchf (name, f, size, check)
+  local best = math.huge
+  local res
+  for _ = 1, ROUNDS do
+    local t0 = os.clock()
+    res = f()
+    best = math.min(best, os.clock() - t0)
+  end
+  assert(check(res), name)
+  print(string.format("%-22s %6.1f MB  %8.4fs  %8.1f MB/s",
+                      name, size / 1048576, best, size / 1048576 / best))
+end
+
+
+local function bench (name, patt, subject, check)
+  benchf(name, function () return patt:match(subject) end, #subject, check)
+end
+
+
+-- CSV: quoted and plain fields, counting records
+local field = '"' * m.Cs(((m.P(1) - '"') + m.P'""' / '"')^0) * '"' +
+              m.C((1 - m.S',\n"')^0)
+local record = field * (',' * field)^0 * '\n'
+local csv = m.Cf(m.Cc(0) * (record / function () return 1 end)^0,
+                 function (a, b) return a + b end) * -1
+local row = 'alpha,1234567,"quoted, with comma",' .. string.rep("x", 40) ..
+            ',"say ""hi""",tail\n'
+local csvdata = fill(row)
+bench("csv records", csv, csvdata, function (n) return n == #csvdata / #row end)
+
+
+-- identifier lexing: words, numbers and punctuation
+local alpha = m.R("az", "AZ") + "_"
+local ident = alpha * (alpha + m.R"09")^0
+local number = m.R"09"^1
+local space = m.S" \t\r\n"^0
+local token = ident + number + m.S"+-*/=(){}[],.;:"
+local lexer = m.Cf(m.Cc(0) * (space * token * m.Cc(1))^0,
+                   function (a, b) return a + b end) * space * -1
+local src = "local some_identifier_name = another_module.function_name(arg1, 42)\n" ..
+            "    if long_condition_variable then return value_with_long_name end\n"
+bench("identifier lexing", lexer, fill(src), function (n) return n > 0 end)
+
+-- long identifiers only
+bench("long identifiers", (ident * " ")^0 * -1,
+      fill(string.rep("abcdefghij", 20) .. "_0123456789 "),
+      function (p) return p ~= nil end)
+
+
+-- whitespace skipping between rare tokens
+local ws = fill(string.rep(" ", 200) .. "\t\n" .. string.rep(" ", 300) .. "x")
+bench("whitespace skipping", (space * "x")^0 * -1, ws,
+      function (p) return p ~= nil end)
+
+-- single character run
+bench("char run", m.P"a"^0 * -1, fill("a"), function (p) return p ~= nil end)
+
+-- spans broken every few bytes (worst case for block scanning)
+bench("short spans", (m.R"az"^0 * " ")^0 * -1, fill("ab cde f ghij "),
+      function (p) return p ~= nil end)
+
+
+-- keyword recognition: a choice among a few dozen literals
+local kws = {"and", "break", "do", "else", "elseif", "end", "false", "for",
+             "function", "goto", "if", "in", "local", "nil", "not", "or",
+             "repeat", "return", "then", "true", "until", "while"}
+local kw = m.P(false)
+for _, w in ipairs(kws) do kw = kw + w end
+local kwtoken = kw * -(alpha + m.R"09") + ident + number + m.P(1)
+bench("keywords", m.Cf(m.Cc(0) * (space * kwtoken * m.Cc(1))^0,
+                       function (a, b) return a + b end) * space * -1,
+      fill(src), function (n) return n > 0 end)
+
+
+-- sensitive-word filter: masking any of 20k words in a text
+local seed = 1
+local function rand (n)
+  seed = (seed * 1103515245 + 12345) % 2147483648
+  return seed % n
+end
+local function word (min, max)
+  local t = {}
+  for i = 1, min + rand(max - min + 1) do
+    t[i] = string.char(97 + rand(26))
+  end
+  return table.concat(t)
+end
+local words = {}
+for i = 1, 20000 do words[i] = word(3, 8) end
+local function choice (i, j)  -- balanced, to avoid quadratic copying
+  if i == j then return m.P(words[i]) end
+  local k = math.floor((i + j) / 2)
+  return choice(i, k) + choice(k + 1, j)
+end
+local sensitive = choice(1, #words)
+local text = {}
+for i = 1, 500 do
+  text[i] = (i % 50 == 0) and words[rand(#words) + 1] or word(2, 10)
+end
+bench("sensitive words", m.Cs((sensitive / "***" + 1)^0),
+      fill(table.concat(text, " ") .. "\n"),
+      function (r) return r:find("***", 1, true) ~= nil end)
+
+
+-- searches in logs, against the equivalent grammar idioms
+local logline = "2024-05-01 12:00:00 INFO [worker-3] GET /api/items?page=2 " ..
+                "id=1234567 took 45ms\n"
+local log = fill(logline)
+local errline = "2024-05-01 12:00:01 ERROR [worker-1] timeout id=99\n"
+local logerr = log .. errline
+local errp = m.P"ERROR"
+benchf("find idiom", function ()
+  return m.match((1 - errp)^0 * m.Cp() * errp, logerr) end,
+  #logerr, function (i) return i == #log + 21 end)
+benchf("find", function () return m.find(errp, logerr) end,
+  #logerr, function (i) return i == #log + 21 end)
+
+local idp = "id=" * m.C(m.R"09"^1)
+local function count (it)
+  local n = 0
+  for _ in it do n = n + 1 end
+  return n
+end
+local nlines = #log / #logline
+benchf("gmatch idiom", function ()
+  return #m.match(m.Ct((idp + 1)^0), log) end,
+  #log, function (n) return n == nlines end)
+benchf("gmatch", function () return count(m.gmatch(idp, log)) end,
+  #log, function (n) return n == nlines end)
+
+local took = "took " * m.R"09"^1 * "ms"
+benchf("gsub idiom", function ()
+  return m.match(m.Cs((took / "took ?" + 1)^0), log) end,
+  #log, function (r) return #r == #log - 3 * nlines end)
+benchf("gsub", function () return (m.gsub(took, log, "took ?")) end,
+  #log, function (r) return #r == #log - 3 * nlines end)
+
+
+-- rule calls: expressions with and without memoization, and nested
+-- input for a grammar that retries each level three times
+local expr = m.P{"E", E = m.V"T" * (m.S"+-" * m.V"T")^0,
+                      T = "(" * m.V"E" * ")" + "n"}
+local exprdata = fill("(n+(n-n))-n+") .. "n"
+bench("expressions", expr * -1, exprdata, function (p) return p ~= nil end)
+m.setpackrat(4096)
+bench("expressions packrat", expr * -1, exprdata,
+      function (p) return p ~= nil end)
+m.setpackrat()
+local retry = m.P{"E", E = m.V"T" * "+" * m.V"E" + m.V"T" * "-" * m.V"E"
+                           + m.V"T",
+                       T = "(" * m.V"E" * ")" + "n"}
+local function timed (name, f, check)
+  local best = math.huge
+  for _ = 1, ROUNDS do
+    local t0 = os.clock()
+    assert(check(f()), name)
+    best = math.min(best, os.clock() - t0)
+  end
+  print(string.format("%-22s %8.4fs", name, best))
+end
+local nested = string.rep("(", 14) .. "n" .. string.rep(")", 14)
+local function nestmatch () return pcall(m.match, retry, nested) end
+m.setmaxstack(1000)
+timed("nested depth 14", nestmatch, function (ok, p) return p == 30 end)
+m.setpackrat(4096)
+timed("nested packrat", nestmatch, function (ok, p) return p == 30 end)
+m.setpackrat()
+m.setmaxsteps(1e6)
+timed("nested step limit", nestmatch, function (ok) return not ok end)
+m.setmaxsteps()
+
+-- many short subjects: lpeg.match in a loop against a matcher and
+-- a batch
+local names = {}
+for i = 1, 100000 do names[i] = word(4, 12) .. " " .. i end
+local namep = m.C(m.R"az"^1) * " " * (m.R"09"^1 / tonumber)
+local namem = namep:matcher()
+local nsize = #table.concat(names)
+local function lastword (t) return t == names[#names]:match("%a+") end
+benchf("short matches", function ()
+  local r
+  for i = 1, #names do r = m.match(namep, names[i]) end
+  return r end, nsize, lastword)
+benchf("short matcher", function ()
+  local r
+  for i = 1, #names do r = namem:match(names[i]) end
+  return r end, nsize, lastword)
+benchf("short match_all", function ()
+  local t = namem:match_all(names)
+  return t[#t] end, nsize, lastword)
+
+
+-- tokenizing into a table: a table capture against streaming, with
+-- the memory allocated during the match (collector stopped)
+local function benchmem (name, f, size, check)
+  local res, kb
+  benchf(name, function ()
+    collectgarbage(); collectgarbage("stop")
+    local k0 = collectgarbage("count")
+    res = f()
+    kb = collectgarbage("count") - k0
+    collectgarbage("restart")
+    return res
+  end, size, check)
+  print(string.format("%-22s %8.1f MB allocated", "", kb / 1024))
+end
+local tok = space * m.C(ident + number + m.S"+-*/=(){}[],.;:")
+local srcdata = fill(src)
+local ntok = #m.match(m.Ct(tok^0), srcdata)
+benchmem("tokens Ct", function () return m.match(m.Ct(tok^0), srcdata) end,
+  #srcdata, function (t) return #t == ntok end)
+benchmem("tokens stream", function ()
+  local t = {}
+  m.stream(tok^0, srcdata, t)
+  return t end,
+  #srcdata, function (t) return #t == ntok end)
+benchmem("tokens stream/count", function ()
+  local n = 0
+  m.stream(tok^0, srcdata, function () n = n + 1 end)
+  return n end,
+  #srcdata, function (n) return n == ntok end)
+
+
+-- startup: building and compiling the sensitive-word filter against
+-- loading it from a dump
+local function startup (name, f)
+  local best = math.huge
+  for _ = 1, ROUNDS do
+    local t0 = os.clock()
+    f():match("")  -- force compilation
+    best = math.min(best, os.clock() - t0)
+  end
+  print(string.format("%-22s %8.4fs", name, best))
+end
+local filter = function () return m.Cs((choice(1, #words) / "***" + 1)^0) end
+local dumped = m.dump(filter())
+startup("filter build", filter)
+startup("filter undump", function () return m.undump(dumped) end)
+print(string.format("%-22s %8.1f KB", "filter dump size", #dumped / 1024))
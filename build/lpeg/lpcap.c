@@ -511,12 +511,10 @@ static int pushcapture (CapState *cs) {
 /*
 ** Prepare a CapState structure and traverse the entire list of
 ** captures in the stack pushing its results. 's' is the subject
-** string, 'r' is the final position of the match, and 'ptop' 
-** the index in the stack where some useful values were pushed.
-** Returns the number of results pushed. (If the list produces no
-** results, push the final position of the match.)
+** string and 'ptop' the index in the stack where some useful values
+** were pushed. Returns the number of results pushed.
 */
-int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
+int capturevalues (lua_State *L, const char *s, int ptop) {
   Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
   int n = 0;
   if (!isclosecap(capture)) {  /* is there any capture? */
@@ -527,6 +525,16 @@ int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
       n += pushcapture(&cs);
     } while (!isclosecap(cs.cap));
   }
+  return n;
+}
+
+
+/*
+** Push the results of a match; 'r' is its final position. (If the
+** list of captures produces no results, push that position.)
+*/
+int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
+  int n = capturevalues(L, s, ptop);
   if (n == 0) {  /* no capture values? */
     lua_pushinteger(L, r - s + 1);  /* return only end position */
     n = 1;
@@ -535,3 +543,59 @@ int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
 }
 
 
+/*
+** Number of entries of the top-level capture at 'cap' if it is
+** complete among the 'n' entries of the list; 0 otherwise
+*/
+static int capentries (Capture *cap, int n) {
+  int i, depth = 0;
+  if (isfullcap(cap)) return 1;
+  for (i = 1; i < n; i++) {  /* open capture: look for its close */
+    if (!isfullcap(cap + i)) depth++;  /* nested open capture */
+    else if (isclosecap(cap + i) && depth-- == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+
+/*
+** Evaluate the complete top-level captures at the start of the
+** first 'n' entries of 'capture' and deliver their values to the
+** sink at stack index 'sink': a table gets them appended, a function
+** is called with the values of each capture. Returns the number of
+** entries consumed.
+*/
+int streamcaptures (lua_State *L, const char *s, Capture *capture, int n,
+                    int ptop, int sink) {
+  CapState cs;
+  int k = 0;
+  int istable = lua_istable(L, sink);
+  int len = istable ? (int)lua_objlen(L, sink) : 0;
+  cs.ocap = capture; cs.L = L;
+  cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+  for (;;) {
+    int nv, size;
+    if (k >= n || isclosecap(capture + k)) break;
+    size = capentries(capture + k, n - k);
+    if (size == 0) break;  /* first capture not complete yet */
+    cs.cap = capture + k;
+    nv = pushcapture(&cs);
+    assert(cs.cap == capture + k + size);
+    k += size;
+    if (istable) {
+      int i;
+      len += nv;
+      for (i = 0; i < nv; i++)  /* values are popped from the last one */
+        lua_rawseti(L, sink, len - i);
+    }
+    else if (nv > 0) {
+      lua_pushvalue(L, sink);
+      lua_insert(L, -(nv + 1));
+      lua_call(L, nv, 0);
+    }
+  }
+  return k;
+}
+
+
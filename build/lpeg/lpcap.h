@@ -35,8 +35,11 @@ typedef struct CapState {
 
 
 int runtimecap (CapState *cs, Capture *close, const char *s, int *rem);
+int capturevalues (lua_State *L, const char *s, int ptop);
 int getcaptures (lua_State *L, const char *s, const char *r, int ptop);
 int finddyncap (Capture *cap, Capture *last);
+int streamcaptures (lua_State *L, const char *s, Capture *capture, int n,
+                    int ptop, int sink);
 
 #endif
 
@@ -4,6 +4,7 @@
 */
 
 #include <limits.h>
+#include <string.h>
 
 
 #include "lua.h"
@@ -402,6 +403,8 @@ static int needfollow (TTree *tree) {
 int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
     case ISet: case ISpan: return CHARSETINSTSIZE;
+    case IString: return instsize(i->i.aux);
+    case ITrie: return (i + 1)->offset;
     case ITestSet: return CHARSETINSTSIZE + 1;
     case ITestChar: case ITestAny: case IChoice: case IJmp: 
     case ICall: case IOpenCall: case ICommit: case IPartialCommit:
@@ -586,6 +589,246 @@ static int codetestset (CompileState *compst, Charset *cs, int e) {
 }
 
 
+/*
+** {======================================================
+** Literal strings
+** =======================================================
+*/
+
+/* maximum length of a literal coded as a single instruction */
+#define MAXLITERAL	MAXAUX
+
+/* minimum number of alternatives to code a choice as a trie */
+#define MINTRIE		4
+
+
+/*
+** If 'tree' is a literal string (a sequence of single characters),
+** append it to 'buff' (which already has 'len' chars) and return
+** the new length; otherwise, or if it does not fit in MAXLITERAL,
+** return -1.
+*/
+static int getliteral (TTree *tree, byte *buff, int len) {
+ tailcall:
+  switch (tree->tag) {
+    case TChar: {
+      if (len >= MAXLITERAL) return -1;
+      buff[len] = tree->u.n;
+      return len + 1;
+    }
+    case TTrue: return len;
+    case TSeq: {
+      len = getliteral(sib1(tree), buff, len);
+      if (len < 0) return -1;
+      tree = sib2(tree); goto tailcall;
+    }
+    default: return -1;
+  }
+}
+
+
+/*
+** Add an IString instruction (or an IChar for a single char)
+*/
+static void addstring (CompileState *compst, const byte *buff, int n) {
+  if (n == 1)
+    addinstruction(compst, IChar, buff[0]);
+  else {
+    int i = addinstruction(compst, IString, n);
+    int k;
+    for (k = 1; k < (int)instsize(n); k++)
+      nextinstruction(compst);  /* space for the string */
+    memcpy(getinstr(compst, i + 1).buff, buff, n);
+  }
+}
+
+
+/*
+** Code the literal prefix of sequence 'tree' as a single IString
+** (using an IAny for its first char when there is an equivalent
+** test dominating it). Return the rest of the sequence still to
+** be coded (NULL if none), or 'tree' itself if its literal prefix
+** is too short to be worth it.
+*/
+static TTree *codestring (CompileState *compst, TTree *tree, int tt) {
+  byte buff[MAXLITERAL];
+  int len = 0;
+  int i = 0;
+  TTree *rest = tree;
+  while (rest->tag == TSeq) {
+    int l = getliteral(sib1(rest), buff, len);
+    if (l < 0) break;
+    len = l; rest = sib2(rest);
+  }
+  if (rest->tag != TSeq) {
+    int l = getliteral(rest, buff, len);
+    if (l >= 0) { len = l; rest = NULL; }
+  }
+  if (len < 2) return tree;
+  if (tt >= 0 && getinstr(compst, tt).i.code == ITestChar &&
+                 getinstr(compst, tt).i.aux == buff[0]) {
+    addinstruction(compst, IAny, 0);
+    i = 1;
+  }
+  addstring(compst, buff + i, len - i);
+  return rest;
+}
+
+
+/*
+** Count the alternatives of a choice made only of literal strings
+** (adding their total length to 'nchars'); return 0 if any of them
+** is not a literal.
+*/
+static int literalalts (TTree *tree, int *nchars) {
+  if (tree->tag == TChoice) {
+    int n1 = literalalts(sib1(tree), nchars);
+    int n2 = (n1 == 0) ? 0 : literalalts(sib2(tree), nchars);
+    return (n2 == 0) ? 0 : n1 + n2;
+  }
+  else {
+    byte buff[MAXLITERAL];
+    int len = getliteral(tree, buff, 0);
+    if (len < 0) return 0;
+    *nchars += len;
+    return 1;
+  }
+}
+
+
+typedef struct TrieNode {
+  int term;  /* priority of alternative ending here */
+  int min;  /* minimum priority of alternatives below this node */
+  int child;  /* first child (0 if none); children sorted by label */
+  int next;  /* next sibling */
+  int parent;
+  int pos;  /* position of node in final code */
+  byte c;  /* label */
+} TrieNode;
+
+
+/*
+** Add the alternatives of choice 'tree' to the trie, in order
+*/
+static int trieadd (TTree *tree, TrieNode *nodes, int *nnodes, int prio) {
+  if (tree->tag == TChoice) {
+    prio = trieadd(sib1(tree), nodes, nnodes, prio);
+    return trieadd(sib2(tree), nodes, nnodes, prio);
+  }
+  else {
+    byte buff[MAXLITERAL];
+    int len = getliteral(tree, buff, 0);
+    int k = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+      int *link = &nodes[k].child;
+      while (*link != 0 && nodes[*link].c < buff[i])
+        link = &nodes[*link].next;
+      if (*link == 0 || nodes[*link].c != buff[i]) {  /* new node? */
+        int n = (*nnodes)++;
+        nodes[n].term = nodes[n].min = TRIENOTERM;
+        nodes[n].child = 0; nodes[n].next = *link;
+        nodes[n].parent = k; nodes[n].c = buff[i];
+        *link = n;
+      }
+      k = *link;
+    }
+    if (nodes[k].term == TRIENOTERM)  /* first occurrence wins */
+      nodes[k].term = prio;
+    return prio + 1;
+  }
+}
+
+
+/*
+** Size of a trie node; sets 'dense' to whether its children
+** should be indexed directly by label
+*/
+static int trienodesize (const TrieNode *nodes, const TrieNode *node,
+                         int *nentries, int *dense) {
+  int n = 0;
+  int k;
+  int lo = 0, hi = 0;
+  for (k = node->child; k != 0; k = nodes[k].next) {
+    if (n++ == 0) lo = nodes[k].c;
+    hi = nodes[k].c;
+  }
+  *dense = (n >= 4 && hi - lo + 1 <= 2 * n);
+  if (*dense) {
+    *nentries = hi - lo + 1;
+    return 3 + *nentries;
+  }
+  else {
+    *nentries = n;
+    return 3 + (n + sizeof(Instruction) - 1) / sizeof(Instruction) + n;
+  }
+}
+
+
+/*
+** Code a choice among literal strings as an ITrie, which picks
+** in one pass the first alternative (in the choice order) that
+** matches. Return false if the choice does not qualify.
+*/
+static int codetrie (CompileState *compst, TTree *tree) {
+  int nchars = 0;
+  int nalts = literalalts(tree, &nchars);
+  int nnodes = 1;
+  int size = 0;
+  int i, k;
+  TrieNode *nodes;
+  Instruction *base;
+  if (nalts < MINTRIE)
+    return 0;
+  nodes = (TrieNode *)lua_newuserdata(compst->L,
+                                       (nchars + 1) * sizeof(TrieNode));
+  nodes[0].term = nodes[0].min = TRIENOTERM;
+  nodes[0].child = nodes[0].next = 0;
+  trieadd(tree, nodes, &nnodes, 0);
+  for (k = nnodes - 1; k > 0; k--) {  /* children come after parents */
+    TrieNode *parent = &nodes[nodes[k].parent];
+    int m = (nodes[k].term < nodes[k].min) ? nodes[k].term : nodes[k].min;
+    if (m < parent->min) parent->min = m;
+  }
+  for (k = 0; k < nnodes; k++) {
+    int nentries, dense;
+    nodes[k].pos = size;
+    size += trienodesize(nodes, &nodes[k], &nentries, &dense);
+  }
+  i = addinstruction(compst, ITrie, 0);
+  for (k = 0; k <= size; k++)
+    nextinstruction(compst);  /* space for size and nodes */
+  getinstr(compst, i + 1).offset = size + 2;
+  base = &getinstr(compst, i + 2);
+  for (k = 0; k < nnodes; k++) {
+    Instruction *node = base + nodes[k].pos;
+    Instruction *children;
+    int nentries, dense, c, j;
+    trienodesize(nodes, &nodes[k], &nentries, &dense);
+    trieterm(node) = nodes[k].term;
+    triemin(node) = nodes[k].min;
+    triehead(node).code = (nodes[k].child != 0) ? nodes[nodes[k].child].c : 0;
+    triehead(node).aux = dense;
+    triehead(node).key = nentries;
+    children = triechildren(node);
+    if (dense)
+      for (j = 0; j < nentries; j++) children[j].offset = 0;
+    for (c = nodes[k].child, j = 0; c != 0; c = nodes[c].next, j++) {
+      if (dense)
+        children[nodes[c].c - triehead(node).code].offset = nodes[c].pos;
+      else {
+        trielabels(node)[j] = nodes[c].c;
+        children[j].offset = nodes[c].pos;
+      }
+    }
+  }
+  lua_pop(compst->L, 1);  /* remove trie nodes */
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Find the final destination of a sequence of jumps
 */
@@ -874,7 +1117,11 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
     case TSet: codecharset(compst, treebuffer(tree), tt); break;
     case TTrue: break;
     case TFalse: addinstruction(compst, IFail, 0); break;
-    case TChoice: codechoice(compst, sib1(tree), sib2(tree), opt, fl); break;
+    case TChoice: {
+      if (!codetrie(compst, tree))
+        codechoice(compst, sib1(tree), sib2(tree), opt, fl);
+      break;
+    }
     case TRep: coderep(compst, sib1(tree), opt, fl); break;
     case TBehind: codebehind(compst, tree); break;
     case TNot: codenot(compst, sib1(tree)); break;
@@ -884,6 +1131,11 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
     case TGrammar: codegrammar(compst, tree); break;
     case TCall: codecall(compst, tree); break;
     case TSeq: {
+      TTree *rest = codestring(compst, tree, tt);
+      if (rest != tree) {  /* coded a literal prefix? */
+        if (rest == NULL) break;
+        tree = rest; tt = NOINST; goto tailcall;
+      }
       tt = codeseq1(compst, sib1(tree), sib2(tree), tt, fl);  /* code 'p1' */
       /* codegen(compst, p2, opt, tt, fl); */
       tree = sib2(tree); goto tailcall;
@@ -906,6 +1158,7 @@ static void peephole (CompileState *compst) {
   Instruction *code = compst->p->code;
   int i;
   for (i = 0; i < compst->ncode; i += sizei(&code[i])) {
+   redo:
     switch (code[i].i.code) {
       case IChoice: case ICall: case ICommit: case IPartialCommit:
       case IBackCommit: case ITestChar: case ITestSet:
@@ -927,8 +1180,7 @@ static void peephole (CompileState *compst) {
             int fft = finallabel(code, ft);
             code[i] = code[ft];  /* jump becomes that instruction... */
             jumptothere(compst, i, fft);  /* but must correct its offset */
-            i--;  /* reoptimize its label */
-            break;
+            goto redo;  /* reoptimize its label */
           }
           default: {
             jumptothere(compst, i, ft);  /* optimize label */
@@ -944,6 +1196,30 @@ static void peephole (CompileState *compst) {
 }
 
 
+/*
+** Find how searches can skip positions that cannot start a match:
+** only when every match must begin with a char from the first set
+** (no empty matches, no match-time captures before the first char)
+*/
+static void setfind (Pattern *p) {
+  Charset cs;
+  int c = 0;
+  p->findkind = FINDANY;
+  if (getfirst(p->tree, fullset, &cs) != 0)
+    return;  /* first set cannot be used */
+  switch (charsettype(cs.cs, &c)) {
+    case IAny: break;  /* any char may start a match */
+    case IChar: p->findkind = FINDCHAR; p->findchar = c; break;
+    default: {  /* ISet or IFail (no position can start a match) */
+      p->findkind = FINDSET;
+      p->findset = cs;
+      cs_complement(&p->findset);
+      break;
+    }
+  }
+}
+
+
 /*
 ** Compile a pattern
 */
@@ -955,6 +1231,7 @@ Instruction *compile (lua_State *L, Pattern *p) {
   addinstruction(&compst, IEnd, 0);
   reallocprog(L, p, compst.ncode);  /* set final size */
   peephole(&compst);
+  setfind(p);
   return p->code;
 }
 
@@ -56,11 +56,12 @@ static void printinst (const Instruction *op, const Instruction *p) {
   const char *const names[] = {
     "any", "char", "set",
     "testany", "testchar", "testset",
-    "span", "behind",
+    "span", "string", "trie", "behind",
     "ret", "end",
     "choice", "jmp", "call", "open_call",
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
-     "fullcapture", "opencapture", "closecapture", "closeruntime"
+     "fullcapture", "opencapture", "closecapture", "closeruntime",
+    "memoret", "memofail"
   };
   printf("%02ld: %s ", (long)(p - op), names[p->i.code]);
   switch ((Opcode)p->i.code) {
@@ -94,6 +95,14 @@ static void printinst (const Instruction *op, const Instruction *p) {
       printcharset((p+1)->buff);
       break;
     }
+    case IString: {
+      printf("'%.*s'", p->i.aux, (const char *)(p+1)->buff);
+      break;
+    }
+    case ITrie: {
+      printf("(size = %d)", (p+1)->offset);
+      break;
+    }
     case IOpenCall: {
       printf("-> %d", (p + 1)->offset);
       break;
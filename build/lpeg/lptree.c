@@ -1064,11 +1064,11 @@ static int lp_printcode (lua_State *L) {
 
 
 /*
-** Get the initial position for the match, interpreting negative
-** values from the end of the subject
+** Get the initial position for the match from argument 'arg',
+** interpreting negative values from the end of the subject
 */
-static size_t initposition (lua_State *L, size_t len) {
-  lua_Integer ii = luaL_optinteger(L, 3, 1);
+static size_t initposition (lua_State *L, int arg, size_t len) {
+  lua_Integer ii = luaL_optinteger(L, arg, 1);
   if (ii > 0) {  /* positive index? */
     if ((size_t)ii <= len)  /* inside the string? */
       return (size_t)ii - 1;  /* return it (corrected to 0-base) */
@@ -1092,12 +1092,12 @@ static int lp_match (lua_State *L) {
   Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
   Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
   const char *s = luaL_checklstring(L, SUBJIDX, &l);
-  size_t i = initposition(L, l);
+  size_t i = initposition(L, 3, l);
   int ptop = lua_gettop(L);
   lua_pushnil(L);  /* initialize subscache */
   lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
   lua_getfenv(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
+  r = match(L, s, s + i, s + l, code, capture, ptop, 0);
   if (r == NULL) {
     lua_pushnil(L);
     return 1;
@@ -1106,6 +1106,939 @@ static int lp_match (lua_State *L) {
 }
 
 
+/*
+** Whether compiled code has back captures, which need the whole
+** list of captures to find their groups
+*/
+static int hasbackref (Instruction *code, int n) {
+  int i;
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    switch ((Opcode)code[i].i.code) {
+      case IOpenCapture: case IFullCapture:
+        if (getkind(&code[i]) == Cbackref) return 1;
+        break;
+      default: break;
+    }
+  }
+  return 0;
+}
+
+
+/*
+** lpeg.stream(patt, subject, sink [, init]): match delivering the
+** values of each top-level capture to 'sink' (appended if it is a
+** table, as arguments if it is a function) as soon as no backtracking
+** can discard it, so that the list of captures does not grow with
+** the subject. Returns the final position (values delivered before
+** a failure are kept in the sink).
+*/
+static int lp_stream (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  const char *r;
+  size_t l, i;
+  int ptop;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  const char *s = luaL_checklstring(L, SUBJIDX, &l);
+  luaL_argcheck(L, lua_istable(L, 3) || lua_isfunction(L, 3), 3,
+                "table or function expected");
+  i = initposition(L, 4, l);
+  lua_settop(L, 3);  /* no extra arguments for 'Carg' */
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getfenv(L, 1);  /* initialize penvidx */
+  r = match(L, s, s + i, s + l, code, capture, ptop,
+            hasbackref(code, p->codesize) ? 0 : 3);
+  if (r == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  streamcaptures(L, s, (Capture *)lua_touserdata(L, caplistidx(ptop)),
+                 INT_MAX, ptop, 3);
+  lua_pushinteger(L, r - s + 1);
+  return 1;
+}
+
+
+
+/*
+** {======================================================
+** Searches
+** =======================================================
+*/
+
+/*
+** Find the first match of compiled pattern 'p' starting at or after
+** 's' that does not end at 'last' (so that an empty match cannot
+** follow right after the previous one). Positions that cannot start
+** a match are skipped without running the VM. Return the end of the
+** match and set '*start'; the stack above 'ptop' must be prepared as
+** for 'match'.
+*/
+static const char *search (lua_State *L, Pattern *p, const char *o,
+                           const char *s, const char *e, const char *last,
+                           const char **start, int ptop) {
+  for (;;) {
+    const char *r;
+    switch (p->findkind) {
+      case FINDCHAR: {
+        s = (const char *)memchr(s, p->findchar, e - s);
+        if (s == NULL) return NULL;
+        break;
+      }
+      case FINDSET: {
+        s = spanset(p->findset.cs, s, e);
+        if (s == e) return NULL;
+        break;
+      }
+      default: break;
+    }
+    lua_settop(L, ptop + 3);  /* remove what a failed match left */
+    r = match(L, o, s, e, p->code,
+              (Capture *)lua_touserdata(L, caplistidx(ptop)), ptop, 0);
+    if (r != NULL && r != last) {
+      *start = s;
+      return r;
+    }
+    if (s >= e) return NULL;
+    s++;
+  }
+}
+
+
+/*
+** Push the initial values 'match' expects above 'ptop'
+*/
+static void prepsearch (lua_State *L, Capture *capture) {
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getfenv(L, 1);  /* initialize penvidx */
+}
+
+
+/*
+** lpeg.find(patt, subject [, init, ...]): start and end of the first
+** match, followed by its captures
+*/
+static int lp_find (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  const char *r, *start, *s;
+  size_t l, i;
+  int ptop;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  s = luaL_checklstring(L, SUBJIDX, &l);
+  i = initposition(L, 3, l);
+  ptop = lua_gettop(L);
+  prepsearch(L, capture);
+  r = search(L, p, s, s + i, s + l, NULL, &start, ptop);
+  if (r == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushinteger(L, start - s + 1);
+  lua_pushinteger(L, r - s);
+  return 2 + capturevalues(L, s, ptop);
+}
+
+
+/*
+** Iterator for 'gmatch'; upvalues are the pattern, the subject, the
+** position to continue the search and the end of the previous match
+** (-1 if none)
+*/
+static int gmatch_aux (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  const char *r, *start;
+  size_t l;
+  lua_Integer pos = lua_tointeger(L, lua_upvalueindex(3));
+  lua_Integer last = lua_tointeger(L, lua_upvalueindex(4));
+  Pattern *p;
+  const char *s;
+  int ptop, n;
+  lua_settop(L, 0);
+  lua_pushvalue(L, lua_upvalueindex(1));  /* pattern */
+  lua_pushvalue(L, lua_upvalueindex(2));  /* subject */
+  lua_pushnil(L);  /* no initial position */
+  p = getpattern(L, 1);
+  s = lua_tolstring(L, SUBJIDX, &l);
+  if ((size_t)pos > l)  /* subject exhausted? */
+    return 0;
+  ptop = lua_gettop(L);
+  prepsearch(L, capture);
+  r = search(L, p, s, s + pos, s + l, (last < 0) ? NULL : s + last,
+             &start, ptop);
+  lua_pushinteger(L, (r == NULL) ? (lua_Integer)l + 1 : r - s);
+  lua_replace(L, lua_upvalueindex(3));
+  if (r == NULL) return 0;
+  lua_pushinteger(L, r - s);
+  lua_replace(L, lua_upvalueindex(4));
+  n = capturevalues(L, s, ptop);
+  if (n == 0) {  /* no captures? return whole match */
+    lua_pushlstring(L, start, r - start);
+    n = 1;
+  }
+  return n;
+}
+
+
+/*
+** lpeg.gmatch(patt, subject [, init]): iterator over all matches
+*/
+static int lp_gmatch (lua_State *L) {
+  size_t l, i;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  luaL_checklstring(L, SUBJIDX, &l);
+  i = initposition(L, 3, l);
+  lua_settop(L, 2);
+  lua_pushinteger(L, (lua_Integer)i);
+  lua_pushinteger(L, -1);
+  lua_pushcclosure(L, gmatch_aux, 4);
+  return 1;
+}
+
+
+/*
+** Output buffer for 'gsub' and 'dump', kept in a userdata at stack
+** index 'idx'
+*/
+typedef struct SubstBuff {
+  lua_State *L;
+  char *b;
+  size_t n;  /* number of chars in buffer */
+  size_t size;  /* buffer capacity */
+  int idx;
+} SubstBuff;
+
+
+static void addsubst (SubstBuff *sb, const char *str, size_t len) {
+  if (sb->size - sb->n < len) {  /* not enough space? */
+    size_t newsize = sb->size * 2;
+    char *newbuff;
+    if (newsize - sb->n < len)
+      newsize = sb->n + len;
+    newbuff = (char *)lua_newuserdata(sb->L, newsize);
+    memcpy(newbuff, sb->b, sb->n);
+    lua_replace(sb->L, sb->idx);
+    sb->b = newbuff;
+    sb->size = newsize;
+  }
+  memcpy(sb->b + sb->n, str, len);
+  sb->n += len;
+}
+
+
+/*
+** Add to the buffer capture 'k' (0 is the whole match [st, r)) of
+** the 'n' ones on the top of the stack
+*/
+static void addcapture (lua_State *L, SubstBuff *sb, int k, int n,
+                        const char *st, const char *r) {
+  if (k == 0)
+    addsubst(sb, st, r - st);
+  else if (k > n)
+    luaL_error(L, "invalid capture index %%%d in replacement string", k);
+  else {
+    size_t len;
+    const char *v = lua_tolstring(L, lua_gettop(L) - n + k, &len);
+    if (v == NULL)
+      luaL_error(L, "invalid capture value (a %s)",
+                    luaL_typename(L, lua_gettop(L) - n + k));
+    addsubst(sb, v, len);
+  }
+}
+
+
+/*
+** Add the replacement for match [st, r), whose 'n' capture values are
+** on the top of the stack, following the rules of 'string.gsub'
+*/
+static void addreplace (lua_State *L, SubstBuff *sb, const char *st,
+                        const char *r, int n) {
+  if (lua_type(L, 3) == LUA_TFUNCTION) {
+    lua_pushvalue(L, 3);
+    lua_insert(L, -(n + 1));
+    lua_call(L, n, 1);
+  }
+  else if (lua_type(L, 3) == LUA_TTABLE) {
+    lua_pushvalue(L, -n);  /* first capture is the key */
+    lua_gettable(L, 3);
+  }
+  else {  /* replacement string */
+    size_t l;
+    const char *rs = lua_tolstring(L, 3, &l);
+    const char *rend = rs + l;
+    for (;;) {
+      const char *pc = (const char *)memchr(rs, '%', rend - rs);
+      if (pc == NULL) pc = rend;
+      addsubst(sb, rs, pc - rs);
+      if (pc == rend) break;
+      pc++;  /* skip '%' */
+      if (pc < rend && isdigit((unsigned char)*pc))
+        addcapture(L, sb, *pc - '0', n, st, r);
+      else if (pc < rend && *pc == '%')
+        addsubst(sb, pc, 1);
+      else
+        luaL_error(L, "invalid use of '%%' in replacement string");
+      rs = pc + 1;
+    }
+    return;
+  }
+  if (!lua_toboolean(L, -1))  /* nil or false? */
+    addsubst(sb, st, r - st);  /* keep original text */
+  else {
+    size_t len;
+    const char *v = lua_tolstring(L, -1, &len);
+    if (v == NULL)
+      luaL_error(L, "invalid replacement value (a %s)", luaL_typename(L, -1));
+    addsubst(sb, v, len);
+  }
+}
+
+
+/*
+** lpeg.gsub(patt, subject, repl): copy of 'subject' with all matches
+** replaced as in 'string.gsub', plus the number of matches
+*/
+static int lp_gsub (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  SubstBuff sb;
+  size_t l;
+  const char *s, *src;
+  const char *last = NULL;
+  int tr = lua_type(L, 3);
+  int count = 0;
+  int ptop;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  src = s = luaL_checklstring(L, SUBJIDX, &l);
+  luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
+                   tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
+                   "string/function/table expected");
+  lua_settop(L, 3);
+  sb.L = L; sb.n = 0; sb.size = l + 1; sb.idx = 4;
+  sb.b = (char *)lua_newuserdata(L, sb.size);
+  ptop = lua_gettop(L);
+  for (;;) {
+    const char *r, *start;
+    int n;
+    lua_settop(L, ptop);
+    prepsearch(L, capture);
+    r = search(L, p, s, src, s + l, last, &start, ptop);
+    if (r == NULL) break;
+    addsubst(&sb, src, start - src);
+    n = capturevalues(L, s, ptop);
+    if (n == 0) {  /* no captures? whole match is the only one */
+      lua_pushlstring(L, start, r - start);
+      n = 1;
+    }
+    addreplace(L, &sb, start, r, n);
+    count++;
+    src = last = r;
+  }
+  addsubst(&sb, src, s + l - src);
+  lua_pushlstring(L, sb.b, sb.n);
+  lua_pushinteger(L, count);
+  return 2;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Matchers
+** =======================================================
+*/
+
+/*
+** A matcher is a copy of the compiled code of a pattern. Its
+** environment is its own copy of the pattern's ktable, which also
+** keeps at index 0 the last capture list that had to grow, to be
+** lent to the next matches.
+*/
+typedef struct Matcher {
+  int caplist;  /* true if ktable[0] has a list not lent to a match */
+  Instruction code[1];
+} Matcher;
+
+#define getmatcher(L,i)	((Matcher *)luaL_checkudata(L, i, MATCHER_T))
+
+
+/*
+** Match the subject 's' (at SUBJIDX) with the matcher at index 1 from
+** position 'i'; returns the number of values it pushed (0 if the match
+** failed)
+*/
+static int runmatcher (lua_State *L, Matcher *mt, const char *s,
+                       size_t i, size_t l, int ptop) {
+  Capture capture[INITCAPSIZE];
+  const char *r;
+  int n;
+  lua_pushnil(L);  /* initialize subscache */
+  lua_getfenv(L, 1);  /* ktable, to be moved to penvidx */
+  if (mt->caplist) {  /* lend kept list */
+    lua_rawgeti(L, -1, 0);
+    mt->caplist = 0;
+  }
+  else
+    lua_pushlightuserdata(L, capture);
+  lua_insert(L, -2);  /* initialize caplistidx */
+  r = match(L, s, s + i, s + l, mt->code,
+            (Capture *)lua_touserdata(L, caplistidx(ptop)), ptop, 0);
+  n = (r == NULL) ? 0 : getcaptures(L, s, r, ptop);
+  if (lua_type(L, caplistidx(ptop)) == LUA_TUSERDATA) {  /* lent or grown? */
+    lua_pushvalue(L, caplistidx(ptop));
+    lua_rawseti(L, ktableidx(ptop), 0);  /* keep it */
+    mt->caplist = 1;
+  }
+  return n;
+}
+
+
+/*
+** lpeg.matcher(patt): matcher for 'patt'
+*/
+static int lp_matcher (lua_State *L) {
+  Matcher *mt;
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  lua_settop(L, 1);
+  mt = (Matcher *)lua_newuserdata(L, sizeof(Matcher) +
+                                     (p->codesize - 1) * sizeof(Instruction));
+  mt->caplist = 0;
+  memcpy(mt->code, p->code, p->codesize * sizeof(Instruction));
+  lua_newtable(L);  /* ktable */
+  lua_getfenv(L, 1);
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {  /* copy all values (may have holes) */
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -5);
+    }
+  }
+  lua_pop(L, 1);
+  lua_setfenv(L, -2);
+  luaL_getmetatable(L, MATCHER_T);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+/*
+** matcher:match(subject [, init, ...]): same as 'lpeg.match'
+*/
+static int matcher_match (lua_State *L) {
+  size_t l;
+  Matcher *mt = getmatcher(L, 1);
+  const char *s = luaL_checklstring(L, SUBJIDX, &l);
+  size_t i = initposition(L, 3, l);
+  int n = runmatcher(L, mt, s, i, l, lua_gettop(L));
+  if (n == 0) {
+    lua_pushnil(L);
+    n = 1;
+  }
+  return n;
+}
+
+
+/*
+** matcher:match_all(list): table with the first value 'match' gives
+** for each string in 'list' ('false' where the match fails). The
+** results table first gets a copy of the list, so that the stack
+** holds only the matcher, the subject and the results ('ptop' is 3,
+** so argument captures find no arguments).
+*/
+static int matcher_matchall (lua_State *L) {
+  Matcher *mt = getmatcher(L, 1);
+  int len, n, i;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  len = (int)lua_objlen(L, 2);
+  lua_settop(L, 2);
+  lua_createtable(L, len, 0);  /* results */
+  for (i = 1; i <= len; i++) {
+    lua_rawgeti(L, 2, i);
+    lua_rawseti(L, 3, i);
+  }
+  for (i = 1; i <= len; i++) {
+    size_t l;
+    const char *s;
+    lua_settop(L, 3);
+    lua_rawgeti(L, 3, i);
+    lua_replace(L, SUBJIDX);
+    s = lua_tolstring(L, SUBJIDX, &l);
+    if (s == NULL)
+      return luaL_error(L, "bad element #%d in list (string expected, got %s)",
+                           i, luaL_typename(L, SUBJIDX));
+    n = runmatcher(L, mt, s, 0, l, 3);
+    if (n == 0)
+      lua_pushboolean(L, 0);
+    else
+      lua_pushvalue(L, -n);  /* first value */
+    lua_rawseti(L, 3, i);
+  }
+  lua_settop(L, 3);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Dump and undump
+** =======================================================
+*/
+
+/*
+** A dumped pattern is a header followed by the pattern's tree, its
+** compiled code and search skip, the values of its ktable, and a
+** checksum of all that. Trees and code only hold relative offsets, so
+** they are copied as they are; the header rejects dumps from builds
+** with other layouts. 'lp_undump' checks that trees, offsets and
+** operands stay in bounds and repeats the checks for left recursion
+** and empty loops. (The code itself is not verified, e.g. its capture
+** nesting: as with binary chunks, dumps must come from trusted
+** sources.)
+** ('DUMPFORMAT' must change with any change in opcodes or trees.)
+*/
+#define DUMPSIGNATURE	"\x1bLPeg"
+#define DUMPFORMAT	2
+#define DUMPCHECK	0x5678
+
+/* kinds of ktable values */
+#define DUMPBOOL	'b'
+#define DUMPNUM	'n'
+#define DUMPINT	'i'
+#define DUMPSTR	's'
+
+
+typedef struct DumpHeader {
+  char signature[sizeof(DUMPSIGNATURE) - 1];
+  byte format;
+  byte sizes[6];  /* TTree, Instruction, int, size_t, Lua numbers */
+  short check;  /* byte order */
+} DumpHeader;
+
+
+static void dumpheader (DumpHeader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->signature, DUMPSIGNATURE, sizeof(h->signature));
+  h->format = DUMPFORMAT;
+  h->sizes[0] = sizeof(TTree);
+  h->sizes[1] = sizeof(Instruction);
+  h->sizes[2] = sizeof(int);
+  h->sizes[3] = sizeof(size_t);
+  h->sizes[4] = sizeof(lua_Number);
+  h->sizes[5] = sizeof(lua_Integer);
+  h->check = DUMPCHECK;
+}
+
+
+/*
+** FNV-1a hash of a dump, so that damaged dumps are not loaded
+*/
+static unsigned int dumpsum (const char *s, size_t n) {
+  unsigned int h = 2166136261u;
+  size_t i;
+  for (i = 0; i < n; i++)
+    h = (h ^ (byte)s[i]) * 16777619u;
+  return h & 0xFFFFFFFFu;
+}
+
+
+#define dumpvar(sb,v)	addsubst(sb, (const char *)&(v), sizeof(v))
+
+
+/*
+** Add element 'i' of the ktable on the top of the stack to the dump
+*/
+static void dumpkvalue (lua_State *L, SubstBuff *sb, int i) {
+  char kind;
+  lua_rawgeti(L, -1, i);
+  switch (lua_type(L, -1)) {
+    case LUA_TBOOLEAN: {
+      char b = (char)lua_toboolean(L, -1);
+      kind = DUMPBOOL; dumpvar(sb, kind); dumpvar(sb, b);
+      break;
+    }
+    case LUA_TNUMBER: {
+#if (LUA_VERSION_NUM >= 503)
+      if (lua_isinteger(L, -1)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        kind = DUMPINT; dumpvar(sb, kind); dumpvar(sb, n);
+        break;
+      }
+#endif
+      {
+        lua_Number n = lua_tonumber(L, -1);
+        kind = DUMPNUM; dumpvar(sb, kind); dumpvar(sb, n);
+      }
+      break;
+    }
+    case LUA_TSTRING: {
+      size_t len;
+      const char *str = lua_tolstring(L, -1, &len);
+      kind = DUMPSTR; dumpvar(sb, kind); dumpvar(sb, len);
+      addsubst(sb, str, len);
+      break;
+    }
+    default:
+      luaL_error(L, "cannot dump pattern with a %s value (element %d)",
+                    luaL_typename(L, -1), i);
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** lpeg.dump(patt): binary string with the compiled pattern
+*/
+static int lp_dump (lua_State *L) {
+  SubstBuff sb;
+  DumpHeader h;
+  int i, len, nk;
+  unsigned int sum;
+  Pattern *p = (getpatt(L, 1, &len), getpattern(L, 1));
+  if (p->code == NULL) prepcompile(L, p, 1);
+  lua_settop(L, 1);
+  sb.L = L; sb.n = 0; sb.idx = 2;
+  sb.size = sizeof(h) + len * sizeof(TTree) +
+            p->codesize * sizeof(Instruction) + sizeof(Charset) + 32;
+  sb.b = (char *)lua_newuserdata(L, sb.size);
+  lua_getfenv(L, 1);
+  nk = ktablelen(L, 3);
+  dumpheader(&h);
+  dumpvar(&sb, h);
+  dumpvar(&sb, len);
+  dumpvar(&sb, p->codesize);
+  dumpvar(&sb, nk);
+  dumpvar(&sb, p->findkind);
+  dumpvar(&sb, p->findchar);
+  dumpvar(&sb, p->findset);
+  addsubst(&sb, (const char *)p->tree, len * sizeof(TTree));
+  addsubst(&sb, (const char *)p->code, p->codesize * sizeof(Instruction));
+  for (i = 1; i <= nk; i++)
+    dumpkvalue(L, &sb, i);
+  sum = dumpsum(sb.b, sb.n);
+  dumpvar(&sb, sum);
+  lua_pushlstring(L, sb.b, sb.n);
+  return 1;
+}
+
+
+typedef struct UndumpState {
+  lua_State *L;
+  const char *s;
+  size_t n;  /* bytes left */
+} UndumpState;
+
+
+static const char *undumpblock (UndumpState *us, void *v, size_t size) {
+  const char *b = us->s;
+  if (us->n < size)
+    luaL_error(us->L, "truncated dumped pattern");
+  if (v != NULL) memcpy(v, b, size);
+  us->s += size; us->n -= size;
+  return b;
+}
+
+#define undumpvar(us,v)	undumpblock(us, &(v), sizeof(v))
+
+
+/*
+** Check a capture of kind 'cap' with key 'key' as 'lp_dump' could
+** write it: values it reads from the ktable are there, and there
+** are no functions or tables, which cannot be dumped.
+*/
+static int checkcapture (int cap, int key, int nk) {
+  switch (cap) {
+    case Carg: return (0 < key && key <= SHRT_MAX);
+    case Cnum: return (0 <= key && key <= SHRT_MAX);
+    case Cstring: case Cbackref: return (0 < key && key <= nk);
+    case Cposition: case Cconst: case Csimple: case Ctable: case Csubst:
+    case Cgroup:
+      return (0 <= key && key <= nk);
+    default: return 0;  /* Cclose, Cruntime, Cfunction, Cquery, Cfold */
+  }
+}
+
+
+/* state for 'checktree' */
+typedef struct TreeCheck {
+  TTree *tree;
+  int len;  /* number of elements in 'tree' */
+  int nk;  /* size of the ktable */
+  byte *grammars;  /* marks the positions of grammars */
+} TreeCheck;
+
+
+/*
+** Check the tree at position 'i', laid out as the tree constructors
+** build them: first sibling right after its parent, second sibling
+** right after the whole first one. 'rules' has the positions of the
+** rules of the innermost grammar, which its calls must point to.
+** Return the position right after the tree, or -1 if it is corrupted.
+*/
+static int checktree (TreeCheck *tc, int i, int *rules, int nrules) {
+  TTree *tree = tc->tree;
+  int len = tc->len, nk = tc->nk;
+  TTree *t;
+ tailcall:
+  if (i < 0 || i >= len) return -1;
+  t = &tree[i];
+  switch (t->tag) {
+    case TSet:
+      return (len - i > (int)bytes2slots(CHARSETSIZE)) ?
+             i + 1 + (int)bytes2slots(CHARSETSIZE) : -1;
+    case TChar: case TBehind:
+      if (t->u.n < 0 || t->u.n > UCHAR_MAX) return -1;
+      break;
+    case TOpenCall: case TRunTime:  /* dumps are compiled, no functions */
+      return -1;
+    case TRule:
+      if (t->key > nk) return -1;
+      break;
+    case TCall: {
+      TTree *rule;
+      if (t->key > nk || t->u.ps < -i || t->u.ps >= len - i) return -1;
+      rule = sib2(t);
+      if (rule->tag != TRule || rule->key == 0 || rule->cap >= nrules)
+        return -1;
+      return (t->u.ps == rules[rule->cap] - i) ? i + 1 : -1;
+    }
+    case TCapture:
+      if (!checkcapture(t->cap, t->key, nk)) return -1;
+      break;
+    case TGrammar: {
+      int grules[MAXRULES];
+      int n = 0;
+      int r = i + 1;
+      while (r < len && tree[r].tag == TRule) {  /* collect its rules */
+        if (n >= MAXRULES || tree[r].cap != n ||
+            tree[r].u.ps <= 0 || tree[r].u.ps > len - r)
+          return -1;
+        grules[n++] = r;
+        r += tree[r].u.ps;
+      }
+      if (n == 0 || n != t->u.n || r >= len || tree[r].tag != TTrue ||
+          tree[i + 1].key == 0)  /* initial rule always has a name */
+        return -1;
+      tc->grammars[i] = 1;
+      return checktree(tc, i + 1, grules, n);
+    }
+    default:
+      if (t->tag > TRunTime) return -1;
+      break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 0: return i + 1;
+    case 1: i++; goto tailcall;
+    default: {
+      int e = checktree(tc, i + 1, rules, nrules);
+      if (e < 0 || t->u.ps != e - i) return -1;
+      i = e; goto tailcall;
+    }
+  }
+}
+
+
+/* marks for 'checkcode' */
+#define INSTSTART	1	/* start of an instruction */
+#define TRIENODE	2	/* start of a trie node */
+
+
+/*
+** Check the table of an 'ITrie' at position 'i' of 'code': nodes
+** follow one another and each child offset is 0 or the start of a
+** later node, so that the matcher stays inside the instruction.
+** 'mark' flags the node starts.
+*/
+static int checktrie (Instruction *code, int i, byte *mark) {
+  Instruction *base = code + i + 2;
+  int size = code[i + 1].offset - 2;  /* elements in the nodes */
+  int k, j;
+  for (k = 0; k < size; k += (int)(triechildren(base + k) - (base + k)) +
+                            triehead(base + k).key) {
+    if (size - k < 3 || triehead(base + k).key < 0)
+      return 0;
+    mark[i + 2 + k] |= TRIENODE;
+  }
+  if (k != size || size == 0) return 0;
+  for (k = 0; k < size; k++) {
+    if (mark[i + 2 + k] & TRIENODE) {
+      Instruction *node = base + k;
+      Instruction *children = triechildren(node);
+      int n = triehead(node).key;
+      for (j = 0; j < n; j++) {
+        int c = children[j].offset;
+        if (c != 0 &&
+            (c <= k || c >= size || !(mark[i + 2 + c] & TRIENODE)))
+          return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Check that 'code' is a sequence of whole instructions ending in
+** 'IEnd', with jumps and calls landing on instructions, trie tables
+** inside their instructions and capture operands that the capture
+** functions accept.
+*/
+static int checkcode (lua_State *L, Instruction *code, int n, int nk) {
+  byte *mark = (byte *)lua_newuserdata(L, n);
+  int i = 0, last = 0;
+  memset(mark, 0, n);
+  while (i < n) {
+    int size;
+    switch ((Opcode)code[i].i.code) {
+      case IOpenCall: case IGiveup: case ICloseRunTime: return 0;
+      case ITrie: if (n - i < 2) return 0; break;
+      default: if (code[i].i.code > ICloseRunTime) return 0; break;
+    }
+    size = sizei(&code[i]);
+    if (size <= 0 || size > n - i ||
+        (code[i].i.code == ITrie && !checktrie(code, i, mark)))
+      return 0;
+    mark[i] |= INSTSTART;
+    last = i;
+    i += size;
+  }
+  if (code[last].i.code != IEnd) return 0;
+  for (i = 0; i < n; i += sizei(&code[i])) {
+    Instruction *inst = &code[i];
+    switch ((Opcode)inst->i.code) {
+      case ITestAny: case ITestChar: case ITestSet: case IChoice:
+      case IJmp: case ICall: case ICommit: case IPartialCommit:
+      case IBackCommit: {
+        int offset = (inst + 1)->offset;
+        if (offset < -i || offset >= n - i ||
+            !(mark[i + offset] & INSTSTART))
+          return 0;
+        break;
+      }
+      case IOpenCapture: case IFullCapture:
+        if (!checkcapture(getkind(inst), inst->i.key, nk)) return 0;
+        break;
+      case ICloseCapture:
+        if (getkind(inst) != Cclose) return 0;
+        break;
+      default: break;
+    }
+  }
+  lua_pop(L, 1);  /* remove marks */
+  return 1;
+}
+
+
+/*
+** Push element read from 'us' into the table on the top of the stack
+*/
+static void undumpkvalue (lua_State *L, UndumpState *us, int i) {
+  char kind;
+  undumpvar(us, kind);
+  switch (kind) {
+    case DUMPBOOL: {
+      char b;
+      undumpvar(us, b);
+      lua_pushboolean(L, b);
+      break;
+    }
+    case DUMPNUM: {
+      lua_Number n;
+      undumpvar(us, n);
+      lua_pushnumber(L, n);
+      break;
+    }
+    case DUMPINT: {
+      lua_Integer n;
+      undumpvar(us, n);
+      lua_pushinteger(L, n);
+      break;
+    }
+    case DUMPSTR: {
+      size_t len;
+      const char *str;
+      undumpvar(us, len);
+      str = undumpblock(us, NULL, len);
+      lua_pushlstring(L, str, len);
+      break;
+    }
+    default: luaL_error(L, "corrupted dumped pattern");
+  }
+  lua_rawseti(L, -2, i);
+}
+
+
+/*
+** lpeg.undump(string): pattern from the result of 'lpeg.dump',
+** ready to match without compiling it again
+*/
+static int lp_undump (lua_State *L) {
+  UndumpState us;
+  DumpHeader h, exp;
+  int i, len, codesize, nk;
+  unsigned int sum, dsum;
+  const char *start;
+  TreeCheck tc;
+  Pattern *p;
+  us.L = L;
+  us.s = start = luaL_checklstring(L, 1, &us.n);
+  dumpheader(&exp);
+  undumpvar(&us, h);
+  if (memcmp(&h, &exp, sizeof(h)) != 0)
+    return luaL_error(L, "incompatible dumped pattern");
+  undumpvar(&us, len);
+  undumpvar(&us, codesize);
+  undumpvar(&us, nk);
+  if (len <= 0 || codesize <= 0 || nk < 0 || nk > USHRT_MAX ||
+      (size_t)len > us.n / sizeof(TTree) ||
+      (size_t)codesize > us.n / sizeof(Instruction))
+    return luaL_error(L, "corrupted dumped pattern");
+  lua_settop(L, 1);
+  newtree(L, len);
+  p = getpattern(L, 2);
+  undumpvar(&us, p->findkind);
+  undumpvar(&us, p->findchar);
+  undumpvar(&us, p->findset);
+  undumpblock(&us, p->tree, len * sizeof(TTree));
+  reallocprog(L, p, codesize);
+  undumpblock(&us, p->code, codesize * sizeof(Instruction));
+  lua_createtable(L, nk, 0);  /* even if empty, as keys are not trusted */
+  for (i = 1; i <= nk; i++)
+    undumpkvalue(L, &us, i);
+  lua_setfenv(L, 2);
+  sum = dumpsum(start, us.s - start);
+  undumpvar(&us, dsum);
+  tc.tree = p->tree; tc.len = len; tc.nk = nk;
+  tc.grammars = (byte *)lua_newuserdata(L, len);
+  memset(tc.grammars, 0, len);
+  if (us.n != 0 || dsum != sum ||
+      p->findkind < FINDANY || p->findkind > FINDSET ||
+      checktree(&tc, 0, NULL, 0) != len ||
+      !checkcode(L, p->code, codesize, nk))
+    return luaL_error(L, "corrupted dumped pattern");
+  /* checks done when building the patterns: inner grammars first */
+  lua_getfenv(L, 2);  /* ktable, for the messages of 'verifygrammar' */
+  for (i = len - 1; i >= 0; i--) {
+    if (tc.grammars[i]) verifygrammar(L, &p->tree[i]);
+  }
+  if (checkloops(p->tree))
+    return luaL_error(L, "corrupted dumped pattern");
+  lua_settop(L, 2);
+  return 1;
+}
+
+/* }====================================================== */
+
 
 /*
 ** {======================================================
@@ -1121,6 +2054,44 @@ static int lp_setmax (lua_State *L) {
 }
 
 
+/*
+** lpeg.setmaxsteps([max]): limit for the number of failures (and
+** so backtracking) in each match (none if absent or 0)
+*/
+static int lp_setmaxsteps (lua_State *L) {
+  lua_Integer max = luaL_optinteger(L, 1, 0);
+  lua_pushinteger(L, (max > 0) ? max : 0);
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXSTEPSIDX);
+  return 0;
+}
+
+
+/*
+** lpeg.setpackrat([size]): memoize the results of rules in a table
+** with 'size' entries (rounded to a power of 2); 0 or absent turns
+** memoization off
+*/
+static int lp_setpackrat (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 1, 0);
+  if (n <= 0)
+    lua_pushnil(L);
+  else {
+    Memo *memo;
+    int size = 1;
+    luaL_argcheck(L, n <= INT_MAX / 2 / (int)sizeof(MemoEntry), 1,
+                  "size too large");
+    while (size < n) size *= 2;
+    memo = (Memo *)lua_newuserdata(L, sizeof(Memo) +
+                                      (size - 1) * sizeof(MemoEntry));
+    memset(memo->e, 0, size * sizeof(MemoEntry));
+    memo->gen = 0;
+    memo->size = size;
+  }
+  lua_setfield(L, LUA_REGISTRYINDEX, MEMOIDX);
+  return 0;
+}
+
+
 static int lp_version (lua_State *L) {
   lua_pushstring(L, VERSION);
   return 1;
@@ -1181,6 +2152,13 @@ static struct luaL_Reg pattreg[] = {
   {"ptree", lp_printtree},
   {"pcode", lp_printcode},
   {"match", lp_match},
+  {"matcher", lp_matcher},
+  {"stream", lp_stream},
+  {"find", lp_find},
+  {"gmatch", lp_gmatch},
+  {"gsub", lp_gsub},
+  {"dump", lp_dump},
+  {"undump", lp_undump},
   {"B", lp_behind},
   {"V", lp_V},
   {"C", lp_simplecapture},
@@ -1199,11 +2177,20 @@ static struct luaL_Reg pattreg[] = {
   {"locale", lp_locale},
   {"version", lp_version},
   {"setmaxstack", lp_setmax},
+  {"setmaxsteps", lp_setmaxsteps},
+  {"setpackrat", lp_setpackrat},
   {"type", lp_type},
   {NULL, NULL}
 };
 
 
+static struct luaL_Reg matcherreg[] = {
+  {"match", matcher_match},
+  {"match_all", matcher_matchall},
+  {NULL, NULL}
+};
+
+
 static struct luaL_Reg metareg[] = {
   {"__mul", lp_seq},
   {"__add", lp_choice},
@@ -1226,6 +2213,11 @@ LUA_API int luaopen_lpeg (lua_State *L) {
   luaL_register(L, "lpeg", pattreg);
   lua_pushvalue(L, -1);
   lua_setfield(L, -3, "__index");
+  luaL_newmetatable(L, MATCHER_T);
+  lua_newtable(L);
+  luaL_register(L, NULL, matcherreg);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
   return 1;
 }
 
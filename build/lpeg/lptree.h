@@ -52,15 +52,24 @@ typedef struct TTree {
 
 /*
 ** A complete pattern has its tree plus, if already compiled,
-** its corresponding code
+** its corresponding code and how searches can skip start positions
 */
 typedef struct Pattern {
   union Instruction *code;
   int codesize;
+  int findkind;  /* kind of skip (FINDANY, FINDCHAR, or FINDSET) */
+  int findchar;  /* single char that can start a match (FINDCHAR) */
+  Charset findset;  /* chars that cannot start a match (FINDSET) */
   TTree tree[1];
 } Pattern;
 
 
+/* kinds of skip for start positions in searches */
+#define FINDANY		0	/* try every position */
+#define FINDCHAR	1	/* 'memchr' for 'findchar' */
+#define FINDSET		2	/* span over 'findset' */
+
+
 /* number of siblings for each tree */
 extern const byte numsiblings[];
 
@@ -23,7 +23,10 @@
 
 
 #define PATTERN_T	"lpeg-pattern"
+#define MATCHER_T	"lpeg-matcher"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define MAXSTEPSIDX	"lpeg-maxsteps"
+#define MEMOIDX		"lpeg-memo"
 
 
 /*
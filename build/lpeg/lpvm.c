@@ -16,6 +16,18 @@
 #include "lpprint.h"
 
 
+/* size of capture list before streaming starts to flush it */
+#if !defined(STREAMCAPSIZE)
+#define STREAMCAPSIZE	256
+#endif
+
+
+/* number of steps (failures) between checks of step limit */
+#if !defined(STEPCHECK)
+#define STEPCHECK	1000
+#endif
+
+
 /* initial size for call/backtrack stack */
 #if !defined(INITBACK)
 #define INITBACK	100
@@ -25,6 +37,221 @@
 #define getoffset(p)	(((p) + 1)->offset)
 
 static const Instruction giveup = {{IGiveup, 0, 0}};
+static const Instruction memoret = {{IMemoRet, 0, 0}};
+static const Instruction memofail = {{IMemoFail, 0, 0}};
+
+
+/*
+** {======================================================
+** Span kernels
+** =======================================================
+*/
+
+/*
+** 'ISpan' skips whole blocks of the subject with byte shuffles: the
+** charset byte for 'c' is entry 'c >> 3' of the 32-byte set and the
+** bit is 'c & 7', so two 16-entry lookups give both. A kernel only
+** reads full blocks inside [s, e) and returns at the first byte not in
+** the set, or at the start of the last partial block; the interpreter
+** does the first block and the tail byte by byte, so short spans never
+** pay for the setup. The kernel is picked by CPU at the first long span.
+** Define LPEG_NO_SIMD to keep the plain loop.
+*/
+
+#if !defined(LPEG_NO_SIMD)
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LPEG_SPAN_X86
+#define SPANTARGET(t)	__attribute__((target(t)))
+#define spanctz(x)	__builtin_ctz(x)
+#define cpuhas(f)	__builtin_cpu_supports(#f)
+#include <immintrin.h>
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER)
+#define LPEG_SPAN_X86
+#define SPANTARGET(t)
+#define cpuhas(f)	cpuhas_##f()
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__GNUC__)
+#define LPEG_SPAN_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+
+#define SPANBLOCK	16
+
+typedef const char *(*SpanKernel) (const byte *cs, const char *s,
+                                   const char *e);
+
+
+static const char *spannone (const byte *cs, const char *s, const char *e) {
+  (void)cs; (void)e;
+  return s;
+}
+
+
+#if defined(LPEG_SPAN_X86)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+static int spanctz (unsigned x) {
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (int)i;
+}
+
+static int cpuhas_ssse3 (void) {
+  int r[4];
+  __cpuid(r, 1);
+  return (r[2] & (1 << 9)) != 0;
+}
+
+static int cpuhas_avx2 (void) {
+  int r[4];
+  __cpuid(r, 0);
+  if (r[0] < 7) return 0;
+  __cpuid(r, 1);
+  if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0)  /* OSXSAVE, AVX */
+    return 0;
+  if ((_xgetbv(0) & 6) != 6)  /* OS saves the YMM registers? */
+    return 0;
+  __cpuidex(r, 7, 0);
+  return (r[1] & (1 << 5)) != 0;
+}
+#endif
+
+
+SPANTARGET("ssse3")
+static const char *spanssse3 (const byte *cs, const char *s, const char *e) {
+  const __m128i lo = _mm_loadu_si128((const __m128i *)cs);
+  const __m128i hi = _mm_loadu_si128((const __m128i *)(cs + 16));
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                     1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i low4 = _mm_set1_epi8(0x0F);
+  const __m128i low3 = _mm_set1_epi8(7);
+  const __m128i top = _mm_set1_epi8(-128);
+  for (; e - s >= SPANBLOCK; s += SPANBLOCK) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i idx = _mm_and_si128(_mm_srli_epi16(v, 3), low4);
+    __m128i h = _mm_and_si128(v, top);  /* shuffles give 0 for a set sign */
+    __m128i row = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_or_si128(idx, h)),
+        _mm_shuffle_epi8(hi, _mm_or_si128(idx, _mm_xor_si128(h, top))));
+    __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(v, low3));
+    unsigned in = (unsigned)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+    if (in != 0xFFFF)
+      return s + spanctz(~in);
+  }
+  return s;
+}
+
+
+SPANTARGET("avx2")
+static const char *spanavx2 (const byte *cs, const char *s, const char *e) {
+  const __m128i lo128 = _mm_loadu_si128((const __m128i *)cs);
+  const __m128i hi128 = _mm_loadu_si128((const __m128i *)(cs + 16));
+  const __m256i lo = _mm256_inserti128_si256(_mm256_castsi128_si256(lo128),
+                                             lo128, 1);
+  const __m256i hi = _mm256_inserti128_si256(_mm256_castsi128_si256(hi128),
+                                             hi128, 1);
+  const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                        1, 2, 4, 8, 16, 32, 64, -128,
+                                        1, 2, 4, 8, 16, 32, 64, -128,
+                                        1, 2, 4, 8, 16, 32, 64, -128);
+  const __m256i low4 = _mm256_set1_epi8(0x0F);
+  const __m256i low3 = _mm256_set1_epi8(7);
+  const __m256i top = _mm256_set1_epi8(-128);
+  for (; e - s >= 2 * SPANBLOCK; s += 2 * SPANBLOCK) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    __m256i idx = _mm256_and_si256(_mm256_srli_epi16(v, 3), low4);
+    __m256i h = _mm256_and_si256(v, top);
+    __m256i row = _mm256_or_si256(
+        _mm256_shuffle_epi8(lo, _mm256_or_si256(idx, h)),
+        _mm256_shuffle_epi8(hi, _mm256_or_si256(idx, _mm256_xor_si256(h, top))));
+    __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(v, low3));
+    unsigned in = (unsigned)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+    if (in != 0xFFFFFFFFu)
+      return s + spanctz(~in);
+  }
+  return spanssse3(cs, s, e);  /* last 16 bytes, if any */
+}
+
+#elif defined(LPEG_SPAN_NEON)
+
+static const char *spanneon (const byte *cs, const char *s, const char *e) {
+  static const byte bitmask[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                   1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t bits = vld1q_u8(bitmask);
+  const uint8x16_t low3 = vdupq_n_u8(7);
+  uint8x16x2_t set;
+  set.val[0] = vld1q_u8(cs);
+  set.val[1] = vld1q_u8(cs + 16);
+  for (; e - s >= SPANBLOCK; s += SPANBLOCK) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)s);
+    uint8x16_t row = vqtbl2q_u8(set, vshrq_n_u8(v, 3));
+    uint8x16_t in = vtstq_u8(row, vqtbl1q_u8(bits, vandq_u8(v, low3)));
+    /* 4 bits per byte: 'in' narrowed to a 64-bit mask */
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(in), 4)), 0);
+    if (mask != ~(uint64_t)0)
+      return s + (__builtin_ctzll(~mask) >> 2);
+  }
+  return s;
+}
+
+#endif
+
+
+static SpanKernel selectspan (void) {
+#if defined(LPEG_SPAN_X86)
+  if (cpuhas(avx2)) return spanavx2;
+  if (cpuhas(ssse3)) return spanssse3;
+#elif defined(LPEG_SPAN_NEON)
+  return spanneon;
+#endif
+  return spannone;
+}
+
+
+static const char *spanfirst (const byte *cs, const char *s, const char *e);
+
+static SpanKernel spanblocks = spanfirst;
+
+static const char *spanfirst (const byte *cs, const char *s, const char *e) {
+  spanblocks = selectspan();
+  return spanblocks(cs, s, e);
+}
+
+
+/*
+** Return the first position in [s, e) whose char is not in 'cs' (or
+** 'e'); short spans stay byte by byte
+*/
+static const char *span (const byte *cs, const char *s, const char *e) {
+  const char *lim = (e - s > SPANBLOCK) ? s + SPANBLOCK : e;
+  for (; s < lim; s++) {
+    int c = (byte)*s;
+    if (!testchar(cs, c)) return s;
+  }
+  if (s < e) {
+    s = spanblocks(cs, s, e);
+    for (; s < e; s++) {
+      int c = (byte)*s;
+      if (!testchar(cs, c)) break;
+    }
+  }
+  return s;
+}
+
+
+const char *spanset (const byte *cs, const char *s, const char *e) {
+  return span(cs, s, e);
+}
+
+/* }====================================================== */
+
 
 
 /*
@@ -38,6 +265,7 @@ typedef struct Stack {
   const char *s;  /* saved position (or NULL for calls) */
   const Instruction *p;  /* next instruction */
   int caplevel;
+  int start;  /* memoized calls: subject offset, or offset of 'ICall' */
 } Stack;
 
 
@@ -45,14 +273,16 @@ typedef struct Stack {
 
 
 /*
-** Double the size of the array of captures
+** Double the size of the array of captures; its last 'n' entries
+** (up to 'captop') are new and need not be copied
 */
-static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop) {
+static Capture *doublecap (lua_State *L, Capture *cap, int captop, int n,
+                           int ptop) {
   Capture *newc;
   if (captop >= INT_MAX/((int)sizeof(Capture) * 2))
     luaL_error(L, "too many captures");
   newc = (Capture *)lua_newuserdata(L, captop * 2 * sizeof(Capture));
-  memcpy(newc, cap, captop * sizeof(Capture));
+  memcpy(newc, cap, (captop - n) * sizeof(Capture));
   lua_replace(L, caplistidx(ptop));
   return newc;
 }
@@ -142,16 +372,119 @@ static int removedyncap (lua_State *L, Capture *capture,
 
 
 /*
-** Opcode interpreter
+** Called every STEPCHECK steps (failures, which bound the work spent
+** in backtracking): raise an error if the match went over the limit
+** set by 'setmaxsteps'. If 'setpackrat' set a table, start using it
+** unless the match is streaming or has run a match-time capture, which
+** marks the slot of the cache for Lua values with 'true' (the table is
+** anchored in that slot). Returns the memo table in use, if any.
+*/
+static Memo *checksteps (lua_State *L, lua_Integer *steps, Memo *memo,
+                         int sink, int ptop) {
+  lua_Integer max;
+  *steps += STEPCHECK;
+  lua_getfield(L, LUA_REGISTRYINDEX, MAXSTEPSIDX);
+  max = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (max > 0 && *steps > max)
+    luaL_error(L, "too many steps in match (see 'lpeg.setmaxsteps')");
+  if (memo == NULL && sink == 0) {
+    lua_getfield(L, LUA_REGISTRYINDEX, MEMOIDX);
+    if (lua_isuserdata(L, -1) && (lua_isnil(L, ptop + 1) ||
+          lua_touserdata(L, ptop + 1) == lua_touserdata(L, -1))) {
+      memo = (Memo *)lua_touserdata(L, -1);
+      if (++memo->gen == 0) {  /* wrapped around? clear old entries */
+        memset(memo->e, 0, memo->size * sizeof(MemoEntry));
+        memo->gen = 1;
+      }
+      lua_replace(L, ptop + 1);
+    }
+    else lua_pop(L, 1);
+  }
+  return memo;
+}
+
+
+static MemoEntry *memoslot (Memo *memo, int rule, int pos) {
+  unsigned int h = ((unsigned int)rule * 2654435761u) ^ (unsigned int)pos;
+  return &memo->e[h & (memo->size - 1)];
+}
+
+
+/*
+** Record the result 'res' of the call at offset 'call' in the code
+** made from subject offset 'pos'
+*/
+static void memoize (Memo *memo, const Instruction *op, int call, int pos,
+                     int res) {
+  int rule = call + getoffset(op + call);
+  MemoEntry *m = memoslot(memo, rule, pos);
+  m->rule = rule; m->pos = pos; m->res = res; m->gen = memo->gen;
+}
+
+
+/*
+** Stream to 'sink' the complete top-level captures that no pending
+** choice can discard (those below the lowest 'caplevel' in the
+** stack) and remove them from the list, with the dynamic capture
+** values they own. Returns the number of entries removed.
+*/
+static int flushcap (lua_State *L, const char *o, Capture *capture,
+                     int captop, Stack *stack, int ptop, int sink,
+                     int *ndyncap) {
+  Stack *base = getstackbase(L, ptop);
+  Stack *st;
+  int i, k, d = 0;
+  int bound = captop;
+  for (st = base + 1; st < stack; st++) {  /* base entry is 'giveup' */
+    if (st->s != NULL && st->caplevel < bound)
+      bound = st->caplevel;
+  }
+  k = streamcaptures(L, o, capture, bound, ptop, sink);
+  if (k == 0) return 0;
+  for (i = 0; i < k; i++) {
+    if (capture[i].kind == Cruntime) d++;
+  }
+  if (d > 0) {  /* remove values of streamed dynamic captures */
+    for (i = 0; i < d; i++)
+      lua_remove(L, stackidx(ptop) + 1);
+    for (i = k; i < captop; i++) {
+      if (capture[i].kind == Cruntime) capture[i].idx -= d;
+    }
+    *ndyncap -= d;
+  }
+  memmove(capture, capture + k, (captop - k) * sizeof(Capture));
+  for (st = base + 1; st < stack; st++) {
+    if (st->s != NULL) st->caplevel -= k;
+  }
+  return k;
+}
+
+
+/*
+** Opcode interpreter; if 'sink' is not 0, captures are streamed to
+** the value at that stack index whenever the list fills up (see
+** 'flushcap'). Calls are memoized (see 'checksteps') until the match
+** runs a match-time capture, whose results may depend on other
+** captures. A memoized call pushes a frame below its call entry,
+** which returns to 'memoret' and fails to 'memofail' to record the
+** result; so, calls cost nothing extra while there is no memo table.
+** 'capture' has INITCAPSIZE entries, unless it is a full userdata
+** (a list kept from an earlier match), whose size tells its capacity.
 */
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
+                   Instruction *op, Capture *capture, int ptop, int sink) {
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
-  int capsize = INITCAPSIZE;
+  int capsize = (lua_type(L, caplistidx(ptop)) == LUA_TUSERDATA)  /* lent? */
+              ? (int)(lua_objlen(L, caplistidx(ptop)) / sizeof(Capture))
+              : INITCAPSIZE;
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
+  int tick = STEPCHECK;  /* steps until next call to 'checksteps' */
+  lua_Integer steps = 0;
+  Memo *memo = NULL;
   const Instruction *p = op;  /* current instruction */
   stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
   lua_pushlightuserdata(L, stackbase);
@@ -179,6 +512,19 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         p = (--stack)->p;
         continue;
       }
+      case IMemoRet: {  /* return from a memoized call */
+        int call = stack->start;  /* popped call entry keeps the 'ICall' */
+        stack--;  /* remove its frame */
+        if (memo != NULL && stack->caplevel == captop)  /* no captures? */
+          memoize(memo, op, call, stack->start, s - o);
+        p = op + call + 2;
+        continue;
+      }
+      case IMemoFail: {  /* a memoized call failed */
+        if (memo != NULL)  /* call entry is right above its frame */
+          memoize(memo, op, (stack + 1)->start, stack->start, -1);
+        goto fail;
+      }
       case IAny: {
         if (s < e) { p++; s++; }
         else goto fail;
@@ -220,13 +566,52 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case ISpan: {
-        for (; s < e; s++) {
-          int c = (byte)*s;
-          if (!testchar((p+1)->buff, c)) break;
-        }
+        s = span((p+1)->buff, s, e);
         p += CHARSETINSTSIZE;
         continue;
       }
+      case IString: {
+        int n = p->i.aux;
+        const byte *str = (p+1)->buff;
+        if (e - s >= n && (byte)*s == str[0] && memcmp(s, str, n) == 0)
+          { p += instsize(n); s += n; }
+        else goto fail;
+        continue;
+      }
+      case ITrie: {
+        const Instruction *base = p + 2;
+        const Instruction *node = base;
+        const char *t = s;
+        const char *res = NULL;  /* end of best alternative so far */
+        int best = TRIENOTERM;  /* its priority */
+        for (;;) {
+          int c, k = 0;
+          if (trieterm(node) < best) { best = trieterm(node); res = t; }
+          if (triemin(node) >= best || t >= e)
+            break;  /* nothing better below */
+          c = (byte)*t;
+          if (triehead(node).aux) {  /* dense node? */
+            c -= triehead(node).code;
+            if (c >= 0 && c < triehead(node).key)
+              k = triechildren(node)[c].offset;
+          }
+          else {
+            const byte *labels = trielabels(node);
+            int j;
+            for (j = 0; j < triehead(node).key && labels[j] <= c; j++) {
+              if (labels[j] == c) {
+                k = triechildren(node)[j].offset;
+                break;
+              }
+            }
+          }
+          if (k == 0) break;
+          node = base + k; t++;
+        }
+        if (res == NULL) goto fail;
+        s = res; p += (p + 1)->offset;
+        continue;
+      }
       case IJmp: {
         p += getoffset(p);
         continue;
@@ -242,6 +627,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case ICall: {
+        if (memo != NULL) goto memocall;
         if (stack == stacklimit)
           stack = doublestack(L, &stacklimit, ptop);
         stack->s = NULL;
@@ -276,6 +662,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         /* go through */
       case IFail:
       fail: { /* pattern failed: try to backtrack */
+        if (--tick == 0) {
+          tick = STEPCHECK;
+          memo = checksteps(L, &steps, memo, sink, ptop);
+        }
         do {  /* remove pending calls */
           assert(stack > getstackbase(L, ptop));
           s = (--stack)->s;
@@ -286,10 +676,39 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         p = stack->p;
         continue;
       }
+      memocall: {  /* call with memo table (see 'checksteps') */
+        MemoEntry *m = memoslot(memo, (p + getoffset(p)) - op, s - o);
+        if (m->gen == memo->gen && m->rule == (p + getoffset(p)) - op &&
+            m->pos == s - o) {  /* result already known? */
+          if (m->res < 0) goto fail;
+          s = o + m->res;
+          p += 2;
+          continue;
+        }
+        if (stack == stacklimit)
+          stack = doublestack(L, &stacklimit, ptop);
+        stack->s = s;  /* frame to record the result */
+        stack->p = &memofail;
+        stack->caplevel = captop;
+        stack->start = s - o;
+        stack++;
+        if (stack == stacklimit)
+          stack = doublestack(L, &stacklimit, ptop);
+        stack->s = NULL;
+        stack->p = &memoret;
+        stack->start = p - op;
+        stack++;
+        p += getoffset(p);
+        continue;
+      }
       case ICloseRunTime: {
         CapState cs;
         int rem, res, n;
-        int fr = lua_gettop(L) + 1;  /* stack index of first result */
+        int fr;
+        memo = NULL;  /* stop memoizing (see 'checksteps') */
+        lua_pushboolean(L, 1);
+        lua_replace(L, ptop + 1);
+        fr = lua_gettop(L) + 1;  /* stack index of first result */
         cs.s = o; cs.L = L; cs.ocap = capture; cs.ptop = ptop;
         n = runtimecap(&cs, capture + captop, s, &rem);  /* call function */
         captop -= n;  /* remove nested captures */
@@ -302,7 +721,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         ndyncap += n - rem;  /* update number of dynamic captures */
         if (n > 0) {  /* any new capture? */
           if ((captop += n + 2) >= capsize) {
-            capture = doublecap(L, capture, captop, ptop);
+            capture = doublecap(L, capture, captop, n + 1, ptop);
             capsize = 2 * captop;
           }
           /* add new captures to 'capture' list */
@@ -339,8 +758,12 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         capture[captop].idx = p->i.key;
         capture[captop].kind = getkind(p);
         if (++captop >= capsize) {
-          capture = doublecap(L, capture, captop, ptop);
-          capsize = 2 * captop;
+          if (sink == 0 || capsize < STREAMCAPSIZE ||  /* not streaming? */
+              (captop -= flushcap(L, o, capture, captop, stack, ptop, sink,
+                                  &ndyncap)) > capsize / 2) {  /* too full? */
+            capture = doublecap(L, capture, captop, 0, ptop);
+            capsize = 2 * captop;
+          }
         }
         p++;
         continue;
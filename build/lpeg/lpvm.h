@@ -17,6 +17,8 @@ typedef enum Opcode {
   ITestChar,  /* if char != aux, jump to 'offset' */
   ITestSet,  /* if char not in buff, jump to 'offset' */
   ISpan,  /* read a span of chars in buff */
+  IString,  /* if next 'aux' chars != buff, fail */
+  ITrie,  /* match first alternative in trie; fail if none */
   IBehind,  /* walk back 'aux' characters (fail if not possible) */
   IRet,  /* return from a rule */
   IEnd,  /* end of pattern */
@@ -33,7 +35,9 @@ typedef enum Opcode {
   IFullCapture,  /* complete capture of last 'off' chars */
   IOpenCapture,  /* start a capture */
   ICloseCapture,
-  ICloseRunTime
+  ICloseRunTime,
+  IMemoRet,  /* internal use */
+  IMemoFail  /* internal use */
 } Opcode;
 
 
@@ -49,10 +53,51 @@ typedef union Instruction {
 } Instruction;
 
 
+/*
+** Layout of the trie following an 'ITrie' instruction (whose next
+** element has the size of the whole instruction): each node starts
+** with the priority of the alternative ending there ('TRIENOTERM'
+** if none), the minimum priority of all alternatives below it, and
+** a header whose 'key' is the number of entries. A sparse node
+** follows with its sorted labels and then the offsets of its
+** children; a dense node ('aux' true) has one offset for each
+** label from 'code' on, 0 meaning no child. Offsets are relative
+** to the root node, right after the size element.
+*/
+#define TRIENOTERM	INT_MAX
+#define trieterm(n)	((n)[0].offset)
+#define triemin(n)	((n)[1].offset)
+#define triehead(n)	((n)[2].i)
+#define trielabels(n)	((n)[3].buff)
+#define triechildren(n)	((n) + 3 + \
+          (triehead(n).aux ? 0 : (triehead(n).key + sizeof(Instruction) - 1) \
+                                 / sizeof(Instruction)))
+
+
+/*
+** Memo table for rules ('lpeg.setpackrat'): a direct-mapped cache of
+** the results of calls, valid only for the match with generation
+** 'gen'. 'res' is the offset where the rule ended or -1 if it failed.
+*/
+typedef struct MemoEntry {
+  int rule;  /* offset of rule in the code */
+  int pos;  /* subject offset where the call started */
+  int res;
+  unsigned int gen;
+} MemoEntry;
+
+typedef struct Memo {
+  unsigned int gen;  /* generation of the running match */
+  int size;  /* number of entries (a power of 2) */
+  MemoEntry e[1];
+} Memo;
+
+
 int getposition (lua_State *L, int t, int i);
+const char *spanset (const byte *cs, const char *s, const char *e);
 void printpatt (Instruction *p, int n);
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop);
+                   Instruction *op, Capture *capture, int ptop, int sink);
 int verify (lua_State *L, Instruction *op, const Instruction *p,
             Instruction *e, int postable, int rule);
 void checkrule (lua_State *L, Instruction *op, int from, int to,
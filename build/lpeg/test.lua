@@ -218,6 +218,93 @@ for n = 1, 550 do
   assert(m.match(n3 * m.Cp() * n3 * n3, x) == n3 + 1)
 end
 
+-- tests for spans over long subjects (block-wise span code)
+do
+  local sets = { m.S" \t\n", m.R("az", "AZ", "09") + "_", m.P"a",
+                 m.R("\128\255"), m.S"\0\127\128\255", m.R("\0\255") - "x" }
+  for _, set in ipairs(sets) do
+    local span = set^0
+    local members = cs2str(set)
+    local stop = cs2str(-set * 1)
+    for n = 0, 70 do
+      local head = {}
+      for i = 1, n do
+        local k = (i * 7) % #members + 1
+        head[i] = string.sub(members, k, k)
+      end
+      head = table.concat(head)
+      assert(span:match(head) == n + 1)
+      for k = 1, #stop, 37 do
+        local x = head .. string.sub(stop, k, k) .. head
+        assert(span:match(x) == n + 1)
+        assert(m.match(m.P(1) * span, "x" .. x) == n + 2)
+      end
+    end
+  end
+  assert(m.match(m.S"ab"^0, string.rep("ab", 50000) .. "c") == 100001)
+end
+
+-- tests for literal strings and choices among them
+do
+  local long = string.rep("abc", 200) .. "d"
+  assert(m.match(long, long) == #long + 1)
+  assert(not m.match(long, string.sub(long, 1, -2)))
+  assert(not m.match(long, string.sub(long, 1, -2) .. "e"))
+  assert(m.match("hello" * m.P"world"^-1, "helloworld!") == 11)
+  assert(m.match(m.P"a\0b", "a\0bc") == 4)
+  assert(not m.match(m.P"a\0b", "a\0"))
+  assert(m.match(m.P"xy"^1, "xyxyx") == 5)
+
+  -- reference: first alternative that is a prefix of the subject
+  local function first (words, s)
+    for _, w in ipairs(words) do
+      if string.sub(s, 1, #w) == w then return #w + 1 end
+    end
+  end
+  local seed = 7
+  local function rand (n)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % n
+  end
+  local function randstr (n)
+    local t = {}
+    for i = 1, n do
+      local k = rand(4)
+      t[i] = string.sub("ab\0\255", k + 1, k + 1)
+    end
+    return table.concat(t)
+  end
+  for _ = 1, 50 do
+    local words = {}
+    local p = m.P(false)
+    for i = 1, rand(20) + 4 do
+      words[i] = randstr(rand(5) + (i == 1 and 1 or 0))
+      p = p + words[i]
+    end
+    for _ = 1, 20 do
+      local s = randstr(rand(6))
+      assert(p:match(s) == first(words, s))
+    end
+  end
+
+  -- many alternatives (dense and sparse nodes)
+  local words = {}
+  local p = m.P(false)
+  for i = 1, 300 do
+    words[i] = string.format("w%dx", i * 7919 % 1000)
+    p = p + words[i]
+  end
+  for i = 0, 999 do
+    local s = string.format("w%dxy", i)
+    assert(p:match(s) == first(words, s))
+  end
+  assert(m.match(m.Cs((p / "*" + 1)^0), "a" .. words[1] .. "b" .. words[2]
+                 .. "w1") == "a*b*w1")
+  assert(m.match(m.C(m.P"one" + "two" + "three" + "four") * m.P(1)^0,
+                 "threefour") == "three")
+end
+
+
 -- true values
 assert(m.P(0):match("x") == 1)
 assert(m.P(0):match("") == 1)
@@ -358,6 +445,201 @@ checkerr("undefined in given grammar", m.match, { m.V{} }, "")
 checkerr("rule 'A' is not a pattern", m.P, { m.P(1), A = {} })
 checkerr("grammar has no initial rule", m.P, { [print] = {} })
 
+-- tests for searches (find, gmatch, gsub)
+do
+  -- reference search with the grammar idiom
+  local function rfind (p, s, init)
+    local q = m.P{ m.Cp() * p * m.Cp() + 1 * m.V(1) }
+    local i, j = q:match(s, init)
+    if i then return i, j - 1 end
+  end
+  local subjects = {"", "a", "abc", "xxabcxx", "aaab", "ab\0cab\0c",
+                    string.rep("x", 100) .. "abc" .. string.rep("y", 50)}
+  local patts = {m.P"abc", m.P"c", m.S"bc" * "c", m.P"x"^0, m.R"az"^1,
+                 m.P"\0c", -m.P"x" * 1, m.B"a" * "b", m.P(false),
+                 m.P"a" + "b" + "c" + "ab", m.Cmt(1, function () return true end)}
+  for _, p in ipairs(patts) do
+    for _, s in ipairs(subjects) do
+      for init = -3, #s + 2, 2 do
+        local i, j = m.find(p, s, init)
+        local ri, rj = rfind(p, s, init)
+        assert(i == ri and j == rj)
+      end
+    end
+  end
+  checkeq({m.find(m.C"b" * m.Cp(), "abcb")}, {2, 2, "b", 3})
+  assert(m.find("b" * m.Carg(1), "abc", 1, "x") == 2)
+  assert(select(3, (m.P"b" * m.Carg(1)):find("abc", 1, "x")) == "x")
+  assert(not m.find("xyz", string.rep("xy", 1000)))
+  local n = 0
+  local q = m.Cmt("b", function () n = n + 1; return true end)
+  assert(m.find(q, "aaaaab") == 6 and n == 1)  -- 'a' positions skipped
+
+  local t = {}
+  for a, b in m.gmatch(m.C(m.R"az"^1) * "=" * m.C(m.R"09"^1), "a=1 bb=22, c=x")
+  do t[#t + 1] = a .. b end
+  checkeq(t, {"a1", "bb22"})
+  t = {}
+  for w in (m.R"az"^1):gmatch("one two  three", 5) do t[#t + 1] = w end
+  checkeq(t, {"two", "three"})
+  -- empty matches behave as in 'string.gmatch'
+  for _, s in ipairs{"", "axxb", "xx", "abxxxcx"} do
+    local t1, t2 = {}, {}
+    for w in m.gmatch(m.P"x"^0, s) do t1[#t1 + 1] = w end
+    for w in string.gmatch(s, "x*") do t2[#t2 + 1] = w end
+    checkeq(t1, t2)
+    assert(m.gsub(m.P"x"^0, s, "-") == string.gsub(s, "x*", "-"))
+  end
+
+  checkeq({m.gsub(m.R"09"^1, "a1b22c333", "<%0>")}, {"a<1>b<22>c<333>", 3})
+  checkeq({m.gsub(m.C(m.R"az"^1) * "=" * m.C(m.R"09"^1), "a=1, bb=22",
+                  "%2=%1%%")}, {"1=a%, 22=bb%", 2})
+  checkeq({m.gsub(m.R"az"^1, "hello world", string.upper)},
+          {"HELLO WORLD", 2})
+  checkeq({m.gsub(m.R"az"^1, "hello world", {hello = "HI"})},
+          {"HI world", 2})
+  assert(m.gsub(m.R"09"^1, "a12b", function () return false end) == "a12b")
+  assert(m.gsub(m.Cp(), "ab", "%1") == "1a2b3")
+  assert(m.gsub("b", "abc", 10) == "a10c")
+  checkerr("invalid capture index", m.gsub, "b", "abc", "%2")
+  checkerr("invalid use of '%'", m.gsub, "b", "abc", "%x")
+  checkerr("invalid replacement value", m.gsub, "b", "abc", function ()
+    return {} end)
+  local big = string.rep("ab", 10000)
+  assert(m.gsub("b", big, "xyz") == string.rep("axyz", 10000))
+end
+
+-- tests for streaming captures
+do
+  -- same values as a plain match, through many flushes
+  local function samevals (p, s)
+    local t = {}
+    assert(m.stream(p, s, t) == m.match(p / 0 * m.Cp(), s))
+    checkeq(t, {m.match(p, s)})
+  end
+  local sp = m.S" "^0
+  samevals((sp * (m.C(m.R"az"^1) + m.R"09"^1 / tonumber))^0,
+         string.rep("abc 12 de 7 ", 1000))
+  samevals((m.C"a" * m.C"b" * "x" + m.C"a" * m.C"b" * m.C"c" + m.C(1))^0,
+         string.rep("abcabxzab", 500))
+  samevals((m.Ct(m.C"a" * m.C"b"^0) + m.C(1))^0, string.rep("abbbacd", 1000))
+  samevals((m.C(m.C"a"^1 * "b") + 1)^0,
+         string.rep(string.rep("a", 40) .. "b..", 200))
+  samevals((m.Cmt(m.C(m.R"09"^1), function (_, i, c) return i, c + 1, "x" end)
+          + m.C(1))^0, string.rep("12a345b", 1000))
+  samevals((m.Cg(m.C(1), "k") * m.Cb"k")^0, string.rep("abcdef", 300))
+  samevals(m.C(1)^0 * "!" + m.C(1)^0, string.rep("xyz", 3000))
+
+  local n = 0
+  local r = m.stream((sp * m.Cg(m.C(m.R"az"^1) * m.Cp()))^0,
+                     string.rep("ab cd ", 1000), function (w, i)
+    n = n + 1
+    assert(w == (n % 2 == 1 and "ab" or "cd") and i == 3 * n)
+  end)
+  assert(n == 2000 and r == 6000)
+
+  local t = {}
+  assert(m.stream(m.C(1)^0 * "!", "abc", t) == nil)
+  t = {}
+  assert(m.stream(m.C(1)^0, "abcd", t, -2) == 5)
+  checkeq(t, {"c", "d"})
+  t = {10}
+  assert(m.stream(m.P"a"^0, "aa", t) == 3)
+  checkeq(t, {10})
+  checkerr("absent argument", m.stream, m.Carg(1), "a", {})
+  checkerr("table or function expected", m.stream, "a", "a")
+end
+
+-- tests for dump and undump
+do
+  local function roundtrip (p, ...)
+    local q = m.undump(m.dump(p))
+    assert(m.type(q) == "pattern")
+    for _, s in ipairs{...} do
+      checkeq({q:match(s)}, {p:match(s)})
+    end
+    assert(m.dump(q) == m.dump(p))
+    return q
+  end
+  roundtrip(m.P"abc" + m.R"09"^1 * m.Cp(), "abc", "123x", "x", "")
+  roundtrip(m.C(m.P"x"^0) * m.Cc(1, 2.5, true, false, "k"), "xxy", "")
+  roundtrip(m.Ct(m.Cg(m.C(1), "a") * m.Cg(m.C(1), 3)), "xy")
+  local g = roundtrip(m.P{"S", S = "(" * m.V"S"^0 * ")" + m.C(m.R"az"^1)},
+                      "(a(b)(c(d)))", "(a(", "x")
+  -- undumped patterns compose and keep their search skip
+  local q = m.Cs((g / "<%0>" + 1)^0)
+  assert(q:match("1(a)2b") == "1<(a)>2<b>")
+  assert(m.find(roundtrip(m.P"needle"), "hay needle") == 5)
+  local words = m.P(false)
+  for _, w in ipairs{"ab", "abc", "b", "bcd", "cde", "x"} do words = words + w end
+  roundtrip(m.Cs((words / "*" + 1)^0), "xabcdex", "bb")
+  checkerr("cannot dump pattern with a function", m.dump,
+           m.P(1) / print)
+  checkerr("cannot dump pattern with a table", m.dump, m.P(1) / {})
+  local d = m.dump(m.C(m.P"abc"))
+  checkerr("truncated dumped pattern", m.undump, d:sub(1, -2))
+  checkerr("corrupted dumped pattern", m.undump, d .. "x")
+  checkerr("incompatible dumped pattern", m.undump, "x" .. d:sub(2))
+  -- damaged dumps are rejected
+  d = m.dump(g)
+  for i = 1, #d do
+    local c = string.char((d:byte(i) + 1) % 256)
+    assert(not pcall(m.undump, d:sub(1, i - 1) .. c .. d:sub(i + 1)))
+  end
+  if string.pack then
+    -- with the checksum redone, bad trees and offsets are still caught
+    local fnv = load[[
+      local h = 2166136261
+      for i = 1, #... do h = ((h ~ (...):byte(i)) * 16777619) & 0xFFFFFFFF end
+      return h]]
+    for i = 16, #d - 4 do
+      for _, c in ipairs{0, 0x7f, 0xff} do
+        local s = d:sub(1, i - 1) .. string.char(c) .. d:sub(i + 1, -5)
+        local ok, q = pcall(m.undump, s .. string.pack("I4", fnv(s)))
+        if ok then pcall(m.match, q * 1, "(a(b)(c(d)))") end
+      end
+    end
+  end
+end
+
+
+-- tests for matchers
+do
+  local p = m.C(m.R"az"^1) * m.Cp() + m.Carg(1)
+  local mt = p:matcher()
+  assert(mt:match("abc1") == "abc" and select(2, mt:match("abc1")) == 4)
+  assert(mt:match("x1yz", 3) == "yz")
+  assert(mt:match("1", 1, "arg") == "arg")
+  assert(m.matcher("ab"):match("abc") == 3)
+  assert(m.matcher("ab"):match("ba") == nil)
+  -- capture lists that grow are kept
+  local t = m.Ct(m.C(1)^0):matcher()
+  local s = string.rep("abcd", 300)
+  for i = 1, 3 do
+    local r = t:match(s)
+    assert(#r == #s and r[1] == "a" and r[#r] == "d")
+  end
+  assert(#t:match("xyz") == 3)
+  -- a match-time capture reentering its own matcher
+  local inner
+  local re = m.Ct(m.C(1) * m.Cmt(m.C(1), function (s, i, c)
+    if #s > 4 then return true, 0 end
+    return true, #inner:match(string.rep(c, 100))
+  end) * m.C(1)^0)
+  inner = re:matcher()
+  checkeq(inner:match("abcd"), {"a", 100, "c", "d"})
+  -- batches
+  checkeq(m.matcher(m.C(m.R"az"^1)):match_all{"ab", "12", "cd3", 45},
+          {"ab", false, "cd", false})
+  checkerr("absent argument", mt.match_all, mt, {"1"})
+  checkeq(m.matcher(m.R"09"^1 / tonumber):match_all{"12", 34, "x"},
+          {12, 34, false})
+  assert(#mt:match_all{} == 0)
+  checkerr("bad element #2 in list", mt.match_all, mt, {"a", {}})
+  checkerr("table expected", mt.match_all, mt, "abc")
+  checkerr("lpeg-matcher expected", mt.match, {}, "abc")
+end
+
 -- grammar with a long call chain before left recursion
 p = {'a',
   a = m.V'b' * m.V'c' * m.V'd' * m.V'a',
@@ -568,6 +850,41 @@ assert(p:match(string.rep('a', 180) .. 'c' .. string.rep('b', 180)) == 362)
 
 m.setmaxstack(5)   -- restore original limit
 
+-- tests for step limit and memoization of rules
+do
+  -- each level tries 'T' three times: exponential without memoization
+  local g = m.P{"E", E = m.V"T" * "+" * m.V"E" + m.V"T" * "-" * m.V"E" + m.V"T",
+                     T = "(" * m.V"E" * ")" + "n"}
+  local function nest (n) return string.rep("(", n) .. "n" .. string.rep(")", n) end
+  m.setmaxstack(1000)
+  m.setmaxsteps(100000)
+  assert(g:match(nest(5)) == 12)
+  checkerr("too many steps in match", m.match, g, nest(40))
+  m.setpackrat(1024)
+  assert(g:match(nest(40)) == 82)
+  assert(g:match(nest(40) .. "+" .. nest(30) .. "-n") == 146)
+  assert(not g:match(")"))
+  -- rules with captures give the same values
+  local c = m.P{"S", S = m.Ct((m.V"A" * "," + m.V"A" * ";")^0),
+                     A = m.C(m.R"az"^1) + "(" * m.V"S" * ")"}
+  local subj = "a,(b;c,(d,e;);f;),g;"
+  m.setpackrat(4)  -- many collisions
+  local x = c:match(subj)
+  m.setpackrat()
+  checkeq(x, c:match(subj))
+  checkeq(x, {"a", {"b", "c", {"d", "e"}, "f"}, "g"})
+  -- memoization stops at match-time captures
+  local n = 0
+  local r = m.P{"S", S = m.V"R" * "x" + m.V"R" * "y",
+                     R = m.Cmt("a", function () n = n + 1; return true end)}
+  m.setpackrat(16)
+  assert(r:match("ay") == 3 and n == 2)
+  m.setpackrat()
+  m.setmaxsteps()
+  assert(g:match(nest(8)) == 18)
+end
+m.setmaxstack(5)
+
 -- tests for optional start position
 assert(m.match("a", "abc", 1))
 assert(m.match("b", "abc", 2))
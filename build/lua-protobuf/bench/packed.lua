@@ -0,0 +1,42 @@
+-- decode timings for packed repeated fields and multi-byte scalars,
+-- run from the lua-protobuf directory: lua bench/packed.lua
+local pb     = require "pb"
+local protoc = require "protoc"
+
+assert(protoc:load [[
+   syntax = "proto3";
+   message BenchPacked {
+      repeated int64   a = 1;
+      repeated sint32  z = 2;
+      repeated fixed32 f = 3;
+   }
+   message BenchScalars {
+      int64 a = 1; int64 b = 2; uint32 c = 3; int32 d = 4;
+      int64 e = 5; int64 f = 6; int64 g = 7; int64 h = 8;
+   } ]])
+
+local packed = { a = {}, z = {}, f = {} }
+for i = 1, 1000 do
+   packed.a[i] = i * 100003
+   packed.z[i] = (i % 2 == 0 and -i or i) * 37
+   packed.f[i] = i
+end
+local packed_data = pb.encode("BenchPacked", packed)
+local scalars_data = pb.encode("BenchScalars", {
+   a = 300, b = 70000, c = 1 << 30, d = -5,
+   e = 1 << 40, f = 123456789, g = 99, h = 1 << 50 })
+
+local function bench(name, n, f)
+   local best = math.huge
+   for _ = 1, 7 do
+      local c = os.clock()
+      for _ = 1, n do f() end
+      best = math.min(best, os.clock() - c)
+   end
+   print(("%-40s %.3fs"):format(name, best))
+end
+
+bench("1000-element packed x3, 2000 decodes", 2000,
+      function() return pb.decode("BenchPacked", packed_data) end)
+bench("8 multi-byte scalars, 200000 decodes", 200000,
+      function() return pb.decode("BenchScalars", scalars_data) end)
@@ -118,6 +118,11 @@ static int lua53_rawgetp(lua_State *L, int idx, const void *p)
 { return lua_rawgetp(L, idx, p), lua_type(L, -1); }
 #endif
 
+#if LUA_VERSION_NUM < 502
+# define lua_getuservalue lua_getfenv
+# define lua_setuservalue lua_setfenv
+#endif
+
 
 /* protobuf global state */
 
@@ -127,17 +132,88 @@ static int lua53_rawgetp(lua_State *L, int idx, const void *p)
 static const pb_State *global_state = NULL;
 static const char state_name[] = PB_STATE;
 
+/* schema shared read-only by every lua_State of the process; attached
+ * states hold a reference, the current slot holds another one */
+
+#if defined(__GNUC__)
+typedef volatile long lpb_Lock;
+# define LPB_LOCKINIT   0
+# define lpb_trylock(l) (__sync_lock_test_and_set((l), 1) == 0)
+# define lpb_unlock(l)  __sync_lock_release(l)
+#elif defined(_MSC_VER)
+# include <intrin.h>
+typedef volatile long lpb_Lock;
+# define LPB_LOCKINIT   0
+# define lpb_trylock(l) (_InterlockedExchange((l), 1) == 0)
+# define lpb_unlock(l)  ((void)_InterlockedExchange((l), 0))
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+        && !defined(__STDC_NO_ATOMICS__)
+# include <stdatomic.h>
+typedef atomic_flag lpb_Lock;
+# define LPB_LOCKINIT   ATOMIC_FLAG_INIT
+# define lpb_trylock(l) (!atomic_flag_test_and_set(l))
+# define lpb_unlock(l)  atomic_flag_clear(l)
+#else
+# error "pb.share() needs atomics: use GCC, Clang, MSVC or a C11 compiler"
+#endif
+
+typedef struct lpb_Shared {
+    pb_State state;
+    long     refs;
+} lpb_Shared;
+
+static lpb_Shared *shared_current = NULL;
+static lpb_Lock shared_lock = LPB_LOCKINIT;
+
+#define lpb_lockshared()   while (!lpb_trylock(&shared_lock))
+#define lpb_unlockshared() lpb_unlock(&shared_lock)
+
+static lpb_Shared *lpb_acquireshared(void) {
+    lpb_Shared *sh;
+    lpb_lockshared();
+    if ((sh = shared_current) != NULL) ++sh->refs;
+    lpb_unlockshared();
+    return sh;
+}
+
+static void lpb_releaseshared(lpb_Shared *sh) {
+    long refs;
+    if (sh == NULL) return;
+    lpb_lockshared();
+    refs = --sh->refs;
+    lpb_unlockshared();
+    if (refs == 0) pb_free(&sh->state), free(sh);
+}
+
+static void lpb_publishshared(lpb_Shared *sh, long refs) {
+    lpb_Shared *old;
+    sh->refs = refs;
+    lpb_lockshared();
+    old = shared_current, shared_current = sh;
+    lpb_unlockshared();
+    lpb_releaseshared(old);
+}
+
 enum lpb_Int64Mode { LPB_NUMBER, LPB_STRING, LPB_HEXSTRING };
 enum lpb_DefMode   { LPB_DEFDEF, LPB_COPYDEF, LPB_METADEF, LPB_NODEF };
 
+#ifndef LPB_SCRATCH_LIMIT
+# define LPB_SCRATCH_LIMIT (4u << 20) /* default for pb.scratch_limit() */
+#endif
+
 typedef struct lpb_State {
     const pb_State *state;
+    lpb_Shared *shared; /* attached shared schema */
     pb_State  local;
     pb_Cache  cache;
     pb_Buffer buffer;
     int defs_index;
     int enc_hooks_index;
     int dec_hooks_index;
+    int plans_index;
+    size_t scratch_limit; /* largest encode buffer kept between encodes */
+    const pb_State *plans_state; /* state and its gen the plans are for */
+    unsigned plans_gen;
     unsigned use_dec_hooks : 1;
     unsigned use_enc_hooks : 1;
     unsigned enum_as_value : 1;
@@ -169,6 +245,43 @@ static void lpb_pushenchooktable(lua_State *L, lpb_State *LS)
 static void lpb_pushdechooktable(lua_State *L, lpb_State *LS)
 { LS->dec_hooks_index = lpb_reftable(L, LS->dec_hooks_index); }
 
+static void lpb_resetplans(lua_State *L, lpb_State *LS) {
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->plans_index);
+    LS->plans_index = LUA_NOREF;
+}
+
+/* plans hold pb_Type and pb_Field pointers, so they are dropped whenever
+ * the pb_State changes, including through another lua_State sharing it
+ * with pb.use "global" */
+static void lpb_pushplantable(lua_State *L, lpb_State *LS) {
+    const pb_State *S = lpbS_state(LS);
+    if (LS->plans_state != S || LS->plans_gen != S->gen) {
+        lpb_resetplans(L, LS);
+        LS->plans_state = S, LS->plans_gen = S->gen;
+    }
+    LS->plans_index = lpb_reftable(L, LS->plans_index);
+}
+
+static void lpb_typeschanged(lua_State *L, lpb_State *LS)
+{ lpb_resetplans(L, LS); }
+
+/* pb_free() + pb_init() that keeps the generation moving forward, the
+ * same pb_State may be in use by other lua_States */
+static void lpb_resetlocal(lpb_State *LS, int dofree) {
+    unsigned gen = LS->local.gen;
+    if (dofree) pb_free(&LS->local);
+    pb_init(&LS->local);
+    LS->local.gen = gen + 1;
+}
+
+static void lpb_detach(lpb_State *LS) {
+    if (LS->shared == NULL) return;
+    if (LS->state == &LS->shared->state)
+        LS->state = &LS->local;
+    lpb_releaseshared(LS->shared);
+    LS->shared = NULL;
+}
+
 static int Lpb_delete(lua_State *L) {
     lpb_State *LS = (lpb_State*)luaL_testudata(L, 1, PB_STATE);
     if (LS != NULL) {
@@ -176,11 +289,13 @@ static int Lpb_delete(lua_State *L) {
         pb_free(&LS->local);
         if (&LS->local == GS)
             global_state = NULL;
+        lpb_detach(LS);
         LS->state = NULL;
         pb_resetbuffer(&LS->buffer);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->enc_hooks_index);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->dec_hooks_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->plans_index);
     }
     return 0;
 }
@@ -197,6 +312,8 @@ LUALIB_API lpb_State *lpb_lstate(lua_State *L) {
         LS->defs_index = LUA_NOREF;
         LS->enc_hooks_index = LUA_NOREF;
         LS->dec_hooks_index = LUA_NOREF;
+        LS->plans_index = LUA_NOREF;
+        LS->scratch_limit = LPB_SCRATCH_LIMIT;
         LS->state = &LS->local;
         pb_init(&LS->local);
         pb_initbuffer(&LS->buffer);
@@ -1189,6 +1306,9 @@ LUALIB_API const pb_Type *lpb_type(lpb_State *LS, pb_Slice s) {
     return t;
 }
 
+LUALIB_API const pb_State *lpb_state(lpb_State *LS)
+{ return lpbS_state(LS); }
+
 static const pb_Field *lpb_field(lua_State *L, int idx, const pb_Type *t) {
     lpb_State *LS = lpb_lstate(L);
     int isint, number = (int)lua_tointegerx(L, idx, &isint);
@@ -1196,11 +1316,22 @@ static const pb_Field *lpb_field(lua_State *L, int idx, const pb_Type *t) {
     return pb_fname(t, lpb_name(LS, lpb_checkslice(L, idx)));
 }
 
+/* types are loaded into the state's own pb_State, which an attached
+ * state does not read */
+static void lpb_checkdetached(lua_State *L, lpb_State *LS) {
+    if (LS->shared != NULL)
+        luaL_error(L, "state is attached to a shared schema, "
+                "call pb.detach() first");
+}
+
 static int Lpb_load(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
     pb_Slice s = lpb_checkslice(L, 1);
-    int r = pb_load(&LS->local, &s);
+    int r;
+    lpb_checkdetached(L, LS);
+    r = pb_load(&LS->local, &s);
     if (r == PB_OK) global_state = &LS->local;
+    lpb_typeschanged(L, LS);
     lua_pushboolean(L, r == PB_OK);
     lua_pushinteger(L, pb_pos(s)+1);
     return 2;
@@ -1213,7 +1344,9 @@ static int Lpb_loadfile(lua_State *L) {
     pb_Buffer b;
     pb_Slice s;
     int ret;
-    FILE *fp = fopen(filename, "rb");
+    FILE *fp;
+    lpb_checkdetached(L, LS);
+    fp = fopen(filename, "rb");
     if (fp == NULL)
         return luaL_fileresult(L, 0, filename);
     pb_initbuffer(&b);
@@ -1227,12 +1360,25 @@ static int Lpb_loadfile(lua_State *L) {
     s = pb_result(&b);
     ret = pb_load(&LS->local, &s);
     if (ret == PB_OK) global_state = &LS->local;
+    lpb_typeschanged(L, LS);
     pb_resetbuffer(&b);
     lua_pushboolean(L, ret == PB_OK);
     lua_pushinteger(L, pb_pos(s)+1);
     return 2;
 }
 
+static int Lpb_dump(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    pb_Buffer b;
+    int r;
+    pb_initbuffer(&b);
+    r = pb_dump(lpbS_state(LS), &b);
+    if (r == PB_OK) lua_pushlstring(L, pb_buffer(&b), pb_bufflen(&b));
+    pb_resetbuffer(&b);
+    if (r != PB_OK) return luaL_error(L, "out of memory");
+    return 1;
+}
+
 static int lpb_pushtype(lua_State *L, const pb_Type *t) {
     if (t == NULL) return 0;
     lua_pushstring(L, (const char*)t->name);
@@ -1474,13 +1620,15 @@ static int Lpb_clear(lua_State *L) {
     pb_State *S = (pb_State*)LS->state;
     pb_Type *t;
     if (lua_isnoneornil(L, 1)) {
-        pb_free(&LS->local), pb_init(&LS->local);
+        lpb_detach(LS);
+        lpb_resetlocal(LS, 1);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
         LS->defs_index = LUA_NOREF;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->enc_hooks_index);
         LS->enc_hooks_index = LUA_NOREF;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->dec_hooks_index);
         LS->dec_hooks_index = LUA_NOREF;
+        lpb_typeschanged(L, LS);
         return 0;
     }
     LS->state = &LS->local;
@@ -1489,6 +1637,7 @@ static int Lpb_clear(lua_State *L) {
     else pb_delfield(&LS->local, t, (pb_Field*)lpb_field(L, 2, t));
     LS->state = S;
     lpb_cleardefmeta(L, LS, t);
+    lpb_typeschanged(L, LS);
     return 0;
 }
 
@@ -1528,9 +1677,116 @@ typedef struct lpb_Env {
     lpb_State *LS;
     pb_Buffer *b;
     pb_Slice *s;
+    int plans; /* stack index of the plan table */
 } lpb_Env;
 
-static void lpbE_encode (lpb_Env *e, const pb_Type *t);
+static void lpbE_encode (lpb_Env *e, const pb_Type *t, int withlen);
+
+/* per type plans: a dense number->field array for decoding and the fields
+ * in number order for encoding, with the field names pinned as Lua strings
+ * in the plan's uservalue table (keyed by number, oneof names keyed by
+ * field), so neither direction hashes tags nor interns names. Built on
+ * first use, dropped when types or options change. */
+
+#define LPB_PLANSLACK 64 /* spare dense slots for sparse numbers */
+
+typedef struct lpb_PlanField {
+    const pb_Field *f;
+    unsigned char   tag[5]; /* encoded field key */
+    unsigned char   taglen;
+} lpb_PlanField;
+
+typedef struct lpb_Plan {
+    int32_t         base;      /* number of fields[0] */
+    unsigned        count;
+    unsigned        nfields;
+    size_t          size_hint; /* last encoded size, to reserve its length */
+    lpb_PlanField  *order;     /* fields by number */
+    const pb_Field *fields[1];
+} lpb_Plan;
+
+static int lpb_cmpfield(const void *a, const void *b) {
+    int32_t na = ((const lpb_PlanField*)a)->f->number;
+    int32_t nb = ((const lpb_PlanField*)b)->f->number;
+    return na < nb ? -1 : na > nb;
+}
+
+static lpb_Plan *lpb_newplan(lua_State *L, const pb_Type *t) {
+    const pb_Field *f = NULL;
+    int32_t lo = 0, hi = -1;
+    unsigned count, nfields = 0, limit = t->field_count*2 + LPB_PLANSLACK;
+    uint64_t span;
+    size_t size;
+    lpb_Plan *p;
+    while (pb_nextfield(t, &f)) {
+        ++nfields;
+        if (hi < lo)                  lo = hi = f->number;
+        else if (f->number < lo)      lo = f->number;
+        else if (f->number > hi)      hi = f->number;
+    }
+    /* enum values may span the whole int32_t range */
+    span = hi < lo ? 0 : (uint64_t)((int64_t)hi - (int64_t)lo) + 1;
+    count = span > limit ? limit : (unsigned)span;
+    size = sizeof(lpb_Plan) + (count ? count - 1 : 0) * sizeof(const pb_Field*);
+    p = (lpb_Plan*)lua_newuserdata(L, size + nfields * sizeof(lpb_PlanField));
+    p->base = lo, p->count = count, p->nfields = 0, p->size_hint = 0;
+    p->order = (lpb_PlanField*)((char*)p + size);
+    memset(p->fields, 0, (count ? count : 1) * sizeof(const pb_Field*));
+    luaL_checkstack(L, 4, "not enough stack space for plan");
+    lua_createtable(L, hi > 0 && (unsigned)hi <= limit ? (int)hi : 0,
+            t->field_count);
+    while (pb_nextfield(t, &f)) {
+        unsigned idx = (uint32_t)f->number - (uint32_t)lo;
+        lpb_PlanField *pf = &p->order[p->nfields++];
+        int wtype = f->repeated && f->packed ?
+            PB_TBYTES : pb_wtypebytype(f->type_id);
+        pf->f = f;
+        pf->taglen = (unsigned char)pb_write32((char*)pf->tag,
+                pb_pair((uint32_t)f->number, wtype));
+        if (idx < count) p->fields[idx] = f;
+        lua_pushstring(L, (const char*)f->name);
+        lua_rawseti(L, -2, f->number);
+        if (f->oneof_idx) {
+            lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+            lua_rawsetp(L, -2, f);
+        }
+    }
+    if (t->is_enum) { /* names map back to values, aliases included */
+        const pb_Entry *ent = NULL;
+        while (pb_nextentry(&t->field_names, &ent)) {
+            const pb_Field *ev = ((const pb_FieldEntry*)ent)->value;
+            if (ev == NULL) continue;
+            lua_pushstring(L, (const char*)ev->name);
+            lua_pushinteger(L, ev->number);
+            lua_rawset(L, -3);
+        }
+    }
+    qsort(p->order, p->nfields, sizeof(lpb_PlanField), lpb_cmpfield);
+    lua_setuservalue(L, -2);
+    return p;
+}
+
+static lpb_Plan *lpb_pushplan(lpb_Env *e, const pb_Type *t) {
+    lua_State *L = e->L;
+    lpb_Plan *p;
+    if (lua53_rawgetp(L, e->plans, t) == LUA_TUSERDATA)
+        p = (lpb_Plan*)lua_touserdata(L, -1);
+    else {
+        lua_pop(L, 1);
+        p = lpb_newplan(L, t);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, e->plans, t);
+    }
+    lua_getuservalue(L, -1);
+    lua_remove(L, -2);
+    return p;
+}
+
+static const pb_Field *lpb_planfield(const lpb_Plan *p, const pb_Type *t, int32_t number) {
+    unsigned idx = (uint32_t)number - (uint32_t)p->base;
+    return idx < p->count ? p->fields[idx] : pb_field(t, number);
+}
+
 
 static void lpb_checktable(lua_State *L, const pb_Field *f) {
     argcheck(L, lua_istable(L, -1),
@@ -1551,16 +1807,27 @@ static void lpb_useenchooks(lua_State *L, lpb_State *LS, const pb_Type *t) {
     lua_pop(L, 2);
 }
 
+static int lpbE_enumvalue(lpb_Env *e, const pb_Type *t) {
+    lua_State *L = e->L;
+    int found;
+    if (t == NULL) return 0;
+    lpb_pushplan(e, t);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    if ((found = lua_type(L, -1) == LUA_TNUMBER))
+        pb_addvarint32(e->b, (uint32_t)lua_tointeger(L, -1));
+    lua_pop(L, 2);
+    return found;
+}
+
 static void lpbE_enum(lpb_Env *e, const pb_Field *f) {
     lua_State *L = e->L;
     pb_Buffer *b = e->b;
-    const pb_Field *ev;
     int type = lua_type(L, -1);
     if (type == LUA_TNUMBER)
         pb_addvarint64(b, (uint64_t)lua_tonumber(L, -1));
-    else if ((ev = pb_fname(f->type,
-                    lpb_name(e->LS, lpb_toslice(L, -1)))) != NULL)
-        pb_addvarint32(b, ev->number);
+    else if (type == LUA_TSTRING && lpbE_enumvalue(e, f->type))
+        ;
     else if (type != LUA_TSTRING)
         argcheck(L, 0, 2, "number/string expected at field '%s', got %s",
                 (const char*)f->name, luaL_typename(L, -1));
@@ -1569,10 +1836,50 @@ static void lpbE_enum(lpb_Env *e, const pb_Field *f) {
                 lua_tostring(L, -1), (const char*)f->name);
 }
 
+static void lpbE_addtag(lpb_Env *e, const lpb_PlanField *pf) {
+    char *p = pb_prepbuffsize(e->b, pf->taglen);
+    if (p == NULL) luaL_error(e->L, "encode bytes fail");
+    memcpy(p, pf->tag, pf->taglen);
+    pb_addsize(e->b, pf->taglen);
+}
+
+/* length prefixes reserve the bytes an estimate of the length needs, the
+ * body is moved only when the real length needs a different size */
+static size_t lpbE_beginlen(lpb_Env *e, size_t estimate) {
+    char buff[10];
+    size_t ml = pb_write64(buff, estimate);
+    if (pb_prepbuffsize(e->b, ml) == NULL)
+        luaL_error(e->L, "encode bytes fail");
+    pb_addsize(e->b, ml);
+    return ml;
+}
+
+static size_t lpbE_endlen(lpb_Env *e, size_t start, size_t reserved) {
+    pb_Buffer *b = e->b;
+    size_t len = pb_bufflen(b) - start - reserved;
+    char buff[10];
+    size_t ml = pb_write64(buff, len);
+    if (ml != reserved) {
+        if (ml > reserved && pb_prepbuffsize(b, ml - reserved) == NULL)
+            luaL_error(e->L, "encode bytes fail");
+        memmove(pb_buffer(b)+start+ml, pb_buffer(b)+start+reserved, len);
+        pb_bufflen(b) = (unsigned)(start + ml + len);
+    }
+    memcpy(pb_buffer(b)+start, buff, ml);
+    return len;
+}
+
+static size_t lpbE_packedsize(const pb_Field *f, size_t count) {
+    switch (pb_wtypebytype(f->type_id)) {
+    case PB_T64BIT: return count * 8;
+    case PB_T32BIT: return count * 4;
+    default:        return count;
+    }
+}
+
 static void lpbE_field(lpb_Env *e, const pb_Field *f, size_t *plen) {
     lua_State *L = e->L;
     pb_Buffer *b = e->b;
-    size_t len;
     int ltype;
     if (plen) *plen = 0;
     switch (f->type_id) {
@@ -1584,9 +1891,7 @@ static void lpbE_field(lpb_Env *e, const pb_Field *f, size_t *plen) {
     case PB_Tmessage:
         if (e->LS->use_enc_hooks) lpb_useenchooks(L, e->LS, f->type);
         lpb_checktable(L, f);
-        len = pb_bufflen(b);
-        lpbE_encode(e, f->type);
-        lpb_addlength(L, b, len);
+        lpbE_encode(e, f->type, 1);
         break;
 
     default:
@@ -1598,44 +1903,50 @@ static void lpbE_field(lpb_Env *e, const pb_Field *f, size_t *plen) {
     }
 }
 
-static void lpbE_tagfield(lpb_Env *e, const pb_Field *f, int ignorezero) {
-    size_t hlen = pb_addvarint32(e->b,
-            pb_pair(f->number, pb_wtypebytype(f->type_id)));
+static void lpbE_tagfield(lpb_Env *e, const lpb_PlanField *pf, int ignorezero) {
     size_t ignoredlen;
-    lpbE_field(e, f, &ignoredlen);
+    lpbE_addtag(e, pf);
+    lpbE_field(e, pf->f, &ignoredlen);
     if (!e->LS->encode_default_values && ignoredlen != 0 && ignorezero)
-        e->b->size -= (unsigned)(ignoredlen + hlen);
+        e->b->size -= (unsigned)(ignoredlen + pf->taglen);
 }
 
-static void lpbE_map(lpb_Env *e, const pb_Field *f) {
+static void lpbE_map(lpb_Env *e, const lpb_PlanField *pf) {
     lua_State *L = e->L;
-    const pb_Field *kf = pb_field(f->type, 1);
-    const pb_Field *vf = pb_field(f->type, 2);
-    if (kf == NULL || vf == NULL) return;
+    const pb_Field *f = pf->f;
+    lpb_Plan *mp = lpb_pushplan(e, f->type); /* entry: key 1, value 2 */
+    lua_pop(L, 1);
+    if (mp->nfields < 2 || mp->order[0].f->number != 1
+            || mp->order[1].f->number != 2)
+        return;
     lpb_checktable(L, f);
     lua_pushnil(L);
     while (lua_next(L, -2)) {
-        size_t len;
-        pb_addvarint32(e->b, pb_pair(f->number, PB_TBYTES));
-        len = pb_bufflen(e->b);
+        size_t start, reserved;
+        lpbE_addtag(e, pf);
+        start = pb_bufflen(e->b);
+        reserved = lpbE_beginlen(e, mp->size_hint);
         lua_pushvalue(L, -2);
-        lpbE_tagfield(e, kf, 1);
+        lpbE_tagfield(e, &mp->order[0], 1);
         lua_pop(L, 1);
-        lpbE_tagfield(e, vf, 1);
+        lpbE_tagfield(e, &mp->order[1], 1);
         lua_pop(L, 1);
-        lpb_addlength(L, e->b, len);
+        mp->size_hint = lpbE_endlen(e, start, reserved);
     }
 }
 
-static void lpbE_repeated(lpb_Env *e, const pb_Field *f) {
+static void lpbE_repeated(lpb_Env *e, const lpb_PlanField *pf) {
     lua_State *L = e->L;
+    const pb_Field *f = pf->f;
     pb_Buffer *b = e->b;
     int i;
     lpb_checktable(L, f);
     if (f->packed) {
-        size_t len, bufflen = pb_bufflen(b);
-        pb_addvarint32(b, pb_pair(f->number, PB_TBYTES));
-        len = pb_bufflen(b);
+        size_t start, reserved, bufflen = pb_bufflen(b);
+        lpbE_addtag(e, pf);
+        start = pb_bufflen(b);
+        reserved = lpbE_beginlen(e,
+                lpbE_packedsize(f, (size_t)lua_rawlen(L, -1)));
         for (i = 1; lua53_rawgeti(L, -1, i) != LUA_TNIL; ++i) {
             lpbE_field(e, f, NULL);
             lua_pop(L, 1);
@@ -1643,46 +1954,58 @@ static void lpbE_repeated(lpb_Env *e, const pb_Field *f) {
         if (i == 1)
             pb_bufflen(b) = bufflen;
         else
-            lpb_addlength(L, b, len);
+            lpbE_endlen(e, start, reserved);
     } else {
         for (i = 1; lua53_rawgeti(L, -1, i) != LUA_TNIL; ++i) {
-            lpbE_tagfield(e, f, 0);
+            lpbE_tagfield(e, pf, 0);
             lua_pop(L, 1);
         }
     }
     lua_pop(L, 1);
 }
 
-static void lpb_encode_onefield(lpb_Env *e, const pb_Type *t, const pb_Field *f) {
+static void lpb_encode_onefield(lpb_Env *e, const pb_Type *t, const lpb_PlanField *pf) {
+    const pb_Field *f = pf->f;
     if (f->type && f->type->is_map)
-        lpbE_map(e, f);
+        lpbE_map(e, pf);
     else if (f->repeated)
-        lpbE_repeated(e, f);
+        lpbE_repeated(e, pf);
     else if (!f->type || !f->type->is_dead)
-        lpbE_tagfield(e, f, t->is_proto3 && !f->oneof_idx);
+        lpbE_tagfield(e, pf, t->is_proto3 && !f->oneof_idx);
 }
 
-static void lpbE_encode(lpb_Env *e, const pb_Type *t) {
+static void lpbE_encode(lpb_Env *e, const pb_Type *t, int withlen) {
     lua_State *L = e->L;
-    luaL_checkstack(L, 3, "message too many levels");
-    if (e->LS->encode_order) {
-        const pb_Field *f = NULL;
-        while (pb_nextfield(t, &f)) {
-            if (lua53_getfield(L, -1, (const char*)f->name) != LUA_TNIL)
-                lpb_encode_onefield(e, t, f);
-            lua_pop(L, 1);
-        }
-    } else {
-        lua_pushnil(L);
-        while (lua_next(L, -2)) {
-            if (lua_type(L, -2) == LUA_TSTRING) {
-                const pb_Field *f =
-                    pb_fname(t, lpb_name(e->LS, lpb_toslice(L, -2)));
-                if (f != NULL) lpb_encode_onefield(e, t, f);
-            }
-            lua_pop(L, 1);
-        }
+    size_t start = pb_bufflen(e->b), reserved = 0;
+    lpb_Plan *p;
+    unsigned i;
+    luaL_checkstack(L, 4, "message too many levels");
+    p = lpb_pushplan(e, t);
+    if (withlen) reserved = lpbE_beginlen(e, p->size_hint);
+    for (i = 0; i < p->nfields; ++i) {
+        const lpb_PlanField *pf = &p->order[i];
+        lua_rawgeti(L, -1, pf->f->number);
+        if (e->LS->encode_order)
+            lua_gettable(L, -3);
+        else
+            lua_rawget(L, -3);
+        if (!lua_isnil(L, -1)) lpb_encode_onefield(e, t, pf);
+        lua_pop(L, 1);
     }
+    lua_pop(L, 1);
+    if (withlen) p->size_hint = lpbE_endlen(e, start, reserved);
+}
+
+static pb_Buffer *lpb_scratch(lpb_State *LS)
+{ pb_bufflen(&LS->buffer) = 0; return &LS->buffer; }
+
+static void lpb_pushscratch(lua_State *L, lpb_State *LS) {
+    pb_Buffer *b = &LS->buffer;
+    lua_pushlstring(L, pb_buffer(b), pb_bufflen(b));
+    if (pb_onheap(b) && b->u.h.capacity > LS->scratch_limit)
+        pb_resetbuffer(b);
+    else
+        pb_bufflen(b) = 0;
 }
 
 static int Lpb_encode(lua_State *L) {
@@ -1691,17 +2014,44 @@ static int Lpb_encode(lua_State *L) {
     lpb_Env e;
     argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
     luaL_checktype(L, 2, LUA_TTABLE);
-    e.L = L, e.LS = LS, e.b = test_buffer(L, 3);
-    if (e.b == NULL) pb_resetbuffer(e.b = &LS->buffer);
+    e.L = L, e.LS = LS, e.plans = 4, e.b = test_buffer(L, 3);
+    if (e.b == NULL) e.b = lpb_scratch(LS);
+    lua_settop(L, 3);
+    lpb_pushplantable(L, LS);
     lua_pushvalue(L, 2);
     if (e.LS->use_enc_hooks) lpb_useenchooks(L, e.LS, t);
-    lpbE_encode(&e, t);
+    lpbE_encode(&e, t, 0);
     if (e.b != &LS->buffer)
         lua_settop(L, 3);
-    else {
-        lua_pushlstring(L, pb_buffer(e.b), pb_bufflen(e.b));
-        pb_resetbuffer(e.b);
+    else
+        lpb_pushscratch(L, LS);
+    return 1;
+}
+
+static int Lpb_encode_stream(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(LS, lpb_checkslice(L, 1));
+    lpb_Env e;
+    lua_Integer i, n;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    e.L = L, e.LS = LS, e.plans = 4, e.b = test_buffer(L, 3);
+    if (e.b == NULL) e.b = lpb_scratch(LS);
+    lua_settop(L, 3);
+    lpb_pushplantable(L, LS);
+    n = (lua_Integer)lua_rawlen(L, 2);
+    for (i = 1; i <= n; ++i) {
+        if (lua53_rawgeti(L, 2, i) != LUA_TTABLE)
+            luaL_error(L, "table expected at index %d, got %s",
+                    (int)i, luaL_typename(L, -1));
+        if (e.LS->use_enc_hooks) lpb_useenchooks(L, e.LS, t);
+        lpbE_encode(&e, t, 1);
+        lua_pop(L, 1);
     }
+    if (e.b != &LS->buffer)
+        lua_settop(L, 3);
+    else
+        lpb_pushscratch(L, LS);
     return 1;
 }
 
@@ -1742,29 +2092,94 @@ static void lpb_pushtypetable(lua_State *L, lpb_State *LS, const pb_Type *t) {
     }
 }
 
-static void lpb_fetchtable(lpb_Env *e, const pb_Field *f) {
+static int lpb_pushenumname(lpb_Env *e, const pb_Type *t, int32_t value) {
     lua_State *L = e->L;
-    if (lua53_getfield(L, -1, (const char*)f->name) == LUA_TNIL) {
+    if (t == NULL) return 0;
+    lpb_pushplan(e, t);
+    lua_rawgeti(L, -1, value);
+    lua_remove(L, -2);
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 1);
+    return 0;
+}
+
+static void lpb_fetchtable(lpb_Env *e, const pb_Field *f, int names, int narr) {
+    lua_State *L = e->L;
+    lua_rawgeti(L, names, f->number);
+    lua_pushvalue(L, -1);
+    lua_gettable(L, names - 1);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, narr, 0);
+        lua_pushvalue(L, -1);
+        lua_insert(L, -3);
+        lua_settable(L, names - 1);
+    } else
+        lua_remove(L, -2);
+}
+
+/* proto3 default copies come from a {name, value, ...} array kept in the
+ * names table, fields needing a fresh table store the field pointer */
+static void lpb_pushdefcopy(lpb_Env *e, const pb_Type *t) {
+    lua_State *L = e->L;
+    int i, n = 0;
+    luaL_checkstack(L, 5, "not enough stack space for defaults");
+    lpb_pushplan(e, t);
+    if (lua53_rawgetp(L, -1, t) != LUA_TTABLE) {
+        const pb_Field *f = NULL;
         lua_pop(L, 1);
         lua_newtable(L);
+        while (pb_nextfield(t, &f)) {
+            if (f->oneof_idx) continue;
+            if (f->repeated || f->type_id == PB_Tmessage)
+                lua_pushlightuserdata(L, (void*)f);
+            else if (!lpb_pushdeffield(L, e->LS, f, t->is_proto3))
+                continue;
+            lua_rawgeti(L, -3, f->number);
+            lua_rawseti(L, -3, ++n);
+            lua_rawseti(L, -2, ++n);
+        }
         lua_pushvalue(L, -1);
-        lua_setfield(L, -3, (const char*)f->name);
+        lua_rawsetp(L, -3, t);
+    }
+    n = (int)lua_rawlen(L, -1);
+    lpb_newtypetable(L, t, 0);
+    for (i = 1; i <= n; i += 2) {
+        lua_rawgeti(L, -2, i);
+        lua_rawgeti(L, -3, i + 1);
+        if (lua_islightuserdata(L, -1)) {
+            const pb_Field *f = (const pb_Field*)lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            if (!lpb_pushdeffield(L, e->LS, f, t->is_proto3)) {
+                lua_pop(L, 1);
+                continue;
+            }
+        }
+        lua_rawset(L, -3);
     }
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+}
+
+static void lpbD_pushtypetable(lpb_Env *e, const pb_Type *t) {
+    int mode = e->LS->default_mode;
+    if ((t->is_proto3 && mode == LPB_DEFDEF ? LPB_COPYDEF : mode) == LPB_COPYDEF)
+        lpb_pushdefcopy(e, t);
+    else
+        lpb_pushtypetable(e->L, e->LS, t);
 }
 
 static void lpbD_rawfield(lpb_Env *e, const pb_Field *f) {
     lua_State *L = e->L;
     pb_Slice sv, *s = e->s;
-    const pb_Field *ev = NULL;
     uint64_t u64;
     switch (f->type_id) {
     case PB_Tenum:
         if (pb_readvarint64(s, &u64) == 0)
             luaL_error(L, "invalid varint value at offset %d", pb_pos(*s)+1);
-        if (!lpb_lstate(L)->enum_as_value)
-            ev = pb_field(f->type, (int32_t)u64);
-        if (ev) lua_pushstring(L, (const char*)ev->name);
-        else lpb_pushinteger(L, (lua_Integer)u64, lpb_lstate(L)->int64_mode);
+        if (e->LS->enum_as_value
+                || !lpb_pushenumname(e, f->type, (int32_t)u64))
+            lpb_pushinteger(L, (lua_Integer)u64, e->LS->int64_mode);
         if (e->LS->use_dec_hooks) lpb_usedechooks(L, e->LS, f->type);
         break;
 
@@ -1773,7 +2188,7 @@ static void lpbD_rawfield(lpb_Env *e, const pb_Field *f) {
         if (f->type == NULL || f->type->is_dead)
             lua_pushnil(L);
         else {
-            lpb_pushtypetable(L, e->LS, f->type);
+            lpbD_pushtypetable(e, f->type);
             lpb_withinput(e, &sv, lpbD_message(e, f->type));
         }
         break;
@@ -1805,73 +2220,131 @@ static void lpbD_map(lpb_Env *e, const pb_Field *f) {
     lua_State *L = e->L;
     pb_Slice p, *s = e->s;
     int mask = 0, top = lua_gettop(L);
+    const pb_Field *kv[2];
     uint32_t tag;
     lpb_readbytes(L, s, &p);
     if (f->type == NULL) return;
+    kv[0] = pb_field(f->type, 1);
+    kv[1] = pb_field(f->type, 2);
+    if (kv[0] == NULL || kv[1] == NULL) return; /* entry fields cleared */
     lua_pushnil(L);
     lua_pushnil(L);
     while (pb_readvarint32(&p, &tag)) {
         int n = pb_gettag(tag);
         if (n == 1 || n == 2) {
             mask |= n;
-            lpb_withinput(e, &p, lpbD_field(e, pb_field(f->type, n), tag));
+            lpb_withinput(e, &p, lpbD_field(e, kv[n-1], tag));
             lua_replace(L, top+n);
         }
     }
-    if (!(mask & 1) && lpb_pushdeffield(L, e->LS, pb_field(f->type, 1), 1))
+    if (!(mask & 1) && lpb_pushdeffield(L, e->LS, kv[0], 1))
         lua_replace(L, top + 1), mask |= 1;
-    if (!(mask & 2) && lpb_pushdeffield(L, e->LS, pb_field(f->type, 2), 1))
+    if (!(mask & 2) && lpb_pushdeffield(L, e->LS, kv[1], 1))
         lua_replace(L, top + 2), mask |= 2;
     if (mask == 3) lua_rawset(L, -3);
     else           lua_pop(L, 2);
 }
 
-static void lpbD_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag) {
+static size_t lpbD_packedcount(const pb_Field *f, pb_Slice p) {
+    switch (pb_wtypebytype(f->type_id)) {
+    case PB_T64BIT: return pb_len(p) / 8;
+    case PB_T32BIT: return pb_len(p) / 4;
+    default:        return pb_countvarint(p);
+    }
+}
+
+static void lpbD_packed(lpb_Env *e, const pb_Field *f, pb_Slice *p) {
+    lua_State *L = e->L;
+    int len = (int)lua_rawlen(L, -1), mode = e->LS->int64_mode;
+    pb_Slice *s = e->s;
+    uint64_t u64 = 0;
+    uint32_t u32 = 0;
+#define lpbD_packedloop(read, v, what, push) \
+    while (p->p < p->end) {                                          \
+        if (read(p, &v) == 0)                                        \
+            luaL_error(L, "invalid " what " value at offset %d",     \
+                    pb_pos(*p)+1);                                   \
+        push;                                                        \
+        lua_rawseti(L, -2, ++len);                                   \
+    }
+#define lpbD_varints(push)  lpbD_packedloop(pb_readvarint64, u64, "varint", push)
+#define lpbD_fixed32s(push) lpbD_packedloop(pb_readfixed32, u32, "fixed32", push)
+#define lpbD_fixed64s(push) lpbD_packedloop(pb_readfixed64, u64, "fixed64", push)
+    switch (f->type_id) {
+    case PB_Tbool:     lpbD_varints(lua_pushboolean(L, u64 != 0)); break;
+    case PB_Tint32:    lpbD_varints(lpb_pushinteger(L, (int32_t)u64, mode)); break;
+    case PB_Tuint32:   lpbD_varints(lpb_pushinteger(L, (uint32_t)u64, mode)); break;
+    case PB_Tsint32:   lpbD_varints(lpb_pushinteger(L,
+                               pb_decode_sint32((uint32_t)u64), mode)); break;
+    case PB_Tint64:
+    case PB_Tuint64:   lpbD_varints(lpb_pushinteger(L, (int64_t)u64, mode)); break;
+    case PB_Tsint64:   lpbD_varints(lpb_pushinteger(L,
+                               pb_decode_sint64(u64), mode)); break;
+    case PB_Tfloat:    lpbD_fixed32s(lua_pushnumber(L, pb_decode_float(u32))); break;
+    case PB_Tfixed32:  lpbD_fixed32s(lpb_pushinteger(L, u32, mode)); break;
+    case PB_Tsfixed32: lpbD_fixed32s(lpb_pushinteger(L, (int32_t)u32, mode)); break;
+    case PB_Tdouble:   lpbD_fixed64s(lua_pushnumber(L, pb_decode_double(u64))); break;
+    case PB_Tfixed64:
+    case PB_Tsfixed64: lpbD_fixed64s(lpb_pushinteger(L, (int64_t)u64, mode)); break;
+    default:
+        while (p->p < p->end) {
+            lpb_withinput(e, p, lpbD_rawfield(e, f));
+            lua_rawseti(L, -2, ++len);
+        }
+    }
+#undef lpbD_fixed64s
+#undef lpbD_fixed32s
+#undef lpbD_varints
+#undef lpbD_packedloop
+}
+
+static void lpbD_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag, int names) {
     lua_State *L = e->L;
     if (pb_gettype(tag) != PB_TBYTES
             || (!f->packed && pb_wtypebytype(f->type_id) == PB_TBYTES)) {
+        lpb_fetchtable(e, f, names, 0);
         lpbD_field(e, f, tag);
         lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
     } else {
-        int len = (int)lua_rawlen(L, -1);
-        pb_Slice p, *s = e->s;
-        lpb_readbytes(L, s, &p);
-        while (p.p < p.end) {
-            lpb_withinput(e, &p, lpbD_rawfield(e, f));
-            lua_rawseti(L, -2, ++len);
-        }
+        pb_Slice p;
+        lpb_readbytes(L, e->s, &p);
+        lpb_fetchtable(e, f, names, (int)lpbD_packedcount(f, p));
+        lpbD_packed(e, f, &p);
     }
 }
 
 static int lpbD_message(lpb_Env *e, const pb_Type *t) {
     lua_State *L = e->L;
     pb_Slice *s = e->s;
+    int names = lua_gettop(L) + 1;
+    const lpb_Plan *p;
     uint32_t tag;
-    luaL_checkstack(L, t->field_count * 2, "not enough stack space for fields");
+    luaL_checkstack(L, t->field_count * 2 + 4, "not enough stack space for fields");
+    p = lpb_pushplan(e, t);
     while (pb_readvarint32(s, &tag)) {
-        const pb_Field *f = pb_field(t, pb_gettag(tag));
+        const pb_Field *f = lpb_planfield(p, t, pb_gettag(tag));
         if (f == NULL)
             pb_skipvalue(s, tag);
         else if (f->type && f->type->is_map) {
-            lpb_fetchtable(e, f);
+            lpb_fetchtable(e, f, names, 0);
             lpbD_checktype(e, f, tag);
             lpbD_map(e, f);
             lua_pop(L, 1);
         } else if (f->repeated) {
-            lpb_fetchtable(e, f);
-            lpbD_repeated(e, f, tag);
+            lpbD_repeated(e, f, tag, names);
             lua_pop(L, 1);
         } else {
-            lua_pushstring(L, (const char*)f->name);
+            lua_rawgeti(L, names, f->number);
             if (f->oneof_idx) {
-                lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+                lua_rawgetp(L, names, f);
                 lua_pushvalue(L, -2);
-                lua_rawset(L, -4);
+                lua_rawset(L, names - 1);
             }
             lpbD_field(e, f, tag);
-            lua_rawset(L, -3);
+            lua_rawset(L, names - 1);
         }
     }
+    lua_pop(L, 1);
     if (e->LS->use_dec_hooks) lpb_usedechooks(L, e->LS, t);
     return 1;
 }
@@ -1882,11 +2355,13 @@ static int lpbD_decode(lua_State *L, pb_Slice s, int start) {
     lpb_Env e;
     argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
     lua_settop(L, start);
+    lpb_pushplantable(L, LS);
+    e.L = L, e.LS = LS, e.s = &s, e.plans = start + 1;
     if (!lua_istable(L, start)) {
-        lua_pop(L, 1);
-        lpb_pushtypetable(L, LS, t);
+        lpbD_pushtypetable(&e, t);
+        lua_replace(L, start);
     }
-    e.L = L, e.LS = LS, e.s = &s;
+    lua_pushvalue(L, start);
     return lpbD_message(&e, t);
 }
 
@@ -1896,9 +2371,371 @@ static int Lpb_decode(lua_State *L) {
             lpb_checkslice(L, 2), 3);
 }
 
+static int Lpb_decode_stream(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(LS, lpb_checkslice(L, 1));
+    pb_Slice s = lpb_checkslice(L, 2), msg;
+    lua_Integer pos = posrelat(luaL_optinteger(L, 3, 1), pb_len(s));
+    const char *base = s.p;
+    lpb_Env e;
+    int n = 0;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    if (pos > (lua_Integer)pb_len(s)) pos = (lua_Integer)pb_len(s) + 1;
+    if (pos > 1) s.p += pos - 1;
+    lua_settop(L, 3);
+    lpb_pushplantable(L, LS);
+    e.L = L, e.LS = LS, e.s = &msg, e.plans = 4;
+    lua_newtable(L);
+    for (;;) {
+        const char *p = s.p;
+        uint64_t len;
+        if (pb_readvarint64(&s, &len) == 0) {
+            /* fewer than 10 bytes without a last varint byte may still
+             * be completed by the next chunk, more can not */
+            if (pb_len(s) >= 10)
+                luaL_error(L, "invalid length prefix at offset %d",
+                        (int)(p - base) + 1);
+            break;
+        }
+        if (len > pb_len(s)) {
+            s.p = p;
+            break;
+        }
+        pb_readslice(&s, (size_t)len, &msg);
+        lpbD_pushtypetable(&e, t);
+        lpbD_message(&e, t);
+        lua_rawseti(L, 5, ++n);
+    }
+    lua_pushinteger(L, (lua_Integer)(s.p - base) + 1);
+    return 2;
+}
+
+
+/* lazy message views */
+
+#define PB_VIEW "pb.View"
+
+typedef struct lpb_View {
+    lpb_State      *LS;
+    const pb_State *S;       /* state and its gen when the view was created */
+    unsigned        gen;
+    const pb_Type  *t;
+    const pb_Field *f;       /* element field, for views over repeated fields */
+    pb_Slice        s;       /* bytes of the whole message */
+    unsigned        count;   /* element count of a scanned repeated view */
+    int             scanned;
+} lpb_View;
+
+/* uservalue of a view: [0] holds the bytes, [-1] the pb.State; message
+ * views map field numbers to the offset and wire type of the last
+ * occurrence and field names to decoded values, repeated views map
+ * indices to elements. */
+
+static lpb_View *lpbV_new(lua_State *L, int uv, lpb_State *LS, const pb_Type *t, const pb_Field *f, pb_Slice s) {
+    lpb_View *v = (lpb_View*)lua_newuserdata(L, sizeof(lpb_View));
+    v->LS = LS, v->S = lpbS_state(LS), v->gen = v->S->gen;
+    v->t = t, v->f = f, v->s = s;
+    v->count = 0, v->scanned = 0;
+    luaL_setmetatable(L, PB_VIEW);
+    lua_createtable(L, 0, 2);
+    lua_rawgeti(L, uv, 0);
+    lua_rawseti(L, -2, 0);
+    lua_rawgeti(L, uv, -1);
+    lua_rawseti(L, -2, -1);
+    lua_setuservalue(L, -2);
+    return v;
+}
+
+static lpb_View *lpbV_check(lua_State *L, int idx) {
+    lpb_View *v = (lpb_View*)luaL_checkudata(L, idx, PB_VIEW);
+    if (v->S != lpbS_state(v->LS) || v->gen != v->S->gen)
+        luaL_error(L, "types changed after the view was created");
+    return v;
+}
+
+static void lpbV_env(lua_State *L, lpb_View *v, lpb_Env *e, pb_Slice *s) {
+    lpb_pushplantable(L, v->LS);
+    e->L = L, e->LS = v->LS, e->b = NULL, e->s = s, e->plans = lua_gettop(L);
+}
+
+static void lpbV_element(lpb_Env *e, int uv, const pb_Field *f) {
+    pb_Slice sv;
+    if (f->type_id != PB_Tmessage)
+        lpbD_rawfield(e, f);
+    else {
+        lpb_readbytes(e->L, e->s, &sv);
+        if (f->type == NULL || f->type->is_dead)
+            lua_pushnil(e->L);
+        else
+            lpbV_new(e->L, uv, e->LS, f->type, NULL, sv);
+    }
+}
+
+static void lpbV_scan(lua_State *L, lpb_View *v, int uv) {
+    pb_Slice s = v->s;
+    uint32_t tag;
+    while (pb_readvarint32(&s, &tag)) {
+        size_t pos = (size_t)(s.p - v->s.p);
+        if (pb_skipvalue(&s, tag) == 0)
+            luaL_error(L, "invalid value for tag %d at offset %d",
+                    (int)pb_gettag(tag), pb_pos(s)+1);
+        if (pb_gettag(tag) == 0) continue; /* no field, and [0] pins the bytes */
+        lua_pushinteger(L, (lua_Integer)(pos << 3 | pb_gettype(tag)));
+        lua_rawseti(L, uv, pb_gettag(tag));
+    }
+    v->scanned = 1;
+}
+
+static void lpbV_scanrepeated(lua_State *L, lpb_View *v, int uv) {
+    const pb_Field *f = v->f;
+    pb_Slice src = v->s, p, *s = &src;
+    unsigned n = 0;
+    lpb_Env e;
+    uint32_t tag;
+    lpbV_env(L, v, &e, s);
+    while (pb_readvarint32(s, &tag)) {
+        if ((int32_t)pb_gettag(tag) != f->number)
+            pb_skipvalue(s, tag);
+        else if (pb_gettype(tag) != PB_TBYTES
+                || (!f->packed && pb_wtypebytype(f->type_id) == PB_TBYTES)) {
+            lpbD_checktype(&e, f, tag);
+            lpbV_element(&e, uv, f);
+            lua_rawseti(L, uv, ++n);
+        } else {
+            lpb_readbytes(L, s, &p);
+            while (p.p < p.end) {
+                lpb_withinput(&e, &p, lpbD_rawfield(&e, f));
+                lua_rawseti(L, uv, ++n);
+            }
+        }
+    }
+    lua_pop(L, 1);
+    v->count = n, v->scanned = 1;
+}
+
+static void lpbV_map(lua_State *L, lpb_View *v, const pb_Field *f) {
+    pb_Slice src = v->s, *s = &src;
+    lpb_Env e;
+    uint32_t tag;
+    lpbV_env(L, v, &e, s);
+    lua_newtable(L);
+    while (pb_readvarint32(s, &tag)) {
+        if ((int32_t)pb_gettag(tag) != f->number)
+            pb_skipvalue(s, tag);
+        else {
+            lpbD_checktype(&e, f, tag);
+            lpbD_map(&e, f);
+        }
+    }
+    lua_remove(L, -2);
+}
+
+/* absent fields read as they would in the table pb.decode() returns,
+ * see lpb_pushtypetable() */
+static int lpbV_default(lua_State *L, lpb_View *v, const pb_Field *f) {
+    int mode = v->LS->default_mode;
+    if (f->oneof_idx) return 0;
+    switch (v->t->is_proto3 && mode == LPB_DEFDEF ? LPB_COPYDEF : mode) {
+    case LPB_METADEF:
+        if (f->type_id == PB_Tmessage) return 0;
+        /* fallthrough */
+    case LPB_COPYDEF:
+        return lpb_pushdeffield(L, v->LS, f, v->t->is_proto3);
+    default:
+        return 0;
+    }
+}
+
+static int lpbV_field(lua_State *L, lpb_View *v, const pb_Field *f, int uv) {
+    pb_Slice src = v->s;
+    lpb_Env e;
+    lua_Integer code;
+    if (f->type && f->type->is_map)
+        return lpbV_map(L, v, f), 1;
+    if (f->repeated)
+        return lpbV_new(L, uv, v->LS, v->t, f, v->s), 1;
+    if (!v->scanned) lpbV_scan(L, v, uv);
+    if (lua53_rawgeti(L, uv, f->number) == LUA_TNIL) {
+        lua_pop(L, 1);
+        return lpbV_default(L, v, f);
+    }
+    code = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    src.p += (size_t)(code >> 3);
+    lpbV_env(L, v, &e, &src);
+    lpbD_checktype(&e, f, pb_pair(f->number, (uint32_t)(code & 7)));
+    lpbV_element(&e, uv, f);
+    lua_remove(L, -2);
+    return 1;
+}
+
+/* a oneof name reads as the name of its member set last on the wire, as
+ * in the table pb.decode() returns */
+static int lpbV_oneof(lua_State *L, lpb_View *v, const pb_Name *name, int uv) {
+    const pb_Field *f = NULL, *set = NULL;
+    lua_Integer last = -1;
+    unsigned i, idx = 0;
+    for (i = 1; name != NULL && i <= v->t->oneof_count; ++i)
+        if (pb_oneofname(v->t, (int)i) == name) { idx = i; break; }
+    if (idx == 0) return 0;
+    if (!v->scanned) lpbV_scan(L, v, uv);
+    while (pb_nextfield(v->t, &f)) {
+        if (f->oneof_idx != idx) continue;
+        if (lua53_rawgeti(L, uv, f->number) != LUA_TNIL
+                && lua_tointeger(L, -1) > last)
+            last = lua_tointeger(L, -1), set = f;
+        lua_pop(L, 1);
+    }
+    if (set == NULL) return 0;
+    lua_pushstring(L, (const char*)set->name);
+    return 1;
+}
+
+static int Lview_index(lua_State *L) {
+    lpb_View *v = lpbV_check(L, 1);
+    const pb_Name *name;
+    const pb_Field *f;
+    lua_settop(L, 2);
+    lua_getuservalue(L, 1);
+    if (v->f != NULL) {
+        lua_Integer i = lua_tointeger(L, 2);
+        if (!v->scanned) lpbV_scanrepeated(L, v, 3);
+        if (i < 1 || i > (lua_Integer)v->count) return 0;
+        lua_rawgeti(L, 3, i);
+        return 1;
+    }
+    if (lua_type(L, 2) != LUA_TSTRING) return 0;
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 3);
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 1);
+    name = lpb_name(v->LS, lpb_toslice(L, 2));
+    f = pb_fname(v->t, name);
+    if (f != NULL ? !lpbV_field(L, v, f, 3) : !lpbV_oneof(L, v, name, 3))
+        return 0;
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 3);
+    return 1;
+}
+
+static int Lview_len(lua_State *L) {
+    lpb_View *v = lpbV_check(L, 1);
+    if (v->f == NULL)
+        return luaL_error(L, "attempt to get length of a message view");
+    if (!v->scanned) {
+        lua_getuservalue(L, 1);
+        lpbV_scanrepeated(L, v, lua_gettop(L));
+    }
+    lua_pushinteger(L, (lua_Integer)v->count);
+    return 1;
+}
+
+static int Lview_tostring(lua_State *L) {
+    lpb_View *v = (lpb_View*)luaL_checkudata(L, 1, PB_VIEW);
+    if (v->f != NULL)
+        lua_pushfstring(L, "pb.View (%s.%s): %p",
+                (const char*)v->t->name, (const char*)v->f->name, v);
+    else
+        lua_pushfstring(L, "pb.View (%s): %p", (const char*)v->t->name, v);
+    return 1;
+}
+
+static int Lpb_view(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(LS, lpb_checkslice(L, 1));
+    pb_Slice s;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    if (lua_type(L, 2) == LUA_TSTRING)
+        s = lpb_toslice(L, 2);
+    else {
+        s = lpb_checkslice(L, 2);
+        lua_pushlstring(L, s.p, pb_len(s));
+        lua_replace(L, 2);
+        s = lpb_toslice(L, 2);
+    }
+    lua_settop(L, 2);
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 0);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+    lua_rawseti(L, -2, -1);
+    lpbV_new(L, 3, LS, t, NULL, s);
+    return 1;
+}
+
 
 /* pb module interface */
 
+static void lpb_schemachanged(lua_State *L, lpb_State *LS) {
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
+    LS->defs_index = LUA_NOREF;
+    lpb_typeschanged(L, LS);
+}
+
+static int Lpb_share(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    pb_Slice s = lua_isnoneornil(L, 1) ? pb_lslice(NULL, 0) : lpb_checkslice(L, 1);
+    lpb_Shared *sh = (lpb_Shared*)malloc(sizeof(lpb_Shared));
+    int r = PB_OK;
+    if (sh == NULL) return luaL_error(L, "out of memory");
+    if (s.p == NULL) {
+        sh->state = LS->local;
+        lpb_resetlocal(LS, 0);
+        if (global_state == &LS->local) global_state = NULL;
+        lpb_detach(LS);
+        lpb_publishshared(sh, 2);
+        LS->shared = sh, LS->state = &sh->state;
+        lpb_typeschanged(L, LS);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    pb_init(&sh->state);
+    if ((r = pb_load(&sh->state, &s)) == PB_OK)
+        lpb_publishshared(sh, 1);
+    else
+        pb_free(&sh->state), free(sh);
+    lua_pushboolean(L, r == PB_OK);
+    lua_pushinteger(L, pb_pos(s)+1);
+    return 2;
+}
+
+static int Lpb_attach(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lpb_Shared *sh = lpb_acquireshared();
+    if (sh != NULL) {
+        lpb_detach(LS);
+        LS->shared = sh, LS->state = &sh->state;
+        lpb_schemachanged(L, LS);
+    }
+    lua_pushboolean(L, sh != NULL);
+    return 1;
+}
+
+static int Lpb_detach(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    int attached = LS->shared != NULL;
+    if (attached) {
+        lpb_detach(LS);
+        lpb_schemachanged(L, LS);
+    }
+    lua_pushboolean(L, attached);
+    return 1;
+}
+
+static int Lpb_scratch_limit(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lua_pushinteger(L, (lua_Integer)LS->scratch_limit);
+    if (!lua_isnoneornil(L, 1)) {
+        lua_Integer limit = luaL_checkinteger(L, 1);
+        argcheck(L, limit >= 0, 1, "negative limit");
+        LS->scratch_limit = (size_t)limit;
+        if (pb_onheap(&LS->buffer) && LS->buffer.u.h.capacity > LS->scratch_limit)
+            pb_resetbuffer(&LS->buffer);
+    }
+    return 1;
+}
+
 static int Lpb_option(lua_State *L) {
 #define OPTS(X) \
     X(0, enum_as_name,          LS->enum_as_value = 0)             \
@@ -1935,6 +2772,7 @@ static int Lpb_option(lua_State *L) {
         OPTS(X)
 #undef  X
     }
+    lpb_resetplans(L, LS);
     return 0;
 #undef  OPTS
 }
@@ -1947,8 +2785,12 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         ENTRY(clear),
         ENTRY(load),
         ENTRY(loadfile),
+        ENTRY(dump),
         ENTRY(encode),
         ENTRY(decode),
+        ENTRY(encode_stream),
+        ENTRY(decode_stream),
+        ENTRY(view),
         ENTRY(types),
         ENTRY(fields),
         ENTRY(type),
@@ -1962,7 +2804,11 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         ENTRY(fromhex),
         ENTRY(result),
         ENTRY(option),
+        ENTRY(scratch_limit),
         ENTRY(state),
+        ENTRY(share),
+        ENTRY(attach),
+        ENTRY(detach),
 #undef  ENTRY
         { NULL, NULL }
     };
@@ -1971,11 +2817,20 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         { "setdefault", Lpb_state },
         { NULL, NULL }
     };
+    luaL_Reg view_meta[] = {
+        { "__index",    Lview_index    },
+        { "__len",      Lview_len      },
+        { "__tostring", Lview_tostring },
+        { NULL, NULL }
+    };
     if (luaL_newmetatable(L, PB_STATE)) {
         luaL_setfuncs(L, meta, 0);
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
     }
+    if (luaL_newmetatable(L, PB_VIEW))
+        luaL_setfuncs(L, view_meta, 0);
+    lua_pop(L, 1);
     luaL_newlib(L, libs);
     return 1;
 }
@@ -2009,6 +2864,7 @@ static int Lpb_use(lua_State *L) {
     case 0: if (GS) LS->state = GS; break;
     case 1: LS->state = &LS->local; break;
     }
+    lpb_typeschanged(L, LS);
     lua_pushboolean(L, GS != NULL);
     return 1;
 }
@@ -147,6 +147,7 @@ PB_API size_t pb_readgroup (pb_Slice *s, uint32_t tag, pb_Slice *pv);
 
 PB_API size_t pb_skipvarint (pb_Slice *s);
 PB_API size_t pb_skipbytes  (pb_Slice *s);
+PB_API size_t pb_countvarint (pb_Slice s);
 PB_API size_t pb_skipslice  (pb_Slice *s, size_t len);
 PB_API size_t pb_skipvalue  (pb_Slice *s, uint32_t tag);
 
@@ -223,6 +224,7 @@ typedef struct pb_Field pb_Field;
 #define PB_ENOMEM 2
 
 PB_API int pb_load (pb_State *S, pb_Slice *s);
+PB_API int pb_dump (const pb_State *S, pb_Buffer *b);
 
 PB_API pb_Type  *pb_newtype  (pb_State *S, pb_Name *tname);
 PB_API void      pb_deltype  (pb_State *S, pb_Type *t);
@@ -317,6 +319,7 @@ struct pb_State {
     pb_Table     types;
     pb_Pool      typepool;
     pb_Pool      fieldpool;
+    unsigned     gen; /* bumped whenever a type or field changes */
 };
 
 struct pb_Field {
@@ -586,6 +589,27 @@ PB_API size_t pb_skipvarint(pb_Slice *s) {
     return p - op;
 }
 
+#define PB_U64(hi,lo) (((uint64_t)(hi) << 32) | (uint64_t)(lo))
+#define PB_HIBITS     PB_U64(0x80808080, 0x80808080)
+#define PB_LOWBYTES   PB_U64(0x01010101, 0x01010101)
+
+/* number of bytes in x with the high bit set */
+#define pb_counthibits(x) \
+    ((size_t)(((((x) >> 7) & PB_LOWBYTES) * PB_LOWBYTES) >> 56))
+
+/* counts the varints in s by their terminating bytes, 8 bytes a step */
+PB_API size_t pb_countvarint(pb_Slice s) {
+    size_t count = 0;
+    uint64_t w;
+    for (; pb_len(s) >= 8; s.p += 8) {
+        memcpy(&w, s.p, sizeof(w));
+        count += pb_counthibits(~w & PB_HIBITS);
+    }
+    for (; s.p < s.end; ++s.p)
+        count += !(*s.p & 0x80);
+    return count;
+}
+
 PB_API size_t pb_skipbytes(pb_Slice *s) {
     const char *p = s->p;
     uint64_t var;
@@ -1127,10 +1151,12 @@ PB_API void pb_init(pb_State *S) {
 }
 
 PB_API void pb_free(pb_State *S) {
-    const pb_TypeEntry *te = NULL;
+    const pb_Entry *e = NULL;
     if (S == NULL) return;
-    while (pb_nextentry(&S->types, (const pb_Entry**)&te))
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_TypeEntry *te = (const pb_TypeEntry*)e;
         if (te->value != NULL) pb_deltype(S, te->value);
+    }
     pb_freetable(&S->types);
     pb_freepool(&S->typepool);
     pb_freepool(&S->fieldpool);
@@ -1164,12 +1190,13 @@ PB_API const pb_Name *pb_oneofname(const pb_Type *t, int idx) {
 }
 
 PB_API int pb_nexttype(const pb_State *S, const pb_Type **ptype) {
-    const pb_TypeEntry *e = NULL;
+    const pb_Entry *e = NULL;
     if (S != NULL) {
         if (*ptype != NULL)
-            e = (pb_TypeEntry*)pb_gettable(&S->types, (pb_Key)(*ptype)->name);
-        while (pb_nextentry(&S->types, (const pb_Entry**)&e))
-            if ((*ptype = e->value) != NULL && !(*ptype)->is_dead)
+            e = pb_gettable(&S->types, (pb_Key)(*ptype)->name);
+        while (pb_nextentry(&S->types, &e))
+            if ((*ptype = ((const pb_TypeEntry*)e)->value) != NULL
+                    && !(*ptype)->is_dead)
                 return 1;
     }
     *ptype = NULL;
@@ -1177,12 +1204,12 @@ PB_API int pb_nexttype(const pb_State *S, const pb_Type **ptype) {
 }
 
 PB_API int pb_nextfield(const pb_Type *t, const pb_Field **pfield) {
-    const pb_FieldEntry *e = NULL;
+    const pb_Entry *e = NULL;
     if (t != NULL) {
         if (*pfield != NULL)
-            e = (pb_FieldEntry*)pb_gettable(&t->field_tags, (*pfield)->number);
-        while (pb_nextentry(&t->field_tags, (const pb_Entry**)&e))
-            if ((*pfield = e->value) != NULL)
+            e = pb_gettable(&t->field_tags, (*pfield)->number);
+        while (pb_nextentry(&t->field_tags, &e))
+            if ((*pfield = ((const pb_FieldEntry*)e)->value) != NULL)
                 return 1;
     }
     *pfield = NULL;
@@ -1216,6 +1243,7 @@ PB_API pb_Type *pb_newtype(pb_State *S, pb_Name *tname) {
     pb_TypeEntry *te;
     pb_Type *t;
     if (tname == NULL) return NULL;
+    ++S->gen;
     te = (pb_TypeEntry*)pb_settable(&S->types, (pb_Key)tname);
     if (te == NULL) return NULL;
     if ((t = te->value) != NULL) return t->is_dead = 0, t;
@@ -1227,10 +1255,11 @@ PB_API pb_Type *pb_newtype(pb_State *S, pb_Name *tname) {
 }
 
 PB_API void pb_deltype(pb_State *S, pb_Type *t) {
-    pb_FieldEntry *nf = NULL;
-    pb_OneofEntry *ne = NULL;
+    const pb_Entry *e = NULL;
     if (S == NULL || t == NULL) return;
-    while (pb_nextentry(&t->field_names, (const pb_Entry**)&nf)) {
+    ++S->gen;
+    while (pb_nextentry(&t->field_names, &e)) {
+        pb_FieldEntry *nf = (pb_FieldEntry*)e;
         if (nf->value != NULL) {
             pb_FieldEntry *of = (pb_FieldEntry*)pb_gettable(
                     &t->field_tags, nf->value->number);
@@ -1239,10 +1268,11 @@ PB_API void pb_deltype(pb_State *S, pb_Type *t) {
             pbT_freefield(S, nf->value);
         }
     }
-    while (pb_nextentry(&t->field_tags, (const pb_Entry**)&nf))
-        if (nf->value != NULL) pbT_freefield(S, nf->value);
-    while (pb_nextentry(&t->oneof_index, (const pb_Entry**)&ne))
-        pb_delname(S, ne->name);
+    while (pb_nextentry(&t->field_tags, &e))
+        if (((pb_FieldEntry*)e)->value != NULL)
+            pbT_freefield(S, ((pb_FieldEntry*)e)->value);
+    while (pb_nextentry(&t->oneof_index, &e))
+        pb_delname(S, ((pb_OneofEntry*)e)->name);
     pb_freetable(&t->field_tags);
     pb_freetable(&t->field_names);
     pb_freetable(&t->oneof_index);
@@ -1256,6 +1286,7 @@ PB_API pb_Field *pb_newfield(pb_State *S, pb_Type *t, pb_Name *fname, int32_t nu
     pb_FieldEntry *nf, *tf;
     pb_Field *f;
     if (fname == NULL) return NULL;
+    ++S->gen;
     nf = (pb_FieldEntry*)pb_settable(&t->field_names, (pb_Key)fname);
     tf = (pb_FieldEntry*)pb_settable(&t->field_tags, number);
     if (nf == NULL || tf == NULL) return NULL;
@@ -1281,6 +1312,7 @@ PB_API void pb_delfield(pb_State *S, pb_Type *t, pb_Field *f) {
     pb_FieldEntry *nf, *tf;
     int count = 0;
     if (S == NULL || t == NULL || f == NULL) return;
+    ++S->gen;
     nf = (pb_FieldEntry*)pb_gettable(&t->field_names, (pb_Key)f->name);
     tf = (pb_FieldEntry*)pb_gettable(&t->field_tags, (pb_Key)f->number);
     if (nf && nf->value == f) nf->entry.key = 0, nf->value = NULL, ++count;
@@ -1684,10 +1716,313 @@ static int pbL_loadFile(pb_State *S, pbL_FileInfo *info, pb_Loader *L) {
     return PB_OK;
 }
 
+
+/* compiled schema image */
+
+/* An image is a flat dump of a pb_State: every name once, then every type
+ * and field with references as indexes. Loading it skips the descriptor
+ * parsing and full name construction done by pb_load(). The leading zero
+ * byte can not start a FileDescriptorSet, so pb_load() detects images by
+ * their magic and dispatches here. */
+
+#define PB_IMAGE_MAGIC   "\0PBI"
+#define PB_IMAGE_VERSION 1
+
+#define pbCB(e) do { if ((e) == 0) return PB_ENOMEM; } while (0)
+
+typedef struct pbI_IndexEntry { pb_Entry entry; unsigned index; } pbI_IndexEntry;
+
+typedef struct pbI_Dumper {
+    pb_Buffer b;
+    pb_Table  names;
+    pb_Table  types;
+    unsigned  nnames;
+    unsigned  ntypes;
+} pbI_Dumper;
+
+typedef struct pbI_Loader {
+    pb_Slice  s;
+    pb_Name **names;
+    pb_Type **types;
+    unsigned  nnames, maxnames;
+    unsigned  ntypes;
+} pbI_Loader;
+
+static int pbI_dumpname(pbI_Dumper *D, const pb_Name *name) {
+    pbI_IndexEntry *ie;
+    size_t len;
+    if (name == NULL)
+        return pb_addvarint32(&D->b, 0) ? PB_OK : PB_ENOMEM;
+    pbCM(ie = (pbI_IndexEntry*)pb_settable(&D->names, (pb_Key)name));
+    if (ie->index != 0)
+        return pb_addvarint32(&D->b, ie->index << 1) ? PB_OK : PB_ENOMEM;
+    ie->index = ++D->nnames;
+    len = ((const pb_NameEntry*)name - 1)->length;
+    pbCM(pb_prepbuffsize(&D->b, len + 5));
+    pb_addvarint32(&D->b, (uint32_t)len << 1 | 1);
+    pb_addslice(&D->b, pb_lslice((const char*)name, len));
+    return PB_OK;
+}
+
+static int pbI_dumpfield(pbI_Dumper *D, const pb_Type *t, const pb_Field *f) {
+    const pbI_IndexEntry *ie = NULL;
+    unsigned flags = 0;
+    if (pb_fname(t, f->name) == f)  flags |= 1;
+    if (pb_field(t, f->number) == f) flags |= 2;
+    if (f->type != NULL)
+        ie = (const pbI_IndexEntry*)pb_gettable(&D->types, (pb_Key)f->type);
+    flags |= f->repeated << 2 | f->packed << 3 | f->scalar << 4;
+    pbCB(pb_addvarint32(&D->b, flags));
+    pbC(pbI_dumpname(D, f->name));
+    pbCB(pb_addvarint32(&D->b, (uint32_t)f->number));
+    pbCB(pb_addvarint32(&D->b, ie ? ie->index : 0));
+    pbC(pbI_dumpname(D, f->default_value));
+    pbCB(pb_addvarint32(&D->b, f->oneof_idx));
+    pbCB(pb_addvarint32(&D->b, f->type_id));
+    return PB_OK;
+}
+
+static int pbI_dumptype(pbI_Dumper *D, const pb_Type *t) {
+    const pb_Entry *e = NULL;
+    const pb_Field *f;
+    unsigned i, nfields = 0;
+    pbCB(pb_addvarint32(&D->b, t->oneof_count));
+    for (i = 1; i <= t->oneof_count; ++i)
+        pbC(pbI_dumpname(D, pb_oneofname(t, (int)i)));
+    while (pb_nextentry(&t->field_tags, &e))
+        if (((const pb_FieldEntry*)e)->value != NULL) ++nfields;
+    while (pb_nextentry(&t->field_names, &e))
+        if ((f = ((const pb_FieldEntry*)e)->value) != NULL
+                && pb_field(t, f->number) != f) ++nfields;
+    pbCB(pb_addvarint32(&D->b, nfields));
+    while (pb_nextentry(&t->field_tags, &e))
+        if ((f = ((const pb_FieldEntry*)e)->value) != NULL)
+            pbC(pbI_dumpfield(D, t, f));
+    while (pb_nextentry(&t->field_names, &e))
+        if ((f = ((const pb_FieldEntry*)e)->value) != NULL
+                && pb_field(t, f->number) != f)
+            pbC(pbI_dumpfield(D, t, f));
+    return PB_OK;
+}
+
+static int pbI_dump(pbI_Dumper *D, const pb_State *S) {
+    const pb_Entry *e = NULL;
+    const pb_Type *t;
+    while (pb_nextentry(&S->types, &e)) {
+        pbI_IndexEntry *ie;
+        if ((t = ((const pb_TypeEntry*)e)->value) == NULL) continue;
+        pbCM(ie = (pbI_IndexEntry*)pb_settable(&D->types, (pb_Key)t));
+        ie->index = ++D->ntypes;
+    }
+    while (pb_nextentry(&S->types, &e)) {
+        if ((t = ((const pb_TypeEntry*)e)->value) == NULL) continue;
+        pbC(pbI_dumpname(D, t->name));
+        pbCB(pb_addvarint32(&D->b, t->is_enum | t->is_map << 1
+                    | t->is_proto3 << 2 | t->is_dead << 3));
+    }
+    while (pb_nextentry(&S->types, &e))
+        if ((t = ((const pb_TypeEntry*)e)->value) != NULL)
+            pbC(pbI_dumptype(D, t));
+    return PB_OK;
+}
+
+PB_API int pb_dump(const pb_State *S, pb_Buffer *b) {
+    pbI_Dumper D;
+    int r;
+    memset(&D, 0, sizeof(D));
+    pb_initbuffer(&D.b);
+    pb_inittable(&D.names, sizeof(pbI_IndexEntry));
+    pb_inittable(&D.types, sizeof(pbI_IndexEntry));
+    if ((r = pbI_dump(&D, S)) == PB_OK) {
+        pb_Slice body = pb_result(&D.b);
+        r = pb_prepbuffsize(b, pb_len(body) + 19) == NULL ? PB_ENOMEM : PB_OK;
+        if (r == PB_OK) {
+            pb_addslice(b, pb_lslice(PB_IMAGE_MAGIC, 4));
+            pb_addvarint32(b, PB_IMAGE_VERSION);
+            pb_addvarint32(b, D.nnames);
+            pb_addvarint32(b, D.ntypes);
+            pb_addslice(b, body);
+        }
+    }
+    pb_freetable(&D.names);
+    pb_freetable(&D.types);
+    pb_resetbuffer(&D.b);
+    return r;
+}
+
+static int pbI_readuint(pbI_Loader *L, unsigned *pv) {
+    uint32_t v;
+    if (pb_readvarint32(&L->s, &v) == 0) return PB_ERROR;
+    *pv = (unsigned)v;
+    return PB_OK;
+}
+
+static int pbI_readname(pb_State *S, pbI_Loader *L, pb_Name **pname) {
+    pb_Slice name;
+    unsigned v;
+    pbC(pbI_readuint(L, &v));
+    if (v == 0)
+        *pname = NULL;
+    else if ((v & 1) == 0) {
+        if ((v >>= 1) > L->nnames) return PB_ERROR;
+        *pname = pb_usename(L->names[v-1]);
+    } else {
+        if (L->nnames >= L->maxnames) return PB_ERROR;
+        if (pb_readslice(&L->s, v >> 1, &name) == 0 && v >> 1 != 0)
+            return PB_ERROR;
+        pbCM(*pname = pb_newname(S, name, NULL));
+        L->names[L->nnames++] = *pname;
+    }
+    return PB_OK;
+}
+
+static int pbI_readident(pb_State *S, pbI_Loader *L, pb_Name **pname) {
+    pbC(pbI_readname(S, L, pname));
+    if (*pname != NULL && memchr(*pname, '\0',
+                ((const pb_NameEntry*)*pname - 1)->length) != NULL)
+        return PB_ERROR; /* names are pushed to Lua as C strings */
+    return PB_OK;
+}
+
+static void pbI_release(pb_State *S, pb_Type *t, pb_Field *f) {
+    if (f != NULL && pb_fname(t, f->name) != f && pb_field(t, f->number) != f)
+        pbT_freefield(S, f), --t->field_count;
+}
+
+static pb_Field *pbI_newfield(pb_State *S, pb_Type *t, pb_Name *fname, int32_t number, unsigned owns) {
+    pb_FieldEntry *nf = NULL, *tf = NULL;
+    pb_Field *f, *of_name, *of_tag;
+    if ((owns & 1) && !(nf = (pb_FieldEntry*)pb_settable(&t->field_names, (pb_Key)fname)))
+        return NULL;
+    if ((owns & 2) && !(tf = (pb_FieldEntry*)pb_settable(&t->field_tags, number)))
+        return NULL;
+    of_name = nf ? nf->value : NULL;
+    of_tag  = tf ? tf->value : NULL;
+    if (nf && tf && of_name != NULL && of_name == of_tag) {
+        pb_delname(S, of_name->default_value);
+        of_name->default_value = NULL;
+        return of_name;
+    }
+    if (!(f = (pb_Field*)pb_poolalloc(&S->fieldpool))) return NULL;
+    memset(f, 0, sizeof(pb_Field));
+    f->name   = fname;
+    f->type   = t;
+    f->number = number;
+    if (nf) nf->value = f;
+    if (tf) tf->value = f;
+    pbI_release(S, t, of_name);
+    if (of_tag != of_name) pbI_release(S, t, of_tag);
+    ++t->field_count;
+    return f;
+}
+
+static int pbI_loadfield(pb_State *S, pbI_Loader *L, pb_Type *t) {
+    unsigned flags, number, type, oneof_idx, type_id;
+    pb_Name *name, *default_value;
+    pb_Field *f;
+    pbC(pbI_readuint(L, &flags));
+    pbC(pbI_readident(S, L, &name));
+    pbC(pbI_readuint(L, &number));
+    pbC(pbI_readuint(L, &type));
+    pbC(pbI_readname(S, L, &default_value));
+    pbC(pbI_readuint(L, &oneof_idx));
+    pbC(pbI_readuint(L, &type_id));
+    if (name == NULL || (flags & 3) == 0 || type > L->ntypes
+            || type_id >= PB_TYPECOUNT || oneof_idx > t->oneof_count
+            || (type == 0 && (type_id == PB_Tmessage || type_id == PB_Tenum)))
+        return PB_ERROR;
+    pbCM(f = pbI_newfield(S, t, name, (int32_t)number, flags & 3));
+    f->default_value = default_value;
+    f->type      = type ? L->types[type-1] : NULL;
+    if ((f->oneof_idx = oneof_idx)) ++t->oneof_field;
+    f->type_id   = type_id;
+    f->repeated  = (flags >> 2) & 1;
+    f->packed    = (flags >> 3) & 1;
+    f->scalar    = (flags >> 4) & 1;
+    return PB_OK;
+}
+
+static int pbI_loadtype(pb_State *S, pbI_Loader *L, pb_Type *t) {
+    unsigned i, count;
+    pbC(pbI_readuint(L, &count));
+    if (count > pb_len(L->s)) return PB_ERROR;
+    for (i = 1; i <= count; ++i) {
+        pb_OneofEntry *e = (pb_OneofEntry*)pb_settable(&t->oneof_index, i);
+        pb_Name *name;
+        pbCM(e); pbC(pbI_readident(S, L, &name));
+        pb_delname(S, e->name);
+        e->name = name, e->index = i;
+    }
+    t->oneof_count = count;
+    pbC(pbI_readuint(L, &count));
+    if (count > pb_len(L->s)) return PB_ERROR;
+    if (t->field_tags.size < count) {
+        pbCB(pb_resizetable(&t->field_tags, count));
+        pbCB(pb_resizetable(&t->field_names, count));
+    }
+    for (i = 0; i < count; ++i)
+        pbC(pbI_loadfield(S, L, t));
+    return PB_OK;
+}
+
+static int pbI_load(pb_State *S, pbI_Loader *L) {
+    unsigned i, version, flags;
+    pb_Name *name;
+    pb_Type *t;
+    if (pbI_readuint(L, &version) != PB_OK || version != PB_IMAGE_VERSION
+            || pbI_readuint(L, &L->maxnames) != PB_OK
+            || pbI_readuint(L, &L->ntypes) != PB_OK
+            || L->maxnames > pb_len(L->s) || L->ntypes > pb_len(L->s))
+        return PB_ERROR;
+    pbCM(L->names = (pb_Name**)malloc(sizeof(pb_Name*) * (L->maxnames + 1)));
+    pbCM(L->types = (pb_Type**)malloc(sizeof(pb_Type*) * (L->ntypes + 1)));
+    if (S->nametable.size < S->nametable.count + L->maxnames)
+        pbCB(pbN_resize(S, S->nametable.count + L->maxnames));
+    if (S->types.size < L->ntypes)
+        pbCB(pb_resizetable(&S->types, L->ntypes));
+    for (i = 0; i < L->ntypes; ++i) {
+        const pb_TypeEntry *te;
+        int live;
+        pbC(pbI_readident(S, L, &name));
+        pbC(pbI_readuint(L, &flags));
+        te = (const pb_TypeEntry*)pb_gettable(&S->types, (pb_Key)name);
+        live = te && te->value && !te->value->is_dead;
+        pbCE(t = pb_newtype(S, name));
+        t->is_enum   = flags & 1;
+        t->is_map    = (flags >> 1) & 1;
+        t->is_proto3 = (flags >> 2) & 1;
+        if ((flags & 8) && !live) t->is_dead = 1;
+        L->types[i] = t;
+    }
+    for (i = 0; i < L->ntypes; ++i)
+        pbC(pbI_loadtype(S, L, L->types[i]));
+    for (i = 0; i < L->ntypes; ++i) /* map decoding needs key and value */
+        if (L->types[i]->is_map && (pb_field(L->types[i], 1) == NULL
+                    || pb_field(L->types[i], 2) == NULL))
+            return PB_ERROR;
+    return PB_OK;
+}
+
+static int pbI_loadimage(pb_State *S, pb_Slice *s) {
+    pbI_Loader L;
+    int r;
+    memset(&L, 0, sizeof(L));
+    L.s = *s;
+    L.s.p += 4;
+    r = pbI_load(S, &L);
+    free(L.names);
+    free(L.types);
+    s->p = L.s.p;
+    return r;
+}
+
 PB_API int pb_load(pb_State *S, pb_Slice *s) {
     pbL_FileInfo *files = NULL;
     pb_Loader L;
     int r;
+    ++S->gen;
+    if (pb_len(*s) >= 4 && memcmp(s->p, PB_IMAGE_MAGIC, 4) == 0)
+        return pbI_loadimage(S, s);
     pb_initbuffer(&L.b);
     L.s         = *s;
     L.is_proto3 = 0;
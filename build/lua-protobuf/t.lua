@@ -0,0 +1 @@
+assert(io.write(require 'pb.io'.read()))
\ No newline at end of file
@@ -496,6 +496,356 @@ function _G.test_enum()
    assert(pb.type ".google.protobuf.FileDescriptorSet")
 end
 
+function _G.test_reload()
+   check_load [[
+      syntax = "proto3";
+      message TestReload {
+         int32  a = 1;
+         string b = 2;
+      } ]]
+   local data = pb.encode("TestReload", { a = 1, b = "x" })
+   eq(pb.decode("TestReload", data), { a = 1, b = "x" })
+
+   check_load [[
+      syntax = "proto3";
+      enum ReloadKind { K0 = 0; K1 = 1; }
+      message TestReload {
+         int32      a2 = 1;
+         string     b2 = 2;
+         int64      c2 = 100000;
+         ReloadKind k2 = 3;
+      } ]]
+   eq(pb.decode("TestReload", data), { a2 = 1, b2 = "x", c2 = 0, k2 = "K0" })
+   eq(pb.decode("TestReload", "\128\234\48\5\24\1"),
+      { a2 = 0, b2 = "", c2 = 5, k2 = "K1" })
+
+   pb.option "enum_as_value"
+   eq(pb.decode("TestReload", data), { a2 = 1, b2 = "x", c2 = 0, k2 = 0 })
+   pb.option "enum_as_name"
+
+   -- a state reading these types through pb.use "global" sees the reload
+   local unsafe = require "pb.unsafe"
+   local owner = pb.state(nil)
+   eq(unsafe.use "global", true)
+   eq(pb.decode("TestReload", data), { a2 = 1, b2 = "x", c2 = 0, k2 = "K0" })
+   local user = pb.state(owner)
+   pb.clear "TestReload"
+   check_load [[
+      syntax = "proto3";
+      message TestReload { string b3 = 2; } ]]
+   pb.state(user)
+   eq(pb.decode("TestReload", data), { b3 = "x" })
+   pb.state(owner)
+
+   check_load [[
+      enum ReloadWide { W_MIN = -2147483648; W0 = 0; W_MAX = 2147483647; }
+      message TestReloadWide { repeated ReloadWide w = 1; } ]]
+   check_msg("TestReloadWide", { w = { "W_MIN", "W0", "W_MAX" } })
+   eq(pb.enum("ReloadWide", -2147483648), "W_MIN")
+   eq(pb.enum("ReloadWide", "W_MAX"), 2147483647)
+end
+
+function _G.test_view()
+   check_load [[
+      syntax = "proto3";
+      message ViewItem { int32 id = 1; string name = 2; }
+      message TestView {
+         int32              id    = 1;
+         string             name  = 2;
+         ViewItem           item  = 3;
+         repeated ViewItem  items = 4;
+         repeated int32     nums  = 5;
+         map<string, int32> dict  = 6;
+         repeated string    tags  = 7;
+      } ]]
+   local msg = {
+      id = 7, name = "view",
+      item = { id = 1, name = "one" },
+      items = { { id = 2 }, { id = 3, name = "three" } },
+      nums = { 1, -2, 300 },
+      dict = { a = 1, b = 2 },
+      tags = { "x", "y" },
+   }
+   local data = pb.encode("TestView", msg)
+   local v = pb.view("TestView", data)
+   eq(v.id, 7)
+   eq(v.name, "view")
+   eq(v.id, 7)
+   eq(v.item.name, "one")
+   eq(v.item.id, 1)
+   eq(#v.items, 2)
+   eq(v.items[1].id, 2)
+   eq(v.items[1].name, "")
+   eq(v.items[2].name, "three")
+   eq(v.items[3], nil)
+   eq(#v.nums, 3)
+   eq({ v.nums[1], v.nums[2], v.nums[3] }, { 1, -2, 300 })
+   eq(v.dict, { a = 1, b = 2 })
+   eq({ v.tags[1], v.tags[2] }, { "x", "y" })
+   eq(v.not_a_field, nil)
+   eq(v[1], nil)
+
+   local e = pb.view("TestView", "")
+   eq(e.id, 0)
+   eq(e.name, "")
+   eq(e.item, nil)
+   eq(#e.items, 0)
+   eq(tostring(e):match "^pb.View %(.TestView%)" ~= nil, true)
+
+   fail("attempt to get length of a message view", function() return #v end)
+   fail("invalid value for tag 2",
+        function() return pb.view("TestView", "\18\5ab").id end)
+
+   local items = v.items
+   check_load [[
+      syntax = "proto3";
+      message TestView { int32 id = 1; } ]]
+   fail("types changed after the view was created",
+        function() return v.id end)
+   fail("types changed after the view was created",
+        function() return items[1] end)
+   eq(pb.view("TestView", data).id, 7)
+
+   -- wire field number 0 is skipped like pb.decode does
+   v = pb.view("TestView", "\0\1" .. data)
+   eq(v.id, 7)
+   collectgarbage()
+   eq(v.id, 7)
+
+   -- proto2 fields read like the fields of the decoded table
+   check_load [[
+      message TestView2 {
+         optional int32     id   = 1 [default = 5];
+         optional string    name = 2 [default = "n"];
+         optional int32     num  = 3;
+         optional TestView2 sub  = 4;
+      } ]]
+   local fields = { "id", "name", "num", "sub" }
+   for _, opt in ipairs { "auto_default_values", "no_default_values",
+                          "use_default_values", "use_default_metatable" } do
+      pb.option(opt)
+      local v2, t2 = pb.view("TestView2", ""), pb.decode("TestView2", "")
+      for _, name in ipairs(fields) do
+         eq(v2[name], t2[name])
+      end
+      v2 = pb.view("TestView2", "\8\1")
+      eq(v2.id, 1)
+   end
+   pb.option "use_default_values"
+   eq(pb.view("TestView2", "").id, 5)
+   eq(pb.view("TestView2", "").name, "n")
+   pb.option "auto_default_values"
+   eq(pb.view("TestView2", "").id, nil)
+   eq(pb.view("TestView2", "").name, nil)
+
+   -- oneof names read as the member set last, as in pb.decode
+   check_load [[
+      syntax = "proto3";
+      message TestViewOneof {
+         oneof o { int32 a = 1; string b = 2; TestViewOneof c = 3; }
+         oneof p { int32 x = 4; int32 y = 5; }
+         int32 n = 6;
+      } ]]
+   for _, m in ipairs { {}, { a = 1 }, { b = "s" }, { c = { a = 2 } },
+                        { a = 0, x = 3 }, { y = 0, n = 1 } } do
+      local d = pb.encode("TestViewOneof", m)
+      local v3, t3 = pb.view("TestViewOneof", d), pb.decode("TestViewOneof", d)
+      eq(v3.o, t3.o)
+      eq(v3.p, t3.p)
+      eq(v3.o, t3.o)
+   end
+   local a1, b1 = pb.encode("TestViewOneof", { a = 1 }),
+                  pb.encode("TestViewOneof", { b = "s" })
+   eq(pb.view("TestViewOneof", a1 .. b1).o, "b")
+   eq(pb.view("TestViewOneof", b1 .. a1).o, "a")
+   eq(pb.decode("TestViewOneof", b1 .. a1).o, "a")
+   local v3 = pb.view("TestViewOneof", pb.encode("TestViewOneof",
+                                                 { c = { b = "t" } }))
+   eq(v3.o, "c")
+   eq(v3.c.o, "b")
+   eq(v3.c.b, "t")
+   eq(v3.a, nil)
+   eq(pb.view("TestViewOneof", "").o, nil)
+   eq(pb.view("TestViewOneof", "").n, 0)
+   eq(v3.q, nil)
+end
+
+function _G.test_stream()
+   check_load [[
+      message TestStream { optional int32 id = 1; optional string name = 2; } ]]
+   local msgs = { { id = 1, name = "a" }, { id = 2 }, {}, { name = "d" } }
+   local data = pb.encode_stream("TestStream", msgs)
+   local expected = {}
+   for i, m in ipairs(msgs) do
+      local s = pb.encode("TestStream", m)
+      expected[i] = string.char(#s) .. s
+   end
+   eq(data, table.concat(expected))
+   local t, pos = pb.decode_stream("TestStream", data)
+   eq(t, msgs)
+   eq(pos, #data + 1)
+
+   t, pos = pb.decode_stream("TestStream", data, #expected[1] + 1)
+   eq(t, { msgs[2], msgs[3], msgs[4] })
+   eq(pos, #data + 1)
+
+   -- an unfinished trailing message is left for the next call
+   t, pos = pb.decode_stream("TestStream", data .. "\5\8\1")
+   eq(#t, 4)
+   eq(pos, #data + 1)
+   t, pos = pb.decode_stream("TestStream", data .. ("\255"):rep(9))
+   eq(#t, 4)
+   eq(pos, #data + 1)
+   fail("invalid length prefix at offset " .. (#data + 1),
+        function() pb.decode_stream("TestStream", data .. ("\255"):rep(10)) end)
+   fail("invalid length prefix at offset 1",
+        function() pb.decode_stream("TestStream", ("\128"):rep(11) .. "\0") end)
+   eq(pb.decode_stream("TestStream", ""), {})
+
+   local b = buffer "x"
+   eq(pb.encode_stream("TestStream", { msgs[1] }, b), b)
+   eq(b:result(), "x" .. expected[1])
+   fail("table expected at index 2, got number",
+        function() pb.encode_stream("TestStream", { {}, 1 }) end)
+   fail("type 'NoSuchType' does not exists",
+        function() pb.decode_stream("NoSuchType", data) end)
+end
+
+function _G.test_scratch()
+   check_load [[ message TestScratch { optional bytes data = 1; } ]]
+   local old = pb.scratch_limit()
+   eq(old, 4 * 1024 * 1024)
+   local big = ("x"):rep(100000)
+   eq(pb.scratch_limit(1024), old)
+   eq(pb.decode("TestScratch", pb.encode("TestScratch", { data = big })).data, big)
+   eq(pb.decode("TestScratch", pb.encode("TestScratch", { data = "y" })).data, "y")
+   eq(pb.scratch_limit(0), 1024)
+   eq(pb.decode("TestScratch", pb.encode("TestScratch", { data = big })).data, big)
+   fail("negative limit", function() pb.scratch_limit(-1) end)
+   eq(pb.scratch_limit(old), 0)
+end
+
+function _G.test_share()
+   local v1 = protoc.new():compile [[
+      message TestShared { optional int32 id = 1; } ]]
+   local v2 = protoc.new():compile [[
+      message TestShared { optional int32 id2 = 1; } ]]
+   local v3 = protoc.new():compile [[
+      message TestShared3 { optional int32 id3 = 1; } ]]
+   eq(pb.type "TestShared", nil)
+   eq(pb.detach(), false)
+   eq(pb.share(v1), true)
+   eq(pb.type "TestShared", nil)
+   eq(pb.attach(), true)
+   eq(pb.type "TestShared", ".TestShared")
+   local data = pb.encode("TestShared", { id = 1 })
+   eq(pb.decode("TestShared", data), { id = 1 })
+
+   -- attached states keep the old schema until they attach again
+   eq(pb.share(v2), true)
+   eq(pb.decode("TestShared", data), { id = 1 })
+   eq(pb.attach(), true)
+   eq(pb.decode("TestShared", data), { id2 = 1 })
+
+   -- loading into the local types needs an explicit detach
+   fail("attached to a shared schema", function() pb.load(v3) end)
+   fail("attached to a shared schema", function() pb.loadfile "-not-exists-" end)
+   eq(pb.type "TestShared3", nil)
+   eq(pb.type "TestShared", ".TestShared")
+   eq(pb.encode("TestShared", { id2 = 1 }), data)
+
+   eq(pb.detach(), true)
+   eq(pb.load(v3), true)
+   eq(pb.type "TestShared3", ".TestShared3")
+   pb.clear "TestShared3"
+   eq(pb.attach(), true)
+   eq(pb.type "TestShared3", nil)
+
+   eq(pb.detach(), true)
+   eq(pb.type "TestShared", nil)
+   eq(pb.detach(), false)
+   eq(pb.share "\10\2", false)
+end
+
+function _G.test_dump()
+   local dump_pb = protoc.new():compile [[
+      syntax = "proto3";
+      enum DumpKind { D0 = 0; D1 = 1; }
+      message TestDump {
+         message Inner { int32 x = 1; }
+         int32             id    = 1;
+         repeated int64    packs = 2;
+         map<string,Inner> items = 3;
+         DumpKind          kind  = 4;
+         oneof choice { string s = 5; Inner i = 6; }
+      } ]]
+   eq(pb.load(dump_pb), true)
+   local msg = { id = 1, packs = { 1, -2, 3 }, kind = "D1",
+                 items = { a = { x = 1 }, b = { x = 2 } }, s = "str" }
+   local data = pb.encode("TestDump", msg)
+   local decoded = pb.decode("TestDump", data)
+   local field = { pb.field("TestDump", "i") }
+   local image = pb.dump()
+   eq(image:sub(1, 4), "\0PBI")
+
+   local old = pb.state(nil)
+   eq(pb.type "TestDump", nil)
+   eq(pb.load(image), true)
+   eq(pb.type "TestDump", ".TestDump")
+   eq({ pb.type "TestDump.ItemsEntry" },
+      { ".TestDump.ItemsEntry", "ItemsEntry", "map" })
+   eq({ pb.field("TestDump", "i") }, field)
+   eq(pb.enum("DumpKind", 1), "D1")
+   eq(pb.decode("TestDump", data), decoded)
+   eq(pb.encode("TestDump", msg), data)
+
+   -- an image of a loaded image is equivalent to the original one
+   pb.state(nil)
+   eq(pb.load(image), true)
+   local image2 = pb.dump()
+   pb.state(nil)
+   eq(pb.load(image2), true)
+   eq(pb.decode("TestDump", data), decoded)
+   eq({ pb.field("TestDump", "i") }, field)
+
+   pb.state(nil)
+   eq(pb.load(image:sub(1, -2)), false)
+   eq(pb.load "\0PBI\2", false)
+
+   -- .M { .M.E e = 1; } where the map entry .M.E has no key or value,
+   -- and the same with a message field that names no type
+   local function M(etype, eflags)
+      return "\0PBI\1\3\2" .. "\5.M\0" .. "\9.M.E" .. eflags
+          .. "\0\1" .. "\3\3e\1" .. etype .. "\0\0\11" .. "\0\0"
+   end
+   eq(pb.load(M("\2", "\0")), true)
+   pb.state(nil)
+   eq(pb.load(M("\2", "\2")), false)
+   pb.state(nil)
+   eq(pb.load(M("\0", "\0")), false)
+   -- names are C strings in Lua, so they can not hold "\0"
+   pb.state(nil)
+   eq(pb.load("\0PBI\1\1\1" .. "\9.M_N" .. "\0" .. "\0\0"), true)
+   pb.state(nil)
+   eq(pb.load("\0PBI\1\1\1" .. "\9.M\0N" .. "\0" .. "\0\0"), false)
+
+   -- corrupted images load or fail, but never break decoding
+   pb.state(nil)
+   eq(pb.load(dump_pb), true)
+   local small = pb.dump()
+   for i = 5, #small do
+      for _, c in ipairs { 0, 1, 2, 3, 11, 127, 255 } do
+         pb.state(nil)
+         if pb.load(small:sub(1, i-1) .. string.char(c) .. small:sub(i+1)) then
+            pcall(pb.decode, "TestDump", data)
+            pcall(pb.encode, "TestDump", msg)
+            for _ in pb.types() do end
+         end
+      end
+   end
+   pb.state(old)
+end
+
 function _G.test_packed()
    check_load [[
    message Empty {}
@@ -0,0 +1,66 @@
+-- pb <-> json transcoding against going through Lua tables with
+-- pb.decode/pb.encode and rapidjson.encode/decode, run from the
+-- lua-rapidjson directory: lua bench/pbjson.lua [iterations]
+package.path = "../lua-protobuf/?.lua;" .. package.path
+local rapidjson = require "rapidjson"
+local pb        = require "pb"
+local protoc    = require "protoc"
+
+assert(protoc:load [[
+  syntax = "proto3";
+  enum BenchKind { NONE = 0; ITEM = 1; HERO = 2; }
+  message BenchItem {
+    int32 item_id = 1; int32 count = 2; BenchKind kind = 3; string name = 4;
+    repeated int32 attrs = 5;
+  }
+  message BenchPlayer {
+    int64 player_id = 1; string nick_name = 2; int32 level = 3;
+    double exp_rate = 4; repeated BenchItem bag_items = 5;
+    map<string, int32> counters = 6; repeated string tags = 7; bool online = 8;
+  } ]])
+
+local player = { player_id = 1234567890123, nick_name = "player one",
+                 level = 42, exp_rate = 0.75, online = true,
+                 bag_items = {}, counters = {}, tags = {} }
+for i = 1, 50 do
+  player.bag_items[i] = { item_id = 1000 + i, count = i * 3,
+                          kind = i % 2 == 0 and "ITEM" or "HERO",
+                          name = "item_" .. i, attrs = {i, i * 2, i * 3, i * 4} }
+  player.counters["c" .. i] = i
+  if i <= 10 then player.tags[i] = "tag" .. i end
+end
+
+local opts = { proto_names = true }
+local data = pb.encode("BenchPlayer", player)
+local json = rapidjson.pb.tojson("BenchPlayer", data, opts)
+print(("message %d bytes, json %d bytes"):format(#data, #json))
+
+local n = tonumber(arg and arg[1]) or 20000
+
+-- heap per op is sampled with the collector stopped, then the timed loop
+-- runs with it on
+local function bench(name, f)
+  collectgarbage()
+  collectgarbage("stop")
+  local m = collectgarbage("count")
+  for _ = 1, 200 do f() end
+  local heap = (collectgarbage("count") - m) / 200
+  collectgarbage("restart")
+  collectgarbage()
+  local c = os.clock()
+  for _ = 1, n do f() end
+  print(("%-28s %6.2fs  %6.1fKB Lua heap/op"):format(name, os.clock() - c, heap))
+end
+
+bench("pb -> json: decode + encode", function()
+  return rapidjson.encode(pb.decode("BenchPlayer", data))
+end)
+bench("            pb.tojson", function()
+  return rapidjson.pb.tojson("BenchPlayer", data, opts)
+end)
+bench("json -> pb: decode + encode", function()
+  return pb.encode("BenchPlayer", rapidjson.decode(json))
+end)
+bench("            pb.fromjson", function()
+  return rapidjson.pb.fromjson("BenchPlayer", json)
+end)
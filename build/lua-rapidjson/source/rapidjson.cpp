@@ -1,9 +1,19 @@
 #include <limits>
+#include <cctype>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <new>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
 
 #include "lua.hpp"
 
@@ -26,16 +36,28 @@
 #include "rapidjson/filewritestream.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/reader.h"
+#include "rapidjson/schema.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/prettywriter.h"
 
+#ifdef LUA_RAPIDJSON_WITH_PB
+#define PB_STATIC_API
+#include "pb.h"
+#endif
+
 using namespace rapidjson;
 
 #ifndef LUA_RAPIDJSON_VERSION
 #define LUA_RAPIDJSON_VERSION "scm"
 #endif
 
+// WebGL has no threads unless emscripten builds with pthreads, load_many
+// then parses everything on the calling thread.
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__) && !defined(LUA_RAPIDJSON_NO_THREADS)
+#define LUA_RAPIDJSON_NO_THREADS
+#endif
+
 static const char* JSON_TABLE_TYPE_FIELD = "__jsontype";
 enum json_table_type {
 	JSON_TABLE_TYPE_OBJECT = 0,
@@ -46,6 +68,13 @@ enum json_table_type {
 static const char* JSON_TABLE_TYPE_NAMES[JSON_TABLE_TYPE_MAX] = { "object", "array" };
 static const char* JSON_TABLE_TYPE_METAS[JSON_TABLE_TYPE_MAX] = { "json.object", "json.array" };
 
+static const char* JSON_ENCODER_META = "json.encoder";
+static const char* JSON_SCHEMA_META = "json.schema";
+static const char* JSON_LOAD_BATCH_META = "json.load_batch";
+#ifdef LUA_RAPIDJSON_WITH_PB
+static const char* PB_BUFFER_META = "pb.Buffer";
+#endif
+
 
 static void setfuncs(lua_State* L, const luaL_Reg *funcs)
 {
@@ -59,6 +88,20 @@ static void setfuncs(lua_State* L, const luaL_Reg *funcs)
 
 #if LUA_VERSION_NUM < 502
 #define lua_rawlen   lua_objlen
+
+// only used with pseudo-indices such as LUA_REGISTRYINDEX.
+static void lua_rawgetp(lua_State* L, int idx, const void* p)
+{
+	lua_pushlightuserdata(L, const_cast<void*>(p));
+	lua_rawget(L, idx);
+}
+
+static void lua_rawsetp(lua_State* L, int idx, const void* p)
+{
+	lua_pushlightuserdata(L, const_cast<void*>(p));
+	lua_insert(L, -2);
+	lua_rawset(L, idx);
+}
 #endif
 
 
@@ -239,8 +282,8 @@ struct ToLuaHandler {
 		current_.submit(L);
 		return true;
 	}
-	bool StartObject() {
-		lua_createtable(L, 0, 0); // [..., object]
+	bool StartObject(SizeType nrec = 0) {
+		lua_createtable(L, 0, nrec); // [..., object]
 
 		// mark as object.
 		luaL_getmetatable(L, "json.object");  //[..., object, json.object]
@@ -254,14 +297,18 @@ struct ToLuaHandler {
 		lua_pushlstring(L, str, length);
 		return true;
 	}
+	bool IntKey(int64_t i) { // MessagePack maps may use integer keys
+		lua_pushinteger(L, static_cast<lua_Integer>(i));
+		return true;
+	}
 	bool EndObject(SizeType memberCount) {
 		current_ = stack_.back();
 		stack_.pop_back();
 		current_.submit(L);
 		return true;
 	}
-	bool StartArray() {
-		lua_createtable(L, 0, 0);
+	bool StartArray(SizeType narr = 0) {
+		lua_createtable(L, narr, 0);
 
 		// mark as array.
 		luaL_getmetatable(L, "json.array");  //[..., array, json.array]
@@ -301,11 +348,100 @@ inline int decode(lua_State* L, Stream* s)
 	return 1;
 }
 
+/**
+* Forwards validated events to a ToLuaHandler. The validator also creates
+* default constructed output handlers for its sub-schema validators, those
+* must stay silent.
+*/
+struct ValidatedHandler {
+	ValidatedHandler() : h_(NULL) {}
+	explicit ValidatedHandler(ToLuaHandler* h) : h_(h) {}
+
+	bool Null() { return h_ == NULL || h_->Null(); }
+	bool Bool(bool b) { return h_ == NULL || h_->Bool(b); }
+	bool Int(int i) { return h_ == NULL || h_->Int(i); }
+	bool Uint(unsigned u) { return h_ == NULL || h_->Uint(u); }
+	bool Int64(int64_t i) { return h_ == NULL || h_->Int64(i); }
+	bool Uint64(uint64_t u) { return h_ == NULL || h_->Uint64(u); }
+	bool Double(double d) { return h_ == NULL || h_->Double(d); }
+	bool String(const char* str, SizeType length, bool copy) { return h_ == NULL || h_->String(str, length, copy); }
+	bool StartObject() { return h_ == NULL || h_->StartObject(); }
+	bool Key(const char* str, SizeType length, bool copy) { return h_ == NULL || h_->Key(str, length, copy); }
+	bool EndObject(SizeType memberCount) { return h_ == NULL || h_->EndObject(memberCount); }
+	bool StartArray() { return h_ == NULL || h_->StartArray(); }
+	bool EndArray(SizeType elementCount) { return h_ == NULL || h_->EndArray(elementCount); }
+private:
+	ToLuaHandler* h_;
+};
+
+/**
+* Decodes and validates against the schema in the same SAX pass,
+* stops at the first violation.
+*/
+template<typename Stream>
+inline int decode(lua_State* L, Stream* s, const SchemaDocument* schema)
+{
+	int top = lua_gettop(L);
+	ToLuaHandler handler(L);
+	ValidatedHandler output(&handler);
+	GenericSchemaValidator<SchemaDocument, ValidatedHandler> validator(*schema, output);
+	Reader reader;
+	ParseResult r = reader.Parse(*s, validator);
+
+	if (!r) {
+		lua_settop(L, top);
+		lua_pushnil(L);
+		if (validator.IsValid()) {
+			lua_pushfstring(L, "%s (%d)", GetParseError_En(r.Code()), r.Offset());
+			return 2;
+		}
+
+		StringBuffer sp, dp;
+		validator.GetInvalidSchemaPointer().StringifyUriFragment(sp);
+		validator.GetInvalidDocumentPointer().StringifyUriFragment(dp);
+		lua_pushfstring(L, "schema violation: '%s' at %s (schema %s)",
+			validator.GetInvalidSchemaKeyword(), dp.GetString(), sp.GetString());
+		return 2;
+	}
+
+	return 1;
+}
+
+static const SchemaDocument* optSchema(lua_State* L, int opt)
+{
+	if (lua_isnoneornil(L, opt))
+		return NULL;
+	luaL_checktype(L, opt, LUA_TTABLE);
+
+	lua_getfield(L, opt, "schema"); // [schema]
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1); // []
+		return NULL;
+	}
+
+	const SchemaDocument* schema = static_cast<SchemaDocument*>(lua_touserdata(L, -1));
+	bool is = schema != NULL && lua_getmetatable(L, -1); // [schema, meta]
+	if (is)
+	{
+		luaL_getmetatable(L, JSON_SCHEMA_META); // [schema, meta, json.schema]
+		is = lua_rawequal(L, -1, -2) != 0;
+		lua_pop(L, 2); // [schema]
+	}
+	if (!is)
+		luaL_argerror(L, opt, "field 'schema' must be a rapidjson.schema");
+	lua_pop(L, 1); // []
+	return schema;
+}
+
 static int json_decode(lua_State* L)
 {
 	size_t len = 0;
 	const char* contents = luaL_checklstring(L, 1, &len);
+	const SchemaDocument* schema = optSchema(L, 2);
 	StringStream s(contents);
+	if (schema != NULL)
+		return decode(L, &s, schema);
 	return decode(L, &s);
 }
 
@@ -314,6 +450,7 @@ static int json_decode(lua_State* L)
 static int json_load(lua_State* L)
 {
 	const char* filename = luaL_checklstring(L, 1, NULL);
+	const SchemaDocument* schema = optSchema(L, 2);
 	FILE* fp = openForRead(filename);
 	if (fp == NULL)
 		luaL_error(L, "error while open file: %s", filename);
@@ -323,39 +460,460 @@ static int json_load(lua_State* L)
 	FileReadStream fs(fp, &readBuffer.front(), BufferSize);
 	AutoUTFInputStream<unsigned, FileReadStream> eis(fs);
 
-	int n = decode(L, &eis);
+	int n = schema != NULL ? decode(L, &eis, schema) : decode(L, &eis);
 
 	fclose(fp);
 	return n;
 }
 
+
+/**
+* One file of a rapidjson.load_many batch. Parsed off the Lua thread into
+* its own Document, whose MemoryPoolAllocator is dropped in one go once the
+* tree has been copied into Lua.
+*/
+struct LoadJob {
+	LoadJob() : done(false) {}
+
+	std::string path;
+	Document doc;
+	std::string error;
+	bool done;
+};
+
+/**
+* Workers claim jobs in order, the Lua thread materializes them in the same
+* order and parses the next unclaimed one itself instead of idling. Workers
+* never run more than window jobs ahead of the Lua thread, so at most that
+* many parsed Documents are resident at once. Lives in a userdata so a Lua
+* error while materializing still joins the workers.
+*/
+class LoadBatch {
+public:
+	LoadBatch(size_t n, size_t window) : jobs_(n), window_(window), consumed_(0), next_(0), cancel_(false) {}
+	~LoadBatch()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			cancel_ = true;
+		}
+		room_.notify_all();
+		for (size_t i = 0; i < workers_.size(); ++i)
+			workers_[i].join();
+	}
+
+	LoadJob& operator[](size_t i) { return jobs_[i]; }
+	size_t size() const { return jobs_.size(); }
+
+	void start(size_t nthreads)
+	{
+#ifndef LUA_RAPIDJSON_NO_THREADS
+		try {
+			for (size_t i = 0; i < nthreads; ++i)
+				workers_.push_back(std::thread(&LoadBatch::work, this));
+		}
+		catch (const std::system_error&) {
+			// fewer workers, wait() parses whatever is left.
+		}
+#else
+		(void)nthreads;
+#endif
+	}
+
+	LoadJob& wait(size_t i)
+	{
+		size_t expected = i;
+		if (next_.compare_exchange_strong(expected, i + 1))
+		{
+			parse(jobs_[i]);
+			return jobs_[i];
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (!jobs_[i].done)
+			ready_.wait(lock);
+		return jobs_[i];
+	}
+
+	// job i has been copied into Lua, workers may parse one more.
+	void release(size_t i)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			consumed_ = i + 1;
+		}
+		room_.notify_all();
+	}
+
+private:
+	void work()
+	{
+		for (;;)
+		{
+			size_t i = next_.fetch_add(1);
+			if (i >= jobs_.size() || cancel_)
+				return;
+
+			{
+				// the job the Lua thread waits for is always inside the window.
+				std::unique_lock<std::mutex> lock(mutex_);
+				while (i >= consumed_ + window_ && !cancel_)
+					room_.wait(lock);
+				if (cancel_)
+					return;
+			}
+
+			parse(jobs_[i]);
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				jobs_[i].done = true;
+			}
+			ready_.notify_all();
+		}
+	}
+
+	static void parse(LoadJob& job)
+	{
+		FILE* fp = openForRead(job.path.c_str());
+		if (fp == NULL)
+		{
+			job.error = "error while open file: " + job.path;
+			return;
+		}
+
+		char readBuffer[16 * 1024];
+		FileReadStream fs(fp, readBuffer, sizeof(readBuffer));
+		AutoUTFInputStream<unsigned, FileReadStream> eis(fs);
+		job.doc.ParseStream<kParseDefaultFlags, AutoUTF<unsigned> >(eis);
+		fclose(fp);
+
+		if (job.doc.HasParseError())
+		{
+			char offset[24];
+			snprintf(offset, sizeof(offset), " (%u)", static_cast<unsigned>(job.doc.GetErrorOffset()));
+			job.error = job.path + ": " + GetParseError_En(job.doc.GetParseError()) + offset;
+		}
+	}
+
+	std::vector<LoadJob> jobs_;
+	std::vector<std::thread> workers_;
+	size_t window_;
+	size_t consumed_; // guarded by mutex_
+	std::atomic<size_t> next_;
+	std::atomic<bool> cancel_;
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::condition_variable room_;
+};
+
+static const int LOAD_MANY_MAX_DEPTH = 200;
+
+static bool pushDocument(lua_State* L, ToLuaHandler& handler, const Value& v, int depth)
+{
+	switch (v.GetType()) {
+	case kNullType:
+		return handler.Null();
+	case kFalseType:
+	case kTrueType:
+		return handler.Bool(v.GetBool());
+	case kStringType:
+		return handler.String(v.GetString(), v.GetStringLength(), false);
+	case kNumberType:
+		if (v.IsInt())
+			return handler.Int(v.GetInt());
+		if (v.IsUint())
+			return handler.Uint(v.GetUint());
+		if (v.IsInt64())
+			return handler.Int64(v.GetInt64());
+		if (v.IsUint64())
+			return handler.Uint64(v.GetUint64());
+		return handler.Double(v.GetDouble());
+	case kObjectType:
+		if (depth >= LOAD_MANY_MAX_DEPTH || !lua_checkstack(L, 4))
+			return false;
+		handler.StartObject(v.MemberCount());
+		for (Value::ConstMemberIterator m = v.MemberBegin(); m != v.MemberEnd(); ++m)
+		{
+			handler.Key(m->name.GetString(), m->name.GetStringLength(), false);
+			if (!pushDocument(L, handler, m->value, depth + 1))
+				return false;
+		}
+		return handler.EndObject(v.MemberCount());
+	case kArrayType:
+		if (depth >= LOAD_MANY_MAX_DEPTH || !lua_checkstack(L, 4))
+			return false;
+		handler.StartArray(v.Size());
+		for (Value::ConstValueIterator e = v.Begin(); e != v.End(); ++e)
+		{
+			if (!pushDocument(L, handler, *e, depth + 1))
+				return false;
+		}
+		return handler.EndArray(v.Size());
+	}
+	return false;
+}
+
+static int loadbatch_gc(lua_State* L)
+{
+	LoadBatch* batch = static_cast<LoadBatch*>(luaL_checkudata(L, 1, JSON_LOAD_BATCH_META));
+	batch->~LoadBatch();
+	return 0;
+}
+
+static void createLoadBatchMeta(lua_State* L)
+{
+	luaL_newmetatable(L, JSON_LOAD_BATCH_META); // [meta]
+	lua_pushcfunction(L, loadbatch_gc); // [meta, gc]
+	lua_setfield(L, -2, "__gc"); // [meta]
+	lua_pop(L, 1); // []
+}
+
+/**
+* rapidjson.load_many(paths[, options])
+* options.threads: number of parser threads, defaults to the cpu count.
+* options.window: most files parsed ahead of the ones already returned to
+* Lua, defaults to twice the thread count.
+* Returns an array of decoded values in the order of paths, and a second
+* table of error messages keyed by index when any file failed.
+*/
+static int json_load_many(lua_State* L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	size_t n = lua_rawlen(L, 1);
+
+	size_t nthreads = std::thread::hardware_concurrency();
+	size_t window = 0;
+	if (lua_istable(L, 2))
+	{
+		lua_getfield(L, 2, "threads");
+		if (!lua_isnil(L, -1))
+		{
+			lua_Integer t = luaL_checkinteger(L, -1);
+			nthreads = t > 0 ? static_cast<size_t>(t) : 1;
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "window");
+		if (!lua_isnil(L, -1))
+		{
+			lua_Integer w = luaL_checkinteger(L, -1);
+			window = w > 0 ? static_cast<size_t>(w) : 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 1);
+	if (nthreads == 0)
+		nthreads = 1;
+	if (window == 0)
+		window = nthreads * 2;
+
+	LoadBatch* batch = new(lua_newuserdata(L, sizeof(LoadBatch))) LoadBatch(n, window); // [paths, batch]
+	luaL_setmetatable(L, JSON_LOAD_BATCH_META); // [paths, batch]
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		lua_rawgeti(L, 1, static_cast<int>(i + 1));
+		size_t len = 0;
+		const char* path = lua_tolstring(L, -1, &len);
+		if (path == NULL)
+			return luaL_error(L, "paths[%d] is not a string", static_cast<int>(i + 1));
+		(*batch)[i].path.assign(path, len);
+		lua_pop(L, 1);
+	}
+
+	// the calling thread parses too while it waits.
+	batch->start(std::min(nthreads, n) > 1 ? std::min(nthreads, n) - 1 : 0);
+
+	lua_createtable(L, static_cast<int>(n), 0); // [paths, batch, docs]
+	int docs = lua_gettop(L);
+	int errors = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		LoadJob& job = batch->wait(i);
+		if (job.error.empty())
+		{
+			ToLuaHandler handler(L);
+			if (pushDocument(L, handler, job.doc, 0))
+				lua_rawseti(L, docs, static_cast<int>(i + 1));
+			else
+			{
+				lua_settop(L, errors != 0 ? errors : docs);
+				job.error = job.path + ": nested too depth";
+			}
+		}
+		Document().Swap(job.doc);
+		batch->release(i);
+
+		if (!job.error.empty())
+		{
+			if (errors == 0)
+			{
+				lua_newtable(L); // [paths, batch, docs, errors]
+				errors = lua_gettop(L);
+			}
+			lua_pushlstring(L, job.error.data(), job.error.size());
+			lua_rawseti(L, errors, static_cast<int>(i + 1));
+		}
+	}
+
+	return errors != 0 ? 2 : 1;
+}
+
+
+// the address is the registry key of the schema cache, so no name in the
+// registry can reach it.
+static char schemaCacheKey;
+
+/**
+* rapidjson.schema(json_schema_string)
+* Compiles the schema once, the same string returns the cached schema.
+*/
+static int json_schema(lua_State* L)
+{
+	size_t len = 0;
+	const char* contents = luaL_checklstring(L, 1, &len);
+	lua_settop(L, 1); // [str]
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &schemaCacheKey); // [str, cache]
+	lua_pushvalue(L, 1); // [str, cache, str]
+	lua_rawget(L, 2); // [str, cache, schema]
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 1); // [str, cache]
+
+	void* p = lua_newuserdata(L, sizeof(SchemaDocument)); // [str, cache, schema]
+	ParseResult r;
+	{
+		Document d;
+		StringStream s(contents);
+		d.ParseStream(s);
+		r = ParseResult(d.GetParseError(), d.GetErrorOffset());
+		if (r)
+			new (p) SchemaDocument(d);
+	}
+	if (!r) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s (%d)", GetParseError_En(r.Code()), r.Offset());
+		return 2;
+	}
+
+	luaL_getmetatable(L, JSON_SCHEMA_META); // [str, cache, schema, meta]
+	lua_setmetatable(L, -2); // [str, cache, schema]
+	lua_pushvalue(L, 1); // [str, cache, schema, str]
+	lua_pushvalue(L, -2); // [str, cache, schema, str, schema]
+	lua_rawset(L, 2); // [str, cache, schema]
+	return 1;
+}
+
+static int schema_gc(lua_State* L)
+{
+	SchemaDocument* schema = static_cast<SchemaDocument*>(luaL_checkudata(L, 1, JSON_SCHEMA_META));
+	schema->~SchemaDocument();
+	return 0;
+}
+
+static void createSchemaMeta(lua_State* L)
+{
+	luaL_newmetatable(L, JSON_SCHEMA_META); // [meta]
+	lua_pushcfunction(L, schema_gc); // [meta, gc]
+	lua_setfield(L, -2, "__gc"); // [meta]
+	lua_pop(L, 1); // []
+
+	// compiled schemas keyed by source, collected once unused.
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &schemaCacheKey); // [cache]
+	bool exists = !lua_isnil(L, -1);
+	lua_pop(L, 1); // []
+	if (exists)
+		return;
+	lua_newtable(L); // [cache]
+	lua_createtable(L, 0, 1); // [cache, mode]
+	lua_pushliteral(L, "v"); // [cache, mode, "v"]
+	lua_setfield(L, -2, "__mode"); // [cache, mode]
+	lua_setmetatable(L, -2); // [cache]
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &schemaCacheKey); // []
+}
+
 struct Key
 {
-	Key(const char* k, SizeType l) : key(k), size(l) {}
-	bool operator<(const Key& rhs) const {
-		return strcmp(key, rhs.key) < 0;
+	Key(const char* k, SizeType l, int s) : prefix(loadPrefix(k, l)), key(k), size(l), slot(s) {}
+
+	// first 8 bytes as a big endian integer, zero padded: comparing two
+	// prefixes gives the bytewise order of those bytes in one step.
+	static uint64_t loadPrefix(const char* k, SizeType l)
+	{
+		uint64_t p = 0;
+		SizeType n = l < 8 ? l : 8;
+		for (SizeType i = 0; i < n; ++i)
+			p |= static_cast<uint64_t>(static_cast<unsigned char>(k[i])) << (56 - 8 * i);
+		return p;
 	}
+
+	uint64_t prefix;
 	const char* key;
 	SizeType size;
+	// > 0: stack index of the value, 0: look the value up by key string,
+	// < 0: look it up by integer key number -slot (1-based).
+	int slot;
 };
 
+// bytewise order, same as strcmp but also fine with embedded zeros.
+struct KeyLexicalOrder
+{
+	// shift selects the first prefix byte on which the keys differ.
+	static unsigned bucket(const Key& k, unsigned shift) { return static_cast<unsigned>(k.prefix >> shift) & 0xFF; }
+	bool operator()(const Key& a, const Key& b) const {
+		if (a.prefix != b.prefix)
+			return a.prefix < b.prefix;
+		SizeType n = a.size < b.size ? a.size : b.size;
+		int c = n > 8 ? memcmp(a.key + 8, b.key + 8, n - 8) : 0;
+		return c < 0 || (c == 0 && a.size < b.size);
+	}
+};
 
+// shorter keys first, then bytewise; cheapest deterministic order.
+struct KeyLengthOrder
+{
+	static unsigned bucket(const Key& k, unsigned) { return k.size < 255 ? k.size : 255; }
+	bool operator()(const Key& a, const Key& b) const {
+		if (a.size != b.size)
+			return a.size < b.size;
+		if (a.prefix != b.prefix)
+			return a.prefix < b.prefix;
+		return a.size > 8 && memcmp(a.key + 8, b.key + 8, a.size - 8) < 0;
+	}
+};
 
 
 class Encoder {
+public:
+	enum SortKeys { SORT_NONE, SORT_LEXICAL, SORT_LENGTH };
+	enum MixedTable { MIXED_ARRAY, MIXED_OBJECT, MIXED_ERROR };
+	enum TableKind { TABLE_ARRAY, TABLE_OBJECT };
+
+private:
 	bool pretty;
-	bool sort_keys;
+	SortKeys sort_keys;
+	MixedTable mixed_table;
 	int max_depth;
 	static const int MAX_DEPTH_DEFAULT = 128;
+
+	// identities of the shared json.array/json.object metatables, refreshed per encode.
+	const void* arrayMeta_;
+	const void* objectMeta_;
+	// keys of all objects being sorted, innermost last; kept between objects.
+	std::vector<Key> keys_;
+	std::vector<Key> scratch_;
 public:
-	Encoder(lua_State*L, int opt) : pretty(false), sort_keys(false), max_depth(MAX_DEPTH_DEFAULT)
+	Encoder(lua_State*L, int opt) : pretty(false), sort_keys(SORT_NONE), mixed_table(MIXED_ARRAY), max_depth(MAX_DEPTH_DEFAULT),
+		arrayMeta_(NULL), objectMeta_(NULL)
 	{
 		if (lua_isnoneornil(L, opt))
 			return;
 		luaL_checktype(L, opt, LUA_TTABLE);
 
 		pretty = optBooleanField(L, opt, "pretty", false);
-		sort_keys = optBooleanField(L, opt, "sort_keys", false);
+		sort_keys = optSortKeysField(L, opt, "sort_keys");
+		mixed_table = optMixedTableField(L, opt, "mixed_table");
 		max_depth = optIntegerField(L, opt, "max_depth", MAX_DEPTH_DEFAULT);
 	}
 
@@ -378,6 +936,29 @@ private:
 		lua_pop(L, 1);
 		return v;
 	}
+	SortKeys optSortKeysField(lua_State* L, int idx, const char* name)
+	{
+		SortKeys v = SORT_NONE;
+		lua_getfield(L, idx, name);  // [field]
+		if (lua_type(L, -1) == LUA_TSTRING)
+		{
+			if (strcmp(lua_tostring(L, -1), "length") != 0)
+				luaL_error(L, "invalid sort_keys '%s'", lua_tostring(L, -1));
+			v = SORT_LENGTH;
+		}
+		else if (lua_toboolean(L, -1))
+			v = SORT_LEXICAL;
+		lua_pop(L, 1);
+		return v;
+	}
+	MixedTable optMixedTableField(lua_State* L, int idx, const char* name)
+	{
+		static const char* const names[] = { "array", "object", "error", NULL };
+		lua_getfield(L, idx, name);  // [field]
+		MixedTable v = static_cast<MixedTable>(luaL_checkoption(L, -1, "array", names));
+		lua_pop(L, 1);
+		return v;
+	}
 	static bool isJsonNull(lua_State* L, int idx)
 	{
 		lua_pushvalue(L, idx); // [value]
@@ -433,13 +1014,58 @@ private:
 		return has;
 	}
 
-	static bool isArray(lua_State* L, int idx)
+	void loadSharedMetas(lua_State* L)
+	{
+		luaL_getmetatable(L, JSON_TABLE_TYPE_METAS[JSON_TABLE_TYPE_ARRAY]); // [json.array]
+		luaL_getmetatable(L, JSON_TABLE_TYPE_METAS[JSON_TABLE_TYPE_OBJECT]); // [json.array, json.object]
+		arrayMeta_ = lua_topointer(L, -2);
+		objectMeta_ = lua_topointer(L, -1);
+		lua_pop(L, 2); // []
+	}
+
+	// true when the table has a key other than the integers 1..n.
+	static bool hasExtraKeys(lua_State* L, int idx, size_t n)
+	{
+		lua_pushnil(L); // [nil]
+		while (lua_next(L, idx < 0 ? idx - 1 : idx))
+		{
+			// [key, value]
+			int64_t i;
+			if (lua_type(L, -2) != LUA_TNUMBER || !isInteger(L, -2, &i) || i < 1 || static_cast<size_t>(i) > n)
+			{
+				lua_pop(L, 2); // []
+				return true;
+			}
+			lua_pop(L, 1); // [key]
+		}
+		return false;
+	}
+
+	TableKind classify(lua_State* L, int idx)
 	{
-		bool isarray = false;
-		if (hasJsonType(L, idx, isarray)) // any table with a meta field __jsontype set to 'array' are arrays
-			return isarray;
+		if (lua_getmetatable(L, idx))
+		{
+			// [metatable], decoded tables carry one of the shared metatables.
+			const void* meta = lua_topointer(L, -1);
+			lua_pop(L, 1); // []
+			if (meta == arrayMeta_)
+				return TABLE_ARRAY;
+			if (meta == objectMeta_)
+				return TABLE_OBJECT;
+
+			bool isarray = false;
+			if (hasJsonType(L, idx, isarray)) // any table with a meta field __jsontype set to 'array' are arrays
+				return isarray ? TABLE_ARRAY : TABLE_OBJECT;
+		}
 
-		return (lua_rawlen(L, idx) > 0); // any table has length > 0 are treat as array.
+		size_t n = lua_rawlen(L, idx);
+		if (n == 0)
+			return TABLE_OBJECT;
+		if (mixed_table == MIXED_ARRAY || !hasExtraKeys(L, idx, n)) // any table has length > 0 are treat as array.
+			return TABLE_ARRAY;
+		if (mixed_table == MIXED_ERROR)
+			luaL_error(L, "can not encode mixed table (array with extra keys)");
+		return TABLE_OBJECT;
 	}
 
 	template<typename Writer>
@@ -477,6 +1103,7 @@ private:
 				writer->Null();
 				return;
 			}
+			// fall through
 		case LUA_TUSERDATA:
 		    if (lua_isint64(L, idx))
 			{
@@ -488,7 +1115,7 @@ private:
 				writer->Uint64(lua_touint64(L, idx));
 				return;
 			}
-			// otherwise fall thought
+			// fall through
 		case LUA_TLIGHTUSERDATA: // fall thought
 		case LUA_TTHREAD: // fall thought
 		case LUA_TNONE: // fall thought
@@ -508,7 +1135,7 @@ private:
 			luaL_error(L, "stack overflow");
 
 		lua_pushvalue(L, idx); // [table]
-		if (isArray(L, -1))
+		if (classify(L, -1) == TABLE_ARRAY)
 		{
 			encodeArray(L, writer, depth);
 			lua_pop(L, 1); // []
@@ -516,34 +1143,61 @@ private:
 		}
 
 		// is object.
-		if (!sort_keys)
+		if (sort_keys == SORT_NONE)
 		{
 			encodeObject(L, writer, depth);
 			lua_pop(L, 1); // []
 			return;
 		}
 
-		lua_pushnil(L); // [table, nil]
-		std::vector<Key> keys;
+		encodeSortedObject(L, writer, depth);
+		lua_pop(L, 1); // []
+	}
 
-		while (lua_next(L, -2))
+	/**
+	* Sorts keys_[first, end). Counting sort on the first byte where the key
+	* prefixes differ (or on the length), then each bucket on its own,
+	* buckets are mostly tiny.
+	*/
+	template<typename Order>
+	void sortKeys(size_t first, Order order)
+	{
+		static const size_t MIN_BUCKETED_KEYS = 32;
+		std::vector<Key>::iterator begin = keys_.begin() + first;
+		std::vector<Key>::iterator end = keys_.end();
+		size_t count = keys_.size() - first;
+		if (count < MIN_BUCKETED_KEYS)
 		{
-			// [table, key, value]
-
-			if (lua_type(L, -2) == LUA_TSTRING)
-			{
-				size_t len = 0;
-				const char *key = lua_tolstring(L, -2, &len);
-				keys.push_back(Key(key, static_cast<SizeType>(len)));
-			}
+			std::sort(begin, end, order);
+			return;
+		}
 
-			// pop value, leaving original key
-			lua_pop(L, 1);
-			// [table, key]
+		uint64_t diff = 0;
+		std::vector<Key>::const_iterator i;
+		for (i = begin; i != end; ++i)
+			diff |= i->prefix ^ begin->prefix;
+		unsigned shift = 56;
+		while (shift > 0 && (diff >> shift) == 0)
+			shift -= 8;
+
+		size_t start[257] = { 0 };
+		for (i = begin; i != end; ++i)
+			++start[Order::bucket(*i, shift) + 1];
+		for (int b = 1; b <= 256; ++b)
+			start[b] += start[b - 1];
+
+		size_t pos[256];
+		memcpy(pos, start, sizeof(pos));
+		scratch_.resize(count, *begin);
+		for (i = begin; i != end; ++i)
+			scratch_[pos[Order::bucket(*i, shift)]++] = *i;
+
+		for (int b = 0; b < 256; ++b)
+		{
+			if (start[b + 1] - start[b] > 1)
+				std::sort(scratch_.begin() + start[b], scratch_.begin() + start[b + 1], order);
 		}
-		// [table]
-		encodeObject(L, writer, depth, keys);
-		lua_pop(L, 1);
+		std::copy(scratch_.begin(), scratch_.end(), begin);
 	}
 
 	template<typename Writer>
@@ -556,6 +1210,7 @@ private:
 		while (lua_next(L, -2))
 		{
 			// [table, key, value]
+			int64_t integer;
 			if (lua_type(L, -2) == LUA_TSTRING)
 			{
 				size_t len = 0;
@@ -563,6 +1218,13 @@ private:
 				writer->Key(key, static_cast<SizeType>(len));
 				encodeValue(L, writer, -1, depth);
 			}
+			else if (mixed_table == MIXED_OBJECT && lua_type(L, -2) == LUA_TNUMBER && isInteger(L, -2, &integer))
+			{
+				char buffer[24];
+				const char* end = internal::i64toa(integer, buffer);
+				writer->Key(buffer, static_cast<SizeType>(end - buffer));
+				encodeValue(L, writer, -1, depth);
+			}
 
 			// pop value, leaving original key
 			lua_pop(L, 1);
@@ -572,26 +1234,102 @@ private:
 		writer->EndObject();
 	}
 
+	/**
+	* Values stay on the stack below the iteration key while there is room,
+	* so writing them in key order needs no second table lookup.
+	*/
 	template<typename Writer>
-	void encodeObject(lua_State* L, Writer* writer, int depth, std::vector<Key> &keys)
+	void encodeSortedObject(lua_State* L, Writer* writer, int depth)
 	{
-		// [table]
-		writer->StartObject();
+		static const int STACK_BUDGET = 4000; // LUAI_MAXCSTACK is 8000 in Lua 5.1 and LuaJIT
 
-		std::sort(keys.begin(), keys.end());
+		struct Number {
+			size_t offset; // of the key text in digits
+			lua_Integer key;
+			int slot;
+		};
 
-		std::vector<Key>::const_iterator i = keys.begin();
-		std::vector<Key>::const_iterator e = keys.end();
-		for (; i != e; ++i)
-		{
-			writer->Key(i->key, static_cast<SizeType>(i->size));
-			lua_pushlstring(L, i->key, i->size); // [table, key]
-			lua_gettable(L, -2); // [table, value]
-			encodeValue(L, writer, -1, depth);
-			lua_pop(L, 1); // [table]
-		}
 		// [table]
+		int table = lua_gettop(L);
+		size_t first = keys_.size();
+		std::vector<char> digits;
+		std::vector<Number> numbers;
+
+		lua_pushnil(L); // [table, nil]
+		while (lua_next(L, table))
+		{
+			// [table, values..., key, value]
+			int64_t integer;
+			bool isstring = lua_type(L, -2) == LUA_TSTRING;
+			if (!isstring && !(mixed_table == MIXED_OBJECT && lua_type(L, -2) == LUA_TNUMBER && isInteger(L, -2, &integer)))
+			{
+				// pop value, leaving original key
+				lua_pop(L, 1); // [table, values..., key]
+				continue;
+			}
+
+			int slot = 0;
+			if (lua_gettop(L) < STACK_BUDGET && lua_checkstack(L, 4))
+			{
+				lua_insert(L, -2); // [table, values..., value, key]
+				slot = lua_gettop(L) - 1;
+			}
+			else
+				lua_pop(L, 1); // [table, values..., key]
+
+			if (isstring)
+			{
+				size_t len = 0;
+				const char* key = lua_tolstring(L, -1, &len);
+				keys_.push_back(Key(key, static_cast<SizeType>(len), slot));
+			}
+			else
+			{
+				// key text is added once digits stops growing.
+				char buffer[24];
+				char* end = internal::i64toa(integer, buffer);
+				Number n = { digits.size(), static_cast<lua_Integer>(integer), slot };
+				numbers.push_back(n);
+				digits.insert(digits.end(), buffer, end);
+				digits.push_back('\0');
+			}
+		}
+		// [table, values...]
+		for (size_t n = 0; n < numbers.size(); ++n)
+		{
+			const char* key = &digits[numbers[n].offset];
+			int slot = numbers[n].slot != 0 ? numbers[n].slot : -static_cast<int>(n + 1);
+			keys_.push_back(Key(key, static_cast<SizeType>(strlen(key)), slot));
+		}
+
+		if (sort_keys == SORT_LENGTH)
+			sortKeys(first, KeyLengthOrder());
+		else
+			sortKeys(first, KeyLexicalOrder());
+
+		writer->StartObject();
+		size_t last = keys_.size();
+		for (size_t k = first; k < last; ++k)
+		{
+			// nested objects append to keys_, keep a copy.
+			const Key key = keys_[k];
+			writer->Key(key.key, static_cast<SizeType>(key.size));
+			if (key.slot > 0)
+				lua_pushvalue(L, key.slot); // [table, values..., value]
+			else
+			{
+				if (key.slot < 0)
+					lua_pushinteger(L, numbers[-key.slot - 1].key); // [table, values..., key]
+				else
+					lua_pushlstring(L, key.key, key.size); // [table, values..., key]
+				lua_rawget(L, table); // [table, values..., value]
+			}
+			encodeValue(L, writer, -1, depth);
+			lua_pop(L, 1); // [table, values...]
+		}
 		writer->EndObject();
+		keys_.erase(keys_.begin() + first, keys_.end());
+		lua_settop(L, table); // [table]
 	}
 
 	template<typename Writer>
@@ -617,14 +1355,23 @@ public:
 		if (pretty)
 		{
 			PrettyWriter<Stream> writer(*s);
-			encodeValue(L, &writer, idx);
+			encodeWith(L, &writer, idx);
 		}
 		else
 		{
 			Writer<Stream> writer(*s);
-			encodeValue(L, &writer, idx);
+			encodeWith(L, &writer, idx);
 		}
 	}
+
+	// drives any writer with the SAX writer interface, see MsgPackWriter.
+	template<typename Writer>
+	void encodeWith(lua_State* L, Writer* writer, int idx)
+	{
+		loadSharedMetas(L);
+		keys_.clear(); // may be left over by an error
+		encodeValue(L, writer, idx);
+	}
 };
 
 
@@ -662,42 +1409,1551 @@ static int json_dump(lua_State* L)
 }
 
 
-static const luaL_Reg methods[] = {
-	// string <--> json
-	{ "decode", json_decode },
-	{ "encode", json_encode },
+#ifdef LUA_RAPIDJSON_WITH_PB
+/**
+* Output stream appending to a lua-protobuf pb.Buffer in place.
+*/
+class PbBufferStream {
+public:
+	typedef char Ch;
+	PbBufferStream(lua_State* L, pb_Buffer* b) : L(L), b_(b) {}
 
-	// file <--> json
-	{ "load", json_load },
-	{ "dump", json_dump },
+	void Put(Ch c) { *prepare(1) = c; pb_addsize(b_, 1); }
+	void PutUnsafe(Ch c) { pb_buffer(b_)[pb_bufflen(b_)] = c; pb_addsize(b_, 1); }
+	void Reserve(size_t count) { prepare(count); }
+	Ch* Push(size_t count) { Ch* p = prepare(count); pb_addsize(b_, count); return p; }
+	void Flush() {}
 
-	// special tags place holder
-	{ "null", json_null },
-	{ "object", json_object },
-	{ "array", json_array },
+private:
+	Ch* prepare(size_t count)
+	{
+		Ch* p = pb_prepbuffsize(b_, count);
+		if (p == NULL)
+			luaL_error(L, "out of memory");
+		return p;
+	}
+
+	lua_State* L;
+	pb_Buffer* b_;
+};
+
+// found by ADL from the writers, like the StringBuffer specializations.
+inline void PutReserve(PbBufferStream& stream, size_t count) { stream.Reserve(count); }
+inline void PutUnsafe(PbBufferStream& stream, char c) { stream.PutUnsafe(c); }
+inline void PutN(PbBufferStream& stream, char c, size_t n) { memset(stream.Push(n), c, n); }
+#endif
+
+
+/**
+* Persistent encoder, options are parsed once and the output buffer is
+* kept between calls.
+*/
+struct JsonEncoder {
+	JsonEncoder(lua_State* L, int opt) : encoder(L, opt) {}
+
+	Encoder encoder;
+	StringBuffer buffer;
+};
+
+static JsonEncoder* checkEncoder(lua_State* L, int idx)
+{
+	return static_cast<JsonEncoder*>(luaL_checkudata(L, idx, JSON_ENCODER_META));
+}
+
+/**
+* rapidjson.encoder([options]) returns a reusable encoder.
+*/
+static int json_encoder(lua_State* L)
+{
+	lua_settop(L, 1); // [options]
+	void* p = lua_newuserdata(L, sizeof(JsonEncoder)); // [options, encoder]
+	new (p) JsonEncoder(L, 1);
+	luaL_getmetatable(L, JSON_ENCODER_META); // [options, encoder, meta]
+	lua_setmetatable(L, -2); // [options, encoder]
+	return 1;
+}
+
+static int encoder_gc(lua_State* L)
+{
+	JsonEncoder* e = checkEncoder(L, 1);
+	e->~JsonEncoder();
+	return 0;
+}
+
+#ifdef LUA_RAPIDJSON_WITH_PB
+// [encoder, value, buffer], called protected so a failed encode can be
+// cut off the buffer.
+static int encoder_encodeInto(lua_State* L)
+{
+	JsonEncoder* e = static_cast<JsonEncoder*>(lua_touserdata(L, 1));
+	PbBufferStream s(L, static_cast<pb_Buffer*>(lua_touserdata(L, 3)));
+	e->encoder.encode(L, &s, 2);
+	return 0;
+}
+#endif
+
+/**
+* encoder:encode(value[, buffer])
+* Without buffer returns the json string. With a pb.Buffer the json text is
+* appended to it and the buffer is returned. The buffer is left as it was if
+* encoding fails.
+*/
+static int encoder_encode(lua_State* L)
+{
+	JsonEncoder* e = checkEncoder(L, 1);
+#ifdef LUA_RAPIDJSON_WITH_PB
+	if (!lua_isnoneornil(L, 3))
+	{
+		pb_Buffer* b = static_cast<pb_Buffer*>(luaL_checkudata(L, 3, PB_BUFFER_META));
+		size_t start = pb_bufflen(b);
+		lua_settop(L, 3); // [encoder, value, buffer]
+		lua_pushcfunction(L, encoder_encodeInto); // [encoder, value, buffer, f]
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, 3); // [encoder, value, buffer, f, encoder, value, buffer]
+		if (lua_pcall(L, 3, 0, 0) != 0) // [encoder, value, buffer, (error)]
+		{
+			b->size = static_cast<unsigned>(start);
+			return lua_error(L);
+		}
+		return 1;
+	}
+#endif
+	e->buffer.Clear();
+	e->encoder.encode(L, &e->buffer, 2);
+	lua_pushlstring(L, e->buffer.GetString(), e->buffer.GetSize());
+	return 1;
+}
+
+static const luaL_Reg encoder_methods[] = {
+	{ "encode", encoder_encode },
+	{ "__gc", encoder_gc },
 	{ NULL, NULL }
 };
 
+static void createEncoderMeta(lua_State* L)
+{
+	luaL_newmetatable(L, JSON_ENCODER_META); // [meta]
+	setfuncs(L, encoder_methods); // [meta]
+	lua_pushvalue(L, -1); // [meta, meta]
+	lua_setfield(L, -2, "__index"); // [meta]
+	lua_pop(L, 1); // []
+}
+
+
+/**
+* Writes MessagePack from the same SAX calls Encoder makes on a json
+* Writer. Container headers are patched in once the element count is known.
+*/
+class MsgPackWriter {
+public:
+	explicit MsgPackWriter(StringBuffer& os) : os_(os) { frames_.reserve(32); }
+
+	bool Null() { put(0xc0); return value(); }
+	bool Bool(bool b) { put(b ? 0xc3 : 0xc2); return value(); }
+	bool Int(int i) { return Int64(i); }
+	bool Uint(unsigned u) { return Uint64(u); }
+	bool Int64(int64_t i)
+	{
+		if (i >= 0)
+			return Uint64(static_cast<uint64_t>(i));
+		if (i >= -32)
+			put(static_cast<uint8_t>(i)); // negative fixint
+		else if (i >= -128)
+			putBig(0xd0, static_cast<uint8_t>(i), 1);
+		else if (i >= -32768)
+			putBig(0xd1, static_cast<uint16_t>(i), 2);
+		else if (i >= std::numeric_limits<int32_t>::min())
+			putBig(0xd2, static_cast<uint32_t>(i), 4);
+		else
+			putBig(0xd3, static_cast<uint64_t>(i), 8);
+		return value();
+	}
+	bool Uint64(uint64_t u)
+	{
+		if (u < 0x80)
+			put(static_cast<uint8_t>(u)); // positive fixint
+		else if (u <= 0xff)
+			putBig(0xcc, u, 1);
+		else if (u <= 0xffff)
+			putBig(0xcd, u, 2);
+		else if (u <= 0xffffffffu)
+			putBig(0xce, u, 4);
+		else
+			putBig(0xcf, u, 8);
+		return value();
+	}
+	bool Double(double d)
+	{
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(bits));
+		putBig(0xcb, bits, 8);
+		return value();
+	}
+	bool String(const char* str, SizeType length, bool /*copy*/ = false)
+	{
+		if (length <= 31)
+			put(static_cast<uint8_t>(0xa0 | length));
+		else if (length <= 0xff)
+			putBig(0xd9, length, 1);
+		else if (length <= 0xffff)
+			putBig(0xda, length, 2);
+		else
+			putBig(0xdb, length, 4);
+		memcpy(os_.Push(length), str, length);
+		return value();
+	}
+	bool Key(const char* str, SizeType length, bool copy = false) { return String(str, length, copy); }
+	bool StartObject() { return start(true); }
+	bool EndObject(SizeType /*memberCount*/ = 0) { return end(); }
+	bool StartArray() { return start(false); }
+	bool EndArray(SizeType /*elementCount*/ = 0) { return end(); }
+
+private:
+	static const size_t HEADER_SIZE = 5; // map32/array32, the largest header
+
+	struct Frame {
+		size_t offset;
+		size_t count; // values written, keys included
+		bool map;
+	};
+
+	void put(uint8_t c) { os_.Put(static_cast<char>(c)); }
+	void putBig(uint8_t tag, uint64_t v, int n)
+	{
+		char* p = os_.Push(n + 1);
+		p[0] = static_cast<char>(tag);
+		for (int i = n; i > 0; --i, v >>= 8)
+			p[i] = static_cast<char>(v & 0xff);
+	}
+
+	bool value()
+	{
+		if (!frames_.empty())
+			++frames_.back().count;
+		return true;
+	}
+
+	bool start(bool map)
+	{
+		Frame f = { os_.GetSize(), 0, map };
+		frames_.push_back(f);
+		os_.Push(HEADER_SIZE);
+		return true;
+	}
+
+	bool end()
+	{
+		Frame f = frames_.back();
+		frames_.pop_back();
+		size_t n = f.map ? f.count / 2 : f.count;
+
+		char h[HEADER_SIZE];
+		size_t hl;
+		if (n <= 15)
+		{
+			h[0] = static_cast<char>((f.map ? 0x80 : 0x90) | n);
+			hl = 1;
+		}
+		else if (n <= 0xffff)
+		{
+			h[0] = static_cast<char>(f.map ? 0xde : 0xdc);
+			h[1] = static_cast<char>(n >> 8);
+			h[2] = static_cast<char>(n);
+			hl = 3;
+		}
+		else
+		{
+			h[0] = static_cast<char>(f.map ? 0xdf : 0xdd);
+			h[1] = static_cast<char>(n >> 24);
+			h[2] = static_cast<char>(n >> 16);
+			h[3] = static_cast<char>(n >> 8);
+			h[4] = static_cast<char>(n);
+			hl = 5;
+		}
+
+		char* base = const_cast<char*>(os_.GetString()) + f.offset;
+		memcpy(base, h, hl);
+		if (hl < HEADER_SIZE)
+		{
+			memmove(base + hl, base + HEADER_SIZE, os_.GetSize() - f.offset - HEADER_SIZE);
+			os_.Pop(HEADER_SIZE - hl);
+		}
+		return value();
+	}
+
+	StringBuffer& os_;
+	std::vector<Frame> frames_;
+};
+
+/**
+* Parses MessagePack into Lua values through a ToLuaHandler, strings are
+* pushed straight from the input buffer.
+*/
+class MsgPackReader {
+public:
+	MsgPackReader(const char* data, size_t len)
+		: p_(reinterpret_cast<const uint8_t*>(data)), begin_(p_), end_(p_ + len), error_(NULL) {}
+
+	bool Parse(lua_State* L, ToLuaHandler& h) { return value(L, h, 0); }
+	bool AtEnd() const { return p_ == end_; }
+	const char* GetError() const { return error_; }
+	size_t GetOffset() const { return static_cast<size_t>(p_ - begin_); }
+
+private:
+	static const int MAX_DEPTH = 200;
+
+	bool fail(const char* msg) { error_ = msg; return false; }
+	size_t remaining() const { return static_cast<size_t>(end_ - p_); }
+	bool need(size_t n) { return remaining() >= n || fail("truncated data"); }
+
+	uint64_t big(int n)
+	{
+		uint64_t v = 0;
+		for (int i = 0; i < n; ++i)
+			v = v << 8 | p_[i];
+		p_ += n;
+		return v;
+	}
+
+	// same integer classes as the json Reader hands to the handler.
+	static bool integer(ToLuaHandler& h, int64_t i)
+	{
+		if (i >= std::numeric_limits<int>::min() && i <= std::numeric_limits<int>::max())
+			return h.Int(static_cast<int>(i));
+		if (i >= 0 && i <= std::numeric_limits<unsigned>::max())
+			return h.Uint(static_cast<unsigned>(i));
+		return h.Int64(i);
+	}
+
+	static bool unsignedInteger(ToLuaHandler& h, uint64_t u)
+	{
+		if (u <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+			return integer(h, static_cast<int64_t>(u));
+		return h.Uint64(u);
+	}
+
+	bool string(ToLuaHandler& h, uint64_t n)
+	{
+		if (!need(n))
+			return false;
+		const char* s = reinterpret_cast<const char*>(p_);
+		p_ += n;
+		return h.String(s, static_cast<SizeType>(n), false);
+	}
+
+	bool array(lua_State* L, ToLuaHandler& h, uint64_t n, int depth)
+	{
+		if (depth >= MAX_DEPTH || !lua_checkstack(L, 4))
+			return fail("nested too depth");
+		if (n > remaining()) // every element takes at least one byte
+			return fail("truncated data");
+		h.StartArray(static_cast<SizeType>(n));
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			if (!value(L, h, depth + 1))
+				return false;
+		}
+		return h.EndArray(static_cast<SizeType>(n));
+	}
+
+	bool map(lua_State* L, ToLuaHandler& h, uint64_t n, int depth)
+	{
+		if (depth >= MAX_DEPTH || !lua_checkstack(L, 4))
+			return fail("nested too depth");
+		if (n > remaining() / 2)
+			return fail("truncated data");
+		h.StartObject(static_cast<SizeType>(n));
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			if (!key(h) || !value(L, h, depth + 1))
+				return false;
+		}
+		return h.EndObject(static_cast<SizeType>(n));
+	}
+
+	bool key(ToLuaHandler& h)
+	{
+		if (!need(1))
+			return false;
+		uint8_t c = *p_;
+		uint64_t n;
+		if ((c & 0xe0) == 0xa0)
+			n = (++p_, c & 0x1f);
+		else if (c >= 0xd9 && c <= 0xdb)
+		{
+			int w = 1 << (c - 0xd9);
+			if (!need(1 + w))
+				return false;
+			++p_;
+			n = big(w);
+		}
+		else if (c <= 0x7f || c >= 0xe0)
+			return ++p_, h.IntKey(static_cast<int8_t>(c));
+		else if (c >= 0xcc && c <= 0xd3)
+		{
+			int w = 1 << ((c - 0xcc) & 3);
+			if (!need(1 + w))
+				return false;
+			++p_;
+			uint64_t v = big(w);
+			if (c >= 0xd0) // sign extend intN
+				v = w < 8 && (v >> (w * 8 - 1)) ? v | (~static_cast<uint64_t>(0) << (w * 8)) : v;
+			return h.IntKey(static_cast<int64_t>(v));
+		}
+		else
+			return fail("unsupported map key type");
+
+		if (!need(n))
+			return false;
+		const char* s = reinterpret_cast<const char*>(p_);
+		p_ += n;
+		return h.Key(s, static_cast<SizeType>(n), false);
+	}
+
+	bool value(lua_State* L, ToLuaHandler& h, int depth)
+	{
+		if (!need(1))
+			return false;
+		uint8_t c = *p_++;
+		if (c <= 0x7f)
+			return h.Int(c);
+		if (c >= 0xe0)
+			return h.Int(static_cast<int8_t>(c));
+		if ((c & 0xe0) == 0xa0)
+			return string(h, c & 0x1f);
+		if ((c & 0xf0) == 0x90)
+			return array(L, h, c & 0x0f, depth);
+		if ((c & 0xf0) == 0x80)
+			return map(L, h, c & 0x0f, depth);
+
+		switch (c) {
+		case 0xc0: return h.Null();
+		case 0xc2: return h.Bool(false);
+		case 0xc3: return h.Bool(true);
+		case 0xc4: case 0xd9: return need(1) && string(h, big(1)); // bin8, str8
+		case 0xc5: case 0xda: return need(2) && string(h, big(2));
+		case 0xc6: case 0xdb: return need(4) && string(h, big(4));
+		case 0xca:
+		{
+			if (!need(4))
+				return false;
+			uint32_t bits = static_cast<uint32_t>(big(4));
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			return h.Double(f);
+		}
+		case 0xcb:
+		{
+			if (!need(8))
+				return false;
+			uint64_t bits = big(8);
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			return h.Double(d);
+		}
+		case 0xcc: return need(1) && integer(h, static_cast<int64_t>(big(1)));
+		case 0xcd: return need(2) && integer(h, static_cast<int64_t>(big(2)));
+		case 0xce: return need(4) && integer(h, static_cast<int64_t>(big(4)));
+		case 0xcf: return need(8) && unsignedInteger(h, big(8));
+		case 0xd0: return need(1) && integer(h, static_cast<int8_t>(big(1)));
+		case 0xd1: return need(2) && integer(h, static_cast<int16_t>(big(2)));
+		case 0xd2: return need(4) && integer(h, static_cast<int32_t>(big(4)));
+		case 0xd3: return need(8) && integer(h, static_cast<int64_t>(big(8)));
+		case 0xdc: return need(2) && array(L, h, big(2), depth);
+		case 0xdd: return need(4) && array(L, h, big(4), depth);
+		case 0xde: return need(2) && map(L, h, big(2), depth);
+		case 0xdf: return need(4) && map(L, h, big(4), depth);
+		default:
+			--p_;
+			return fail("unsupported type"); // ext types and the never used 0xc1
+		}
+	}
+
+	const uint8_t* p_;
+	const uint8_t* begin_;
+	const uint8_t* end_;
+	const char* error_;
+};
+
+/**
+* rapidjson.msgpack.encode(value[, options])
+* Same table rules and options as rapidjson.encode, pretty is ignored.
+*/
+static int msgpack_encode(lua_State* L)
+{
+	Encoder encoder(L, 2);
+	StringBuffer s;
+	MsgPackWriter writer(s);
+	encoder.encodeWith(L, &writer, 1);
+	lua_pushlstring(L, s.GetString(), s.GetSize());
+	return 1;
+}
+
+/**
+* rapidjson.msgpack.decode(data)
+*/
+static int msgpack_decode(lua_State* L)
+{
+	size_t len = 0;
+	const char* data = luaL_checklstring(L, 1, &len);
+	int top = lua_gettop(L);
+	ToLuaHandler handler(L);
+	MsgPackReader reader(data, len);
+
+	bool ok = reader.Parse(L, handler);
+	if (!ok || !reader.AtEnd()) {
+		lua_settop(L, top);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s (%d)", ok ? "trailing data" : reader.GetError(), static_cast<int>(reader.GetOffset()));
+		return 2;
+	}
+
+	return 1;
+}
+
+static const luaL_Reg msgpack_methods[] = {
+	{ "encode", msgpack_encode },
+	{ "decode", msgpack_decode },
+	{ NULL, NULL }
+};
 
+#ifdef LUA_RAPIDJSON_WITH_PB
+/**
+* Protobuf <-> json transcoding without going through lua tables, types come
+* from the pb module of the same lua_State. Uses the proto3 json mapping,
+* well-known types are handled as ordinary messages.
+*/
 extern "C" {
+typedef struct lpb_State lpb_State;
+LUALIB_API lpb_State* lpb_lstate(lua_State* L);
+LUALIB_API const pb_State* lpb_state(lpb_State* LS);
+LUALIB_API const pb_Type* lpb_type(lpb_State* LS, pb_Slice s);
+LUALIB_API pb_Slice lpb_checkslice(lua_State* L, int idx);
+}
 
-LUALIB_API int luaopen_rapidjson(lua_State* L)
+static const int PB_JSON_MAX_DEPTH = 100;
+
+static const char PB_BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char* pbNameString(const pb_Name* name)
 {
-	lua_newtable(L); // [rapidjson]
+	return reinterpret_cast<const char*>(name);
+}
 
-	setfuncs(L, methods); // [rapidjson]
+static SizeType pbNameLength(const pb_Name* name)
+{
+	return reinterpret_cast<const pb_NameEntry*>(name)[-1].length;
+}
 
-	lua_pushliteral(L, "rapidjson"); // [rapidjson, name]
-	lua_setfield(L, -2, "_NAME"); // [rapidjson]
+// protoc's json name: drop underscores and upper case the letter after them.
+static bool pbJsonNameEquals(const char* name, size_t len, const char* key, size_t klen)
+{
+	bool upper = false;
+	size_t k = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		char c = name[i];
+		if (c == '_') { upper = true; continue; }
+		if (upper && c >= 'a' && c <= 'z')
+			c = static_cast<char>(c - 'a' + 'A');
+		upper = false;
+		if (k == klen || key[k++] != c)
+			return false;
+	}
+	return k == klen;
+}
 
-	lua_pushliteral(L, LUA_RAPIDJSON_VERSION); // [rapidjson, version]
-	lua_setfield(L, -2, "_VERSION"); // [rapidjson]
+static void pbJsonName(const char* name, size_t len, std::string& out)
+{
+	bool upper = false;
+	out.clear();
+	for (size_t i = 0; i < len; ++i)
+	{
+		char c = name[i];
+		if (c == '_') { upper = true; continue; }
+		if (upper && c >= 'a' && c <= 'z')
+			c = static_cast<char>(c - 'a' + 'A');
+		upper = false;
+		out.push_back(c);
+	}
+}
+
+static bool pbPackable(const pb_Field* f)
+{
+	return f->repeated && pb_wtypebytype(f->type_id) != PB_TBYTES;
+}
+
+/**
+* Walks wire data with the pb_Type metadata and writes json SAX events.
+* Fields of a message are first collected into one shared entry stack so
+* repeated fields can be grouped into arrays and singular fields resolved
+* last-one-wins, then written in order of their first occurrence.
+*/
+template <typename Writer>
+class PbJsonWriter {
+public:
+	PbJsonWriter(Writer& writer, bool protoNames)
+		: writer_(writer), protoNames_(protoNames), error_(NULL), offset_(0) {}
+
+	bool Write(const pb_Type* t, pb_Slice s) { return message(t, s, 0); }
+	const char* GetError() const { return error_; }
+	size_t GetOffset() const { return offset_; }
+
+private:
+	struct Entry {
+		const pb_Field* f; // NULL once written
+		uint32_t tag;
+		pb_Slice v; // the value, or the contents of length delimited ones
+	};
+
+	bool fail(const char* msg, const pb_Slice& s)
+	{
+		error_ = msg;
+		offset_ = pb_pos(s);
+		return false;
+	}
+
+	bool message(const pb_Type* t, pb_Slice s, int depth)
+	{
+		if (depth > PB_JSON_MAX_DEPTH)
+			return fail("message nested too deep", s);
+		size_t base = entries_.size();
+		while (pb_len(s) > 0)
+		{
+			Entry e;
+			if (pb_readvarint32(&s, &e.tag) == 0 || pb_gettag(e.tag) == 0)
+				return fail("invalid tag", s);
+			e.f = pb_field(t, static_cast<int32_t>(pb_gettag(e.tag)));
+			e.v = s;
+			if (pb_gettype(e.tag) == PB_TBYTES ? pb_readbytes(&s, &e.v) == 0 : pb_skipvalue(&s, e.tag) == 0)
+				return fail("invalid value", s);
+			if (pb_gettype(e.tag) != PB_TBYTES)
+				e.v.end = s.p;
+			if (e.f != NULL) // unknown fields are dropped
+				entries_.push_back(e);
+		}
+
+		writer_.StartObject();
+		for (size_t i = base; i < entries_.size(); ++i)
+		{
+			const pb_Field* f = entries_[i].f;
+			if (f == NULL)
+				continue;
+			key(f);
+			if (!field(f, i, depth))
+				return false;
+		}
+		entries_.resize(base);
+		writer_.EndObject();
+		return true;
+	}
+
+	void key(const pb_Field* f)
+	{
+		const char* name = pbNameString(f->name);
+		SizeType len = pbNameLength(f->name);
+		if (protoNames_ || memchr(name, '_', len) == NULL)
+			writer_.Key(name, len);
+		else
+		{
+			pbJsonName(name, len, scratch_);
+			writer_.Key(scratch_.data(), static_cast<SizeType>(scratch_.size()));
+		}
+	}
+
+	// entries_ may grow under the recursive calls, so work on copies.
+	bool field(const pb_Field* f, size_t i, int depth)
+	{
+		if (f->repeated)
+		{
+			bool map = f->type != NULL && f->type->is_map;
+			if (map)
+				writer_.StartObject();
+			else
+				writer_.StartArray();
+			for (size_t j = i; j < entries_.size(); ++j)
+			{
+				if (entries_[j].f != f)
+					continue;
+				Entry e = entries_[j];
+				entries_[j].f = NULL;
+				if (!(map ? mapEntry(f, e, depth) : element(f, e, depth)))
+					return false;
+			}
+			if (map)
+				writer_.EndObject();
+			else
+				writer_.EndArray();
+			return true;
+		}
+
+		// singular: the last one wins, except messages which are merged.
+		Entry last = entries_[i];
+		std::string merged;
+		for (size_t j = i; j < entries_.size(); ++j)
+		{
+			if (entries_[j].f != f)
+				continue;
+			if (j != i && f->type_id == PB_Tmessage && pb_gettype(entries_[j].tag) == PB_TBYTES)
+			{
+				if (merged.empty())
+					merged.assign(last.v.p, pb_len(last.v));
+				merged.append(entries_[j].v.p, pb_len(entries_[j].v));
+			}
+			last = entries_[j];
+			entries_[j].f = NULL;
+		}
+		if (!merged.empty())
+			last.v = pb_lslice(merged.data(), merged.size());
+		return value(f, last.tag, last.v, depth);
+	}
+
+	bool element(const pb_Field* f, const Entry& e, int depth)
+	{
+		if (pb_gettype(e.tag) != PB_TBYTES || !pbPackable(f))
+			return value(f, e.tag, e.v, depth);
+		pb_Slice s = e.v;
+		uint32_t wt = static_cast<uint32_t>(pb_wtypebytype(f->type_id));
+		uint64_t u;
+		while (pb_len(s) > 0)
+			if (!read(f, wt, &s, &u) || !number(f, u, false))
+				return false;
+		return true;
+	}
+
+	bool mapEntry(const pb_Field* f, const Entry& e, int depth)
+	{
+		const pb_Field* kf = pb_field(f->type, 1);
+		const pb_Field* vf = pb_field(f->type, 2);
+		if (kf == NULL || vf == NULL)
+			return fail("invalid map type", e.v);
+		if (pb_gettype(e.tag) != PB_TBYTES)
+			return fail("type mismatch", e.v);
+
+		Entry k = { NULL, 0, pb_lslice(NULL, 0) };
+		Entry v = k;
+		pb_Slice s = e.v;
+		while (pb_len(s) > 0)
+		{
+			Entry *pe, skipped;
+			uint32_t tag;
+			if (pb_readvarint32(&s, &tag) == 0)
+				return fail("invalid tag", s);
+			pe = pb_gettag(tag) == 1 ? &k : pb_gettag(tag) == 2 ? &v : &skipped;
+			pe->f = pe == &k ? kf : vf;
+			pe->tag = tag;
+			pe->v = s;
+			if (pb_gettype(tag) == PB_TBYTES ? pb_readbytes(&s, &pe->v) == 0 : pb_skipvalue(&s, tag) == 0)
+				return fail("invalid value", s);
+			if (pb_gettype(tag) != PB_TBYTES)
+				pe->v.end = s.p;
+		}
+
+		uint64_t u = 0;
+		if (k.f != NULL && kf->type_id == PB_Tstring && pb_gettype(k.tag) != PB_TBYTES)
+			return fail("type mismatch", k.v);
+		if (kf->type_id == PB_Tstring)
+			writer_.Key(k.v.p != NULL ? k.v.p : "", static_cast<SizeType>(pb_len(k.v)));
+		else if (k.f != NULL && !read(kf, pb_gettype(k.tag), &k.v, &u))
+			return false;
+		else if (!number(kf, u, true))
+			return false;
+
+		if (v.f != NULL)
+			return value(vf, v.tag, v.v, depth);
+		switch (vf->type_id)
+		{
+		case PB_Tstring: case PB_Tbytes:
+			writer_.String("", 0);
+			return true;
+		case PB_Tmessage:
+			writer_.StartObject();
+			writer_.EndObject();
+			return true;
+		default:
+			return number(vf, 0, false);
+		}
+	}
+
+	bool value(const pb_Field* f, uint32_t tag, pb_Slice v, int depth)
+	{
+		uint64_t u;
+		switch (f->type_id)
+		{
+		case PB_Tstring: case PB_Tbytes: case PB_Tmessage:
+			if (pb_gettype(tag) != PB_TBYTES)
+				return fail("type mismatch", v);
+			if (f->type_id == PB_Tstring)
+				writer_.String(v.p, static_cast<SizeType>(pb_len(v)));
+			else if (f->type_id == PB_Tbytes)
+				base64(v);
+			else if (f->type == NULL || f->type->is_dead)
+				writer_.Null();
+			else
+				return message(f->type, v, depth + 1);
+			return true;
+		case PB_Tgroup:
+			writer_.Null();
+			return true;
+		default:
+			return read(f, pb_gettype(tag), &v, &u) && number(f, u, false);
+		}
+	}
+
+	bool read(const pb_Field* f, uint32_t wt, pb_Slice* s, uint64_t* pv)
+	{
+		uint32_t u32;
+		if (wt != static_cast<uint32_t>(pb_wtypebytype(f->type_id)))
+			return fail("type mismatch", *s);
+		switch (wt)
+		{
+		case PB_TVARINT:
+			if (pb_readvarint64(s, pv) != 0)
+				return true;
+			break;
+		case PB_T32BIT:
+			if (pb_readfixed32(s, &u32) != 0)
+			{
+				*pv = u32;
+				return true;
+			}
+			break;
+		case PB_T64BIT:
+			if (pb_readfixed64(s, pv) != 0)
+				return true;
+			break;
+		}
+		return fail("invalid value", *s);
+	}
+
+	// 64 bit integers are quoted, everything is quoted as a map key.
+	bool number(const pb_Field* f, uint64_t u, bool asKey)
+	{
+		char buf[32];
+		char* end = buf;
+		switch (f->type_id)
+		{
+		case PB_Tbool:
+			if (!asKey)
+				return writer_.Bool(u != 0), true;
+			end = buf + sprintf(buf, "%s", u != 0 ? "true" : "false");
+			break;
+		case PB_Tint32: case PB_Tsfixed32: case PB_Tsint32:
+		{
+			int32_t i = f->type_id == PB_Tsint32 ? pb_decode_sint32(static_cast<uint32_t>(u)) : static_cast<int32_t>(u);
+			if (!asKey)
+				return writer_.Int(i), true;
+			end = internal::i32toa(i, buf);
+			break;
+		}
+		case PB_Tuint32: case PB_Tfixed32:
+			if (!asKey)
+				return writer_.Uint(static_cast<uint32_t>(u)), true;
+			end = internal::u32toa(static_cast<uint32_t>(u), buf);
+			break;
+		case PB_Tint64: case PB_Tsfixed64: case PB_Tsint64:
+			end = internal::i64toa(f->type_id == PB_Tsint64 ? pb_decode_sint64(u) : static_cast<int64_t>(u), buf);
+			break;
+		case PB_Tuint64: case PB_Tfixed64:
+			end = internal::u64toa(u, buf);
+			break;
+		case PB_Tenum:
+		{
+			const pb_Field* ev = pb_field(f->type, static_cast<int32_t>(u));
+			if (ev != NULL)
+				return writer_.String(pbNameString(ev->name), pbNameLength(ev->name)), true;
+			return writer_.Int(static_cast<int32_t>(u)), true;
+		}
+		case PB_Tfloat:
+			return real(pb_decode_float(static_cast<uint32_t>(u)), true), true;
+		case PB_Tdouble:
+			return real(pb_decode_double(u), false), true;
+		default:
+			return fail("invalid map key", pb_lslice(NULL, 0));
+		}
+		writer_.String(buf, static_cast<SizeType>(end - buf));
+		return true;
+	}
+
+	void real(double d, bool single)
+	{
+		if (d != d)
+			writer_.String("NaN", 3);
+		else if (d == std::numeric_limits<double>::infinity())
+			writer_.String("Infinity", 8);
+		else if (d == -std::numeric_limits<double>::infinity())
+			writer_.String("-Infinity", 9);
+		else if (!single)
+			writer_.Double(d);
+		else
+		{
+			// the shortest decimal that reads back as the same float, so
+			// 0.1f comes out as 0.1 and not as its double expansion.
+			char buf[32];
+			for (int prec = 6; prec <= 9; ++prec)
+			{
+				snprintf(buf, sizeof(buf), "%.*g", prec, d);
+				if (static_cast<float>(strtod(buf, NULL)) == static_cast<float>(d))
+					break;
+			}
+			writer_.Double(strtod(buf, NULL));
+		}
+	}
+
+	void base64(pb_Slice v)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(v.p);
+		size_t len = pb_len(v), i = 0;
+		scratch_.clear();
+		scratch_.reserve((len + 2) / 3 * 4);
+		for (; i + 3 <= len; i += 3)
+		{
+			uint32_t n = p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+			scratch_.push_back(PB_BASE64[n >> 18]);
+			scratch_.push_back(PB_BASE64[n >> 12 & 63]);
+			scratch_.push_back(PB_BASE64[n >> 6 & 63]);
+			scratch_.push_back(PB_BASE64[n & 63]);
+		}
+		if (i < len)
+		{
+			uint32_t n = p[i] << 16 | (i + 1 < len ? p[i + 1] << 8 : 0);
+			scratch_.push_back(PB_BASE64[n >> 18]);
+			scratch_.push_back(PB_BASE64[n >> 12 & 63]);
+			scratch_.push_back(i + 1 < len ? PB_BASE64[n >> 6 & 63] : '=');
+			scratch_.push_back('=');
+		}
+		writer_.String(scratch_.data(), static_cast<SizeType>(scratch_.size()));
+	}
+
+	Writer& writer_;
+	bool protoNames_;
+	const char* error_;
+	size_t offset_;
+	std::vector<Entry> entries_;
+	std::string scratch_;
+};
+
+/**
+* SAX handler encoding json straight into a pb_Buffer. Nested messages get
+* their length prefix inserted when they close, like pb.encode does.
+* Unknown members are skipped, null means the field's default.
+*/
+class JsonPbHandler {
+public:
+	JsonPbHandler(const pb_State* S, const pb_Type* t, pb_Buffer* b)
+		: S_(S), root_(t), b_(b), skip_(0), skipNext_(false), error_(NULL) { frames_.reserve(16); }
+
+	const char* GetError() const { return error_; }
+
+	bool Null()
+	{
+		if (skipping())
+			return true;
+		if (frames_.empty())
+			return fail("object expected");
+		Frame& top = frames_.back();
+		if (top.kind == FRAME_ARRAY)
+			return fail("null in array");
+		if (top.kind == FRAME_MAP) // entry with only the key, the value is default
+			return close(openEntry(top));
+		return true;
+	}
+	bool Bool(bool b) { Scalar v(SCALAR_BOOL); v.i = b; return value(v); }
+	bool Int(int i) { Scalar v(SCALAR_INT); v.i = i; return value(v); }
+	bool Uint(unsigned u) { Scalar v(SCALAR_INT); v.i = u; return value(v); }
+	bool Int64(int64_t i) { Scalar v(SCALAR_INT); v.i = i; return value(v); }
+	bool Uint64(uint64_t u)
+	{
+		Scalar v(u <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) ? SCALAR_INT : SCALAR_UINT);
+		v.i = static_cast<int64_t>(u);
+		v.u = u;
+		return value(v);
+	}
+	bool Double(double d) { Scalar v(SCALAR_REAL); v.d = d; return value(v); }
+	bool String(const char* str, SizeType len, bool) { Scalar v(SCALAR_STRING); v.s = str; v.len = len; return value(v); }
+
+	bool StartObject()
+	{
+		if (skipping(true))
+			return skip_ <= PB_JSON_MAX_DEPTH || fail("object nested too deep");
+		if (frames_.empty())
+			return push(FRAME_MESSAGE, root_, NULL, NO_POS, NO_POS);
+		Frame& top = frames_.back();
+		const pb_Field* f = top.kind == FRAME_MAP ? pb_field(top.t, 2) : top.f;
+		if (f == NULL)
+			return fail("invalid map type");
+		if (f->type_id != PB_Tmessage || f->type == NULL)
+			return fail("unexpected object");
+		if (top.kind == FRAME_MESSAGE && f->repeated && !f->type->is_map)
+			return fail("array expected");
+		if (top.kind == FRAME_MESSAGE && f->repeated)
+			return push(FRAME_MAP, f->type, f, NO_POS, NO_POS);
+		size_t entry = top.kind == FRAME_MAP ? openEntry(top) : NO_POS;
+		if (top.kind == FRAME_MAP && entry == NO_POS)
+			return false;
+		return push(FRAME_MESSAGE, f->type, NULL, open(f), entry);
+	}
+	bool Key(const char* str, SizeType len, bool)
+	{
+		if (skip_ > 0)
+			return true;
+		Frame& top = frames_.back();
+		if (top.kind == FRAME_MAP)
+		{
+			key_.assign(str, len);
+			return true;
+		}
+		top.f = lookup(top.t, str, len);
+		skipNext_ = top.f == NULL;
+		return true;
+	}
+	bool EndObject(SizeType)
+	{
+		if (skip_ > 0)
+			return --skip_, true;
+		Frame top = frames_.back();
+		frames_.pop_back();
+		if (top.kind == FRAME_MESSAGE)
+		{
+			if (top.body != NO_POS && !close(top.body))
+				return false;
+			if (top.entry != NO_POS && !close(top.entry))
+				return false;
+		}
+		return true;
+	}
+	bool StartArray()
+	{
+		if (skipping(true))
+			return skip_ <= PB_JSON_MAX_DEPTH || fail("object nested too deep");
+		if (frames_.empty())
+			return fail("object expected");
+		Frame& top = frames_.back();
+		const pb_Field* f = top.f;
+		if (top.kind != FRAME_MESSAGE || !f->repeated || (f->type != NULL && f->type->is_map))
+			return fail("unexpected array");
+		if (!f->packed)
+			return push(FRAME_ARRAY, NULL, f, NO_POS, NO_POS);
+		size_t tag = pb_bufflen(b_);
+		return push(FRAME_ARRAY, NULL, f, open(f), tag);
+	}
+	bool EndArray(SizeType)
+	{
+		if (skip_ > 0)
+			return --skip_, true;
+		Frame top = frames_.back();
+		frames_.pop_back();
+		if (top.body == NO_POS)
+			return true;
+		if (pb_bufflen(b_) == top.body) // empty packed fields are left out
+		{
+			b_->size = static_cast<unsigned>(top.entry);
+			return true;
+		}
+		return close(top.body);
+	}
+
+private:
+	static const size_t NO_POS = ~static_cast<size_t>(0);
+
+	enum FrameKind { FRAME_MESSAGE, FRAME_MAP, FRAME_ARRAY };
+	struct Frame {
+		FrameKind kind;
+		const pb_Type* t; // message type, the entry type of a map
+		const pb_Field* f; // field of the member being read, the array's field
+		size_t body; // start of the length delimited body
+		size_t entry; // start of the enclosing map entry, the tag of a packed array
+	};
+
+	enum ScalarKind { SCALAR_BOOL, SCALAR_INT, SCALAR_UINT, SCALAR_REAL, SCALAR_STRING };
+	struct Scalar {
+		explicit Scalar(ScalarKind k) : kind(k), i(0), u(0), d(0), s(NULL), len(0) {}
+		ScalarKind kind;
+		int64_t i;
+		uint64_t u;
+		double d;
+		const char* s;
+		size_t len;
+	};
+
+	bool fail(const char* msg) { error_ = msg; return false; }
+
+	// a value of an unknown member, or anything inside one.
+	bool skipping(bool container = false)
+	{
+		if (skip_ > 0)
+			skip_ += container;
+		else if (skipNext_)
+			skip_ = container;
+		else
+			return false;
+		skipNext_ = false;
+		return true;
+	}
+
+	bool push(FrameKind kind, const pb_Type* t, const pb_Field* f, size_t body, size_t entry)
+	{
+		if (frames_.size() >= static_cast<size_t>(PB_JSON_MAX_DEPTH))
+			return fail("object nested too deep");
+		Frame fr = { kind, t, f, body, entry };
+		frames_.push_back(fr);
+		return true;
+	}
+
+	size_t open(const pb_Field* f)
+	{
+		pb_addvarint32(b_, pb_pair(static_cast<uint32_t>(f->number), PB_TBYTES));
+		return pb_bufflen(b_);
+	}
+
+	bool close(size_t start)
+	{
+		if (start == NO_POS)
+			return false;
+		if (pb_addlength(b_, start) == 0)
+			return fail("out of memory");
+		return true;
+	}
+
+	// starts a map entry holding the pending key, NO_POS if the key is bad.
+	size_t openEntry(const Frame& map)
+	{
+		const pb_Field* kf = pb_field(map.t, 1);
+		if (kf == NULL || pb_field(map.t, 2) == NULL)
+			return fail("invalid map type"), NO_POS;
+		size_t entry = open(map.f);
+		Scalar k(SCALAR_STRING);
+		k.s = key_.c_str();
+		k.len = key_.size();
+		if (kf->type_id == PB_Tbool)
+		{
+			k.kind = SCALAR_BOOL;
+			if (key_ == "true" || key_ == "false")
+				k.i = key_ == "true";
+			else
+				return fail("invalid map key"), NO_POS;
+		}
+		return emit(kf, k, true) ? entry : NO_POS;
+	}
+
+	const pb_Field* lookup(const pb_Type* t, const char* name, SizeType len)
+	{
+		const pb_Field* f = pb_fname(t, pb_name(S_, pb_lslice(name, len), NULL));
+		if (f != NULL)
+			return f;
+		for (f = NULL; pb_nextfield(t, &f);)
+		{
+			const char* fn = pbNameString(f->name);
+			SizeType fl = pbNameLength(f->name);
+			if (memchr(fn, '_', fl) != NULL && pbJsonNameEquals(fn, fl, name, len))
+				return f;
+		}
+		return NULL;
+	}
+
+	bool value(const Scalar& v)
+	{
+		if (skipping())
+			return true;
+		if (frames_.empty())
+			return fail("object expected");
+		Frame& top = frames_.back();
+		switch (top.kind)
+		{
+		case FRAME_MESSAGE:
+			if (top.f->repeated)
+				return fail(top.f->type != NULL && top.f->type->is_map ? "object expected" : "array expected");
+			return emit(top.f, v, true);
+		case FRAME_ARRAY:
+			return emit(top.f, v, top.body == NO_POS);
+		default:
+		{
+			size_t entry = openEntry(top);
+			return entry != NO_POS && emit(pb_field(top.t, 2), v, true) && close(entry);
+		}
+		}
+	}
+
+	bool integer(const Scalar& v, int64_t lo, int64_t hi, int64_t* pv)
+	{
+		Scalar n(v.kind);
+		if (v.kind == SCALAR_STRING && !parse(v, &n))
+			return fail("invalid number");
+		const Scalar& x = v.kind == SCALAR_STRING ? n : v;
+		if (x.kind == SCALAR_INT)
+			*pv = x.i;
+		else if (x.kind == SCALAR_REAL && x.d == std::floor(x.d) && x.d >= -9223372036854775808.0 && x.d < 9223372036854775808.0)
+			*pv = static_cast<int64_t>(x.d);
+		else if (x.kind == SCALAR_REAL && x.d != std::floor(x.d))
+			return fail("integer expected");
+		else
+			return fail(x.kind == SCALAR_BOOL ? "number expected" : "integer out of range");
+		if (*pv < lo || *pv > hi)
+			return fail("integer out of range");
+		return true;
+	}
+
+	bool unsignedInteger(const Scalar& v, uint64_t hi, uint64_t* pv)
+	{
+		Scalar n(v.kind);
+		if (v.kind == SCALAR_STRING && !parse(v, &n))
+			return fail("invalid number");
+		const Scalar& x = v.kind == SCALAR_STRING ? n : v;
+		if (x.kind == SCALAR_INT && x.i >= 0)
+			*pv = static_cast<uint64_t>(x.i);
+		else if (x.kind == SCALAR_UINT)
+			*pv = x.u;
+		else if (x.kind == SCALAR_REAL && x.d == std::floor(x.d) && x.d >= 0 && x.d < 18446744073709551616.0)
+			*pv = static_cast<uint64_t>(x.d);
+		else if (x.kind == SCALAR_REAL && x.d != std::floor(x.d))
+			return fail("integer expected");
+		else
+			return fail(x.kind == SCALAR_BOOL ? "number expected" : "integer out of range");
+		if (*pv > hi)
+			return fail("integer out of range");
+		return true;
+	}
+
+	bool real(const Scalar& v, bool single, double* pv)
+	{
+		Scalar n(v.kind);
+		if (v.kind == SCALAR_STRING)
+		{
+			if (v.len == 3 && memcmp(v.s, "NaN", 3) == 0)
+				return *pv = std::numeric_limits<double>::quiet_NaN(), true;
+			if (v.len == 8 && memcmp(v.s, "Infinity", 8) == 0)
+				return *pv = std::numeric_limits<double>::infinity(), true;
+			if (v.len == 9 && memcmp(v.s, "-Infinity", 9) == 0)
+				return *pv = -std::numeric_limits<double>::infinity(), true;
+			if (!parse(v, &n))
+				return fail("invalid number");
+		}
+		const Scalar& x = v.kind == SCALAR_STRING ? n : v;
+		switch (x.kind)
+		{
+		case SCALAR_INT: *pv = static_cast<double>(x.i); break;
+		case SCALAR_UINT: *pv = static_cast<double>(x.u); break;
+		case SCALAR_REAL: *pv = x.d; break;
+		default: return fail("number expected");
+		}
+		if (single && std::fabs(*pv) > std::numeric_limits<float>::max())
+			return fail("float out of range");
+		return true;
+	}
+
+	// numbers in strings, as 64 bit integers are written.
+	static bool parse(const Scalar& v, Scalar* n)
+	{
+		char* end;
+		if (v.len == 0 || v.len != strlen(v.s) || isspace(static_cast<unsigned char>(v.s[0])))
+			return false;
+		errno = 0;
+		if (v.s[0] == '-')
+		{
+			n->kind = SCALAR_INT;
+			n->i = strtoll(v.s, &end, 10);
+		}
+		else
+		{
+			n->u = strtoull(v.s, &end, 10);
+			n->i = static_cast<int64_t>(n->u);
+			n->kind = n->u <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) ? SCALAR_INT : SCALAR_UINT;
+		}
+		if (*end == '\0' && errno == 0)
+			return true;
+		errno = 0;
+		n->kind = SCALAR_REAL;
+		n->d = strtod(v.s, &end);
+		return *end == '\0' && errno == 0;
+	}
+
+	bool emit(const pb_Field* f, const Scalar& v, bool tagged)
+	{
+		int64_t i;
+		uint64_t u;
+		double d;
+		if (tagged)
+			pb_addvarint32(b_, pb_pair(static_cast<uint32_t>(f->number), static_cast<uint32_t>(pb_wtypebytype(f->type_id))));
+		switch (f->type_id)
+		{
+		case PB_Tbool:
+			if (v.kind != SCALAR_BOOL)
+				return fail("boolean expected");
+			pb_addvarint32(b_, static_cast<uint32_t>(v.i));
+			return true;
+		case PB_Tint32: case PB_Tsint32: case PB_Tsfixed32:
+			if (!integer(v, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max(), &i))
+				return false;
+			if (f->type_id == PB_Tsint32)
+				pb_addvarint32(b_, pb_encode_sint32(static_cast<int32_t>(i)));
+			else if (f->type_id == PB_Tsfixed32)
+				pb_addfixed32(b_, static_cast<uint32_t>(i));
+			else
+				pb_addvarint64(b_, static_cast<uint64_t>(i));
+			return true;
+		case PB_Tint64: case PB_Tsint64: case PB_Tsfixed64:
+			if (!integer(v, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(), &i))
+				return false;
+			if (f->type_id == PB_Tsint64)
+				pb_addvarint64(b_, pb_encode_sint64(i));
+			else if (f->type_id == PB_Tsfixed64)
+				pb_addfixed64(b_, static_cast<uint64_t>(i));
+			else
+				pb_addvarint64(b_, static_cast<uint64_t>(i));
+			return true;
+		case PB_Tuint32: case PB_Tfixed32:
+			if (!unsignedInteger(v, std::numeric_limits<uint32_t>::max(), &u))
+				return false;
+			if (f->type_id == PB_Tfixed32)
+				pb_addfixed32(b_, static_cast<uint32_t>(u));
+			else
+				pb_addvarint32(b_, static_cast<uint32_t>(u));
+			return true;
+		case PB_Tuint64: case PB_Tfixed64:
+			if (!unsignedInteger(v, std::numeric_limits<uint64_t>::max(), &u))
+				return false;
+			if (f->type_id == PB_Tfixed64)
+				pb_addfixed64(b_, u);
+			else
+				pb_addvarint64(b_, u);
+			return true;
+		case PB_Tfloat:
+			if (!real(v, true, &d))
+				return false;
+			pb_addfixed32(b_, pb_encode_float(static_cast<float>(d)));
+			return true;
+		case PB_Tdouble:
+			if (!real(v, false, &d))
+				return false;
+			pb_addfixed64(b_, pb_encode_double(d));
+			return true;
+		case PB_Tenum:
+			if (v.kind == SCALAR_STRING)
+			{
+				const pb_Field* ev = pb_fname(f->type, pb_name(S_, pb_lslice(v.s, v.len), NULL));
+				if (ev == NULL)
+					return fail("unknown enum value");
+				i = ev->number;
+			}
+			else if (!integer(v, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max(), &i))
+				return false;
+			pb_addvarint64(b_, static_cast<uint64_t>(i));
+			return true;
+		case PB_Tstring:
+			if (v.kind != SCALAR_STRING)
+				return fail("string expected");
+			pb_addbytes(b_, pb_lslice(v.s, v.len));
+			return true;
+		case PB_Tbytes:
+			if (v.kind != SCALAR_STRING)
+				return fail("string expected");
+			return base64(v);
+		default:
+			return fail("object expected");
+		}
+	}
+
+	// standard or url-safe alphabet, padding optional.
+	bool base64(const Scalar& v)
+	{
+		uint32_t n = 0;
+		int bits = 0;
+		size_t len = v.len;
+		while (len > 0 && v.s[len - 1] == '=')
+			--len;
+		scratch_.clear();
+		for (size_t i = 0; i < len; ++i)
+		{
+			char c = v.s[i];
+			int x = c >= 'A' && c <= 'Z' ? c - 'A'
+				: c >= 'a' && c <= 'z' ? c - 'a' + 26
+				: c >= '0' && c <= '9' ? c - '0' + 52
+				: c == '+' || c == '-' ? 62
+				: c == '/' || c == '_' ? 63 : -1;
+			if (x < 0)
+				return fail("invalid base64");
+			n = n << 6 | static_cast<uint32_t>(x);
+			if ((bits += 6) >= 8)
+			{
+				bits -= 8;
+				scratch_.push_back(static_cast<char>(n >> bits & 0xFF));
+			}
+		}
+		pb_addbytes(b_, pb_lslice(scratch_.data(), scratch_.size()));
+		return true;
+	}
+
+	const pb_State* S_;
+	const pb_Type* root_;
+	pb_Buffer* b_;
+	int skip_;
+	bool skipNext_;
+	const char* error_;
+	std::vector<Frame> frames_;
+	std::string key_;
+	std::string scratch_;
+};
+
+static const pb_Type* checkPbType(lua_State* L, int idx)
+{
+	size_t len;
+	const char* name = luaL_checklstring(L, idx, &len);
+	const pb_Type* t = lpb_type(lpb_lstate(L), pb_lslice(name, len));
+	if (t == NULL || t->is_dead)
+		luaL_argerror(L, idx, lua_pushfstring(L, "type '%s' does not exists", name));
+	return t;
+}
+
+/**
+* rapidjson.pb.tojson(type, data[, options])
+* data is a string, pb.Buffer or pb.Slice. Options: pretty, and proto_names
+* to keep the .proto field names instead of lowerCamelCase ones.
+*/
+static int pbjson_tojson(lua_State* L)
+{
+	const pb_Type* t = checkPbType(L, 1);
+	pb_Slice data = lpb_checkslice(L, 2);
+	bool pretty = false, protoNames = false;
+	if (!lua_isnoneornil(L, 3))
+	{
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "pretty"); // [pretty]
+		lua_getfield(L, 3, "proto_names"); // [pretty, proto_names]
+		pretty = lua_toboolean(L, -2) != 0;
+		protoNames = lua_toboolean(L, -1) != 0;
+		lua_pop(L, 2); // []
+	}
+
+	StringBuffer s;
+	const char* error;
+	size_t offset;
+	if (pretty)
+	{
+		PrettyWriter<StringBuffer> writer(s);
+		PbJsonWriter<PrettyWriter<StringBuffer> > w(writer, protoNames);
+		error = w.Write(t, data) ? NULL : w.GetError();
+		offset = w.GetOffset();
+	}
+	else
+	{
+		Writer<StringBuffer> writer(s);
+		PbJsonWriter<Writer<StringBuffer> > w(writer, protoNames);
+		error = w.Write(t, data) ? NULL : w.GetError();
+		offset = w.GetOffset();
+	}
+	if (error != NULL)
+	{
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s (%d)", error, static_cast<int>(offset));
+		return 2;
+	}
+	lua_pushlstring(L, s.GetString(), s.GetSize());
+	return 1;
+}
+
+/**
+* rapidjson.pb.fromjson(type, json[, buffer])
+* Returns the encoded message, or appends it to a pb.Buffer and returns the
+* buffer.
+*/
+static int pbjson_fromjson(lua_State* L)
+{
+	const pb_Type* t = checkPbType(L, 1);
+	const char* json = luaL_checkstring(L, 2);
+	pb_Buffer local, *b = &local;
+	if (lua_isnoneornil(L, 3))
+		pb_initbuffer(&local);
+	else
+		b = static_cast<pb_Buffer*>(luaL_checkudata(L, 3, PB_BUFFER_META));
+	size_t start = pb_bufflen(b);
+
+	JsonPbHandler handler(lpb_state(lpb_lstate(L)), t, b);
+	StringStream s(json);
+	Reader reader;
+	ParseResult r = reader.Parse<kParseFullPrecisionFlag>(s, handler);
+	if (!r)
+	{
+		b->size = static_cast<unsigned>(start);
+		if (b == &local)
+			pb_resetbuffer(&local);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s (%d)", r.Code() == kParseErrorTermination && handler.GetError() != NULL
+			? handler.GetError() : GetParseError_En(r.Code()), static_cast<int>(r.Offset()));
+		return 2;
+	}
+	if (b != &local)
+	{
+		lua_settop(L, 3);
+		return 1;
+	}
+	lua_pushlstring(L, pb_buffer(&local), pb_bufflen(&local));
+	pb_resetbuffer(&local);
+	return 1;
+}
+
+static const luaL_Reg pbjson_methods[] = {
+	{ "tojson", pbjson_tojson },
+	{ "fromjson", pbjson_fromjson },
+	{ NULL, NULL }
+};
+#endif
+
+
+static const luaL_Reg methods[] = {
+	// string <--> json
+	{ "decode", json_decode },
+	{ "encode", json_encode },
+	{ "encoder", json_encoder },
+
+	// file <--> json
+	{ "load", json_load },
+	{ "load_many", json_load_many },
+	{ "dump", json_dump },
+
+	// json schema
+	{ "schema", json_schema },
+
+	// special tags place holder
+	{ "null", json_null },
+	{ "object", json_object },
+	{ "array", json_array },
+	{ NULL, NULL }
+};
+
+
+extern "C" {
+
+LUALIB_API int luaopen_rapidjson(lua_State* L)
+{
+	lua_newtable(L); // [rapidjson]
+
+	setfuncs(L, methods); // [rapidjson]
+
+	lua_pushliteral(L, "rapidjson"); // [rapidjson, name]
+	lua_setfield(L, -2, "_NAME"); // [rapidjson]
+
+	lua_pushliteral(L, LUA_RAPIDJSON_VERSION); // [rapidjson, version]
+	lua_setfield(L, -2, "_VERSION"); // [rapidjson]
+
+	lua_newtable(L); // [rapidjson, msgpack]
+	setfuncs(L, msgpack_methods); // [rapidjson, msgpack]
+	lua_setfield(L, -2, "msgpack"); // [rapidjson]
+
+#ifdef LUA_RAPIDJSON_WITH_PB
+	lua_newtable(L); // [rapidjson, pb]
+	setfuncs(L, pbjson_methods); // [rapidjson, pb]
+	lua_setfield(L, -2, "pb"); // [rapidjson]
+#endif
 
 	lua_getfield(L, -1, "null"); // [rapidjson, json.null]
 	null = luaL_ref(L, LUA_REGISTRYINDEX); // [rapidjson]
 
 	createSharedMeta(L, JSON_TABLE_TYPE_OBJECT);
 	createSharedMeta(L, JSON_TABLE_TYPE_ARRAY);
+	createEncoderMeta(L);
+	createSchemaMeta(L);
+	createLoadBatchMeta(L);
 
 	return 1;
 }
@@ -0,0 +1,512 @@
+-- plain assert tests for the rapidjson module, run from this directory:
+--   lua test.lua
+
+local rapidjson = require "rapidjson"
+local msgpack = rapidjson.msgpack
+
+local function deepeq(x, y)
+  if type(x) ~= "table" or type(y) ~= "table" then return x == y end
+  for k, v in pairs(x) do
+    if not deepeq(v, y[k]) then return false end
+  end
+  for k in pairs(y) do
+    if x[k] == nil then return false end
+  end
+  return true
+end
+
+local function hex(s)
+  return (s:gsub(".", function (c) return string.format("%02x", c:byte()) end))
+end
+
+local function roundtrip(v)
+  local s = msgpack.encode(v)
+  local r, err = msgpack.decode(s)
+  assert(err == nil, err)
+  assert(deepeq(r, v), hex(s))
+  return s
+end
+
+
+print("testing msgpack encode/decode")
+
+-- scalars pick the smallest encoding
+assert(hex(msgpack.encode(0)) == "00")
+assert(hex(msgpack.encode(127)) == "7f")
+assert(hex(msgpack.encode(128)) == "cc80")
+assert(hex(msgpack.encode(256)) == "cd0100")
+assert(hex(msgpack.encode(65536)) == "ce00010000")
+assert(hex(msgpack.encode(-1)) == "ff")
+assert(hex(msgpack.encode(-32)) == "e0")
+assert(hex(msgpack.encode(-33)) == "d0df")
+assert(hex(msgpack.encode(true)) == "c3")
+assert(hex(msgpack.encode(false)) == "c2")
+assert(hex(msgpack.encode(rapidjson.null)) == "c0")
+assert(hex(msgpack.encode(1.5)) == "cb3ff8000000000000")
+assert(hex(msgpack.encode("abc")) == "a3616263")
+
+for _, v in ipairs{0, 1, 127, 128, 255, 256, 65535, 65536, 0x7fffffff,
+                   0x100000000, math.maxinteger, -1, -32, -33, -128, -129,
+                   -32768, -32769, math.mininteger, 0.5, -2.25, 1e300,
+                   true, false, "", "x", ("y"):rep(31), ("z"):rep(32),
+                   ("w"):rep(255), ("v"):rep(256), ("u"):rep(70000)} do
+  roundtrip(v)
+end
+assert(msgpack.decode(msgpack.encode(rapidjson.null)) == rapidjson.null)
+
+-- containers switch from fix to 16 and 32 bit headers
+local function range(n)
+  local t = {}
+  for i = 1, n do t[i] = i end
+  return t
+end
+assert(hex(msgpack.encode({1, 2, 3})) == "93010203")
+assert(hex(msgpack.encode({a = 1})) == "81a16101")
+assert(roundtrip(range(15)):byte() == 0x9f)
+assert(roundtrip(range(16)):byte() == 0xdc)
+assert(roundtrip(range(70000)):byte() == 0xdd)
+
+local big = {}
+for i = 1, 70000 do big["k" .. i] = i end
+assert(roundtrip(big):byte() == 0xdf)
+
+roundtrip{
+  name = "record", id = 42, score = -3.75, tags = {"a", "b", "c"},
+  nested = {deep = {deeper = {1, {x = true}, "s"}}},
+}
+
+-- encode options are shared with rapidjson.encode
+assert(hex(msgpack.encode({b = 1, a = 2}, {sort_keys = true})) == "82a16102a16201")
+assert(not pcall(msgpack.encode, {{{}}}, {max_depth = 2}))
+
+-- integer map keys and bin are accepted on decode
+local t = msgpack.decode("\x82\x01\xa1\x61\xd0\xff\xa1\x62")
+assert(t[1] == "a" and t[-1] == "b")
+assert(msgpack.decode("\xc4\x03\x00\x01\x02") == "\0\1\2")
+
+-- errors come back as nil, message
+local r, err = msgpack.decode("\x93\x01\x02")
+assert(r == nil and type(err) == "string")
+r, err = msgpack.decode("\xa5abc")
+assert(r == nil and type(err) == "string")
+r, err = msgpack.decode("\xc1")
+assert(r == nil and err:find("unsupported"))
+r, err = msgpack.decode("\xd4\x01\x00") -- fixext1
+assert(r == nil and err:find("unsupported"))
+r, err = msgpack.decode("\x01\x02")
+assert(r == nil and err:find("trailing"))
+
+-- malformed input never crashes the decoder
+local sample = msgpack.encode{a = {1, 2, 3}, b = "text", c = {d = 1.5}}
+for i = 1, #sample do
+  msgpack.decode(sample:sub(1, i - 1))
+  for _, c in ipairs{0x00, 0xdd, 0xdf, 0xc6, 0xff} do
+    msgpack.decode(sample:sub(1, i - 1) .. string.char(c) .. sample:sub(i + 1))
+  end
+end
+
+
+print("testing load_many")
+
+local function writefile(path, s)
+  local f = assert(io.open(path, "wb"))
+  f:write(s)
+  f:close()
+end
+
+local paths, expected = {}, {}
+for i = 1, 40 do
+  local v = {id = i, name = "file" .. i, values = range(i)}
+  paths[i] = os.tmpname()
+  expected[i] = v
+  writefile(paths[i], rapidjson.encode(v))
+end
+
+for _, opts in ipairs{{}, {threads = 1}, {threads = 4},
+                      {threads = 4, window = 1}, {threads = 8, window = 3}} do
+  local docs, errors = rapidjson.load_many(paths, opts)
+  assert(errors == nil)
+  assert(#docs == #paths)
+  for i = 1, #paths do assert(deepeq(docs[i], expected[i])) end
+end
+
+local docs, errors = rapidjson.load_many({})
+assert(next(docs) == nil and errors == nil)
+
+-- failures are reported per index, the other files still load
+local bad = os.tmpname()
+writefile(bad, "{\"a\": [1, 2,")
+local missing = bad .. ".missing"
+docs, errors = rapidjson.load_many({paths[1], bad, paths[2], missing}, {threads = 2, window = 1})
+assert(deepeq(docs[1], expected[1]) and deepeq(docs[3], expected[2]))
+assert(docs[2] == nil and docs[4] == nil)
+assert(errors[2]:find(bad, 1, true) and errors[4]:find("open", 1, true))
+assert(errors[1] == nil and errors[3] == nil)
+
+assert(not pcall(rapidjson.load_many, {paths[1], {}}))
+assert(not pcall(rapidjson.load_many, "nope"))
+
+os.remove(bad)
+for _, path in ipairs(paths) do os.remove(path) end
+
+
+print("testing encoder")
+
+-- options are read once, when the encoder is created
+local opts = {sort_keys = true, max_depth = 3}
+local enc = rapidjson.encoder(opts)
+assert(enc:encode({b = 1, a = 2}) == '{"a":2,"b":1}')
+opts.sort_keys, opts.pretty, opts.max_depth = false, true, 100
+assert(enc:encode({b = 1, a = 2, c = {d = {}}}) == '{"a":2,"b":1,"c":{"d":{}}}')
+assert(not pcall(enc.encode, enc, {{{{}}}}))
+assert(enc:encode({1, 2}) == "[1,2]")
+
+-- the buffer is reused: a long result, a short one, then a long one again
+local plain = rapidjson.encoder()
+local long = range(10000)
+local s1 = plain:encode(long)
+assert(s1 == rapidjson.encode(long))
+assert(plain:encode({1}) == "[1]")
+assert(plain:encode(long) == s1)
+assert(plain:encode(rapidjson.null) == "null" and plain:encode("s") == '"s"')
+assert(plain:encode({}) == "{}")
+assert(plain:encode(setmetatable({}, {__jsontype = "array"})) == "[]")
+for _, v in ipairs{0, -1, 1.5, "x\0y", true, {a = {b = {1, 2}}}} do
+  assert(plain:encode(v) == rapidjson.encode(v))
+end
+assert(deepeq(rapidjson.decode(rapidjson.encoder({pretty = true}):encode({a = {1}})), {a = {1}}))
+
+-- errors leave the encoder usable
+assert(not pcall(plain.encode, plain, function () end))
+assert(plain:encode({1}) == "[1]")
+assert(not pcall(plain.encode, {}, 1))
+assert(not pcall(rapidjson.encoder, 5))
+
+-- into a pb.Buffer the text is appended and the buffer returned
+local pbuffer = require "pb.buffer"
+local b = pbuffer.new()
+b:pack("s", "pre")
+local prefix = b:result()
+assert(enc:encode({x = 1}, b) == b)
+assert(b:result() == prefix .. '{"x":1}')
+assert(plain:encode(long, b) == b)
+assert(b:result() == prefix .. '{"x":1}' .. s1)
+-- a failed encode leaves the buffer as it was
+assert(not pcall(enc.encode, enc, {{{{}}}}, b))
+assert(b:result() == prefix .. '{"x":1}' .. s1)
+assert(not pcall(plain.encode, plain, {1, function () end}, b))
+assert(b:result() == prefix .. '{"x":1}' .. s1)
+assert(not pcall(plain.encode, plain, {1}, "buffer"))
+b:reset()
+assert(plain:encode({1}, b):result() == "[1]")
+
+
+print("testing sort_keys and mixed_table")
+
+-- what a sorted encode must produce for t with its keys in the given order
+local function expected(t, keys)
+  local parts = {}
+  for i, k in ipairs(keys) do
+    parts[i] = rapidjson.encode(tostring(k)) .. ":" .. rapidjson.encode(t[k])
+  end
+  return "{" .. table.concat(parts, ",") .. "}"
+end
+
+-- bytewise, a proper prefix first, as strcmp but past embedded NULs
+local function lexical(a, b)
+  for i = 1, math.min(#a, #b) do
+    local x, y = a:byte(i), b:byte(i)
+    if x ~= y then return x < y end
+  end
+  return #a < #b
+end
+local function bylength(a, b)
+  if #a ~= #b then return #a < #b end
+  return lexical(a, b)
+end
+
+local function sorted(t, order)
+  local keys = {}
+  for k in pairs(t) do keys[#keys + 1] = tostring(k) end
+  table.sort(keys, order)
+  return keys
+end
+
+local function check(t, n)
+  local lex = sorted(t, lexical)
+  local len = sorted(t, bylength)
+  assert(rapidjson.encode(t, {sort_keys = true}) == expected(t, lex), n)
+  assert(rapidjson.encode(t, {sort_keys = "length"}) == expected(t, len), n)
+  assert(deepeq(rapidjson.decode(rapidjson.encode(t, {sort_keys = true})), t))
+end
+
+-- keys sharing prefixes, shorter and longer than the 8 byte prefix, and
+-- embedded NUL bytes, both below and above the 32 key bucketing threshold
+local base = {"", "a", "a\0", "a\0b", "ab", "abcdefg", "abcdefgh", "abcdefghi",
+              "abcdefgh\0", "abcdefgh\1", "abcdefgi", "b", "\0", "\0\0", "\255",
+              "aaaaaaaaaaaaaaaaaaaaaaaab", "aaaaaaaaaaaaaaaaaaaaaaaaa", "Z", "z"}
+local small = {}
+for i, k in ipairs(base) do small[k] = i end
+check(small, "small")
+
+for _, n in ipairs{31, 32, 33, 100, 1000} do
+  local t = {}
+  for i = 1, n do
+    local k = base[i % #base + 1] .. tostring(i * 7919 % 1000)
+    if i % 3 == 0 then k = "common_prefix_of_keys/" .. k end
+    t[k] = i
+  end
+  check(t, n)
+end
+
+-- keys that only differ past the prefix all land in one bucket
+local same = {}
+for i = 1, 200 do same["samesame" .. string.char(255 - i % 256) .. i] = i end
+check(same, "one bucket")
+
+-- objects too large to keep every value on the stack
+local huge = {}
+for i = 1, 5000 do huge["k" .. i] = i end
+check(huge, "huge")
+
+-- nested objects while an outer object is being sorted
+local nested = {}
+for i = 1, 40 do nested["n" .. i] = {b = i, a = {d = 1, c = 2}} end
+local out = rapidjson.encode(nested, {sort_keys = true})
+assert(out:find('"n1":{"a":{"c":2,"d":1},"b":1},"n10":', 1, true))
+assert(deepeq(rapidjson.decode(out), nested))
+
+local ok, err = pcall(rapidjson.encode, {}, {sort_keys = "bytes"})
+assert(not ok and err:find("invalid sort_keys 'bytes'", 1, true))
+
+-- mixed tables
+local mixed = {10, 20, x = 1}
+assert(rapidjson.encode(mixed) == "[10,20]")
+assert(rapidjson.encode(mixed, {mixed_table = "array"}) == "[10,20]")
+assert(deepeq(rapidjson.decode(rapidjson.encode(mixed, {mixed_table = "object"})),
+              {["1"] = 10, ["2"] = 20, x = 1}))
+assert(rapidjson.encode(mixed, {mixed_table = "object", sort_keys = true}) ==
+       '{"1":10,"2":20,"x":1}')
+assert(rapidjson.encode({1, 2, [-3] = 3, [1.5] = 4, [true] = 5}, {mixed_table = "object", sort_keys = true}) ==
+       '{"-3":3,"1":1,"2":2}')
+ok, err = pcall(rapidjson.encode, mixed, {mixed_table = "error"})
+assert(not ok and err:find("can not encode mixed table (array with extra keys)", 1, true))
+ok, err = pcall(rapidjson.encode, {a = {1, [5] = 5}}, {mixed_table = "error"})
+assert(not ok and err:find("can not encode mixed table", 1, true))
+ok, err = pcall(rapidjson.encode, mixed, {mixed_table = "bad"})
+assert(not ok and err:find("invalid option 'bad'", 1, true))
+
+-- plain arrays and objects are not affected by the policy
+for _, policy in ipairs{"array", "object", "error"} do
+  assert(rapidjson.encode({1, 2, 3}, {mixed_table = policy}) == "[1,2,3]")
+  assert(rapidjson.encode({x = 1}, {mixed_table = policy}) == '{"x":1}')
+  assert(rapidjson.encode(rapidjson.decode('[1,2]'), {mixed_table = policy}) == "[1,2]")
+end
+
+-- many integer keys sorted as text, past the stack budget
+local ints = {}
+for i = 1, 4500 do ints[i] = i end
+ints.x = 0
+local keys = sorted(ints, lexical)
+assert(rapidjson.encode(ints, {mixed_table = "object", sort_keys = true}) ==
+       expected(setmetatable({}, {__index = function (_, k) return ints[tonumber(k) or k] end}), keys))
+
+
+print("testing schema")
+
+local schema_text = [[{
+  "type": "object",
+  "properties": {
+    "name": {"type": "string"},
+    "hp": {"type": "integer", "minimum": 0},
+    "items": {"type": "array", "items": {"type": "integer"}}
+  },
+  "required": ["name"]
+}]]
+local s = assert(rapidjson.schema(schema_text))
+
+-- the same text gives the same compiled schema while it is referenced
+assert(rapidjson.schema(schema_text) == s)
+assert(rapidjson.schema(schema_text .. " ") ~= s)
+-- the cache is not reachable through registry names
+assert(rapidjson.schema("__name") == nil)
+
+local v = assert(rapidjson.decode('{"name":"a","hp":3,"items":[1,2]}', {schema = s}))
+assert(v.name == "a" and v.hp == 3 and deepeq(v.items, {1, 2}))
+
+-- violations return nil and the keyword with both JSON pointers
+local r, err = rapidjson.decode('{"name":"a","hp":-1}', {schema = s})
+assert(r == nil and err == "schema violation: 'minimum' at #/hp (schema #/properties/hp)", err)
+r, err = rapidjson.decode('{"hp":1}', {schema = s})
+assert(r == nil and err:find("'required'", 1, true))
+r, err = rapidjson.decode('{"name":"a","items":[1,"x"]}', {schema = s})
+assert(r == nil and err == "schema violation: 'type' at #/items/1 (schema #/properties/items/items)", err)
+r, err = rapidjson.decode('{"name":', {schema = s})
+assert(r == nil and type(err) == "string")
+
+local path = os.tmpname()
+writefile(path, '{"name":"b","hp":-5}')
+r, err = rapidjson.load(path, {schema = s})
+assert(r == nil and err:find("'minimum' at #/hp", 1, true))
+writefile(path, '{"name":"b","hp":5}')
+assert(rapidjson.load(path, {schema = s}).hp == 5)
+os.remove(path)
+
+-- invalid schema text and options
+r, err = rapidjson.schema("{")
+assert(r == nil and type(err) == "string")
+assert(not pcall(rapidjson.decode, "{}", {schema = {}}))
+assert(not pcall(rapidjson.decode, "{}", {schema = "x"}))
+
+-- collected entries are compiled again on demand
+s, v = nil, nil
+collectgarbage()
+collectgarbage()
+local s2 = rapidjson.schema(schema_text)
+assert(rapidjson.decode('{"name":"c"}', {schema = s2}).name == "c")
+
+
+print("testing pb.tojson/fromjson")
+
+package.path = "../lua-protobuf/?.lua;" .. package.path
+local pb = require "pb"
+local protoc = require "protoc"
+local tojson, fromjson = rapidjson.pb.tojson, rapidjson.pb.fromjson
+
+assert(protoc:load [[
+  syntax = "proto3";
+  package tj;
+  enum Color { RED = 0; GREEN = 1; }
+  message Sub { int32 x = 1; string s = 2; }
+  message M {
+    int32 i32 = 1; int64 i64 = 2; uint64 u64 = 3; sint64 s64 = 4;
+    double d = 5; float f = 6; bool b = 7; string str = 8; bytes by = 9;
+    Color color = 10; Sub sub = 11; repeated Sub subs = 12;
+    repeated int32 packed = 13;
+    repeated int32 unpacked = 14 [packed = false];
+    map<string, int32> counts = 15; map<int32, Sub> subs_by_id = 16;
+    string first_name = 17; repeated double ds = 18;
+  }
+  message Deep { Deep next = 1; int32 v = 2; } ]])
+
+local msg = {
+  i32 = -5, i64 = 1 << 40, u64 = -1, s64 = -3, d = 1.5, f = 0.25, b = true,
+  str = "h\195\169\"", by = "\0\1\255", color = "GREEN", sub = {x = 1, s = "a"},
+  subs = {{x = 2}, {x = 3}}, packed = {1, 2, 300}, unpacked = {4, 5},
+  counts = {a = 1, b = 2}, subs_by_id = {[7] = {x = 7}}, first_name = "n",
+}
+local data = pb.encode("tj.M", msg)
+
+-- round trips through json, both member name styles
+local j = assert(tojson("tj.M", data))
+assert(fromjson("tj.M", j) == data)
+assert(fromjson("tj.M", assert(tojson("tj.M", data, {proto_names = true}))) == data)
+assert(fromjson("tj.M", assert(tojson("tj.M", data, {pretty = true}))) == data)
+assert(deepeq(pb.decode("tj.M", fromjson("tj.M", j)), pb.decode("tj.M", data)))
+assert(tojson("tj.M", require "pb.slice".new(data)) == j)
+
+-- json_name by default, .proto names on request, the reader takes both
+local t = rapidjson.decode(j)
+assert(t.firstName == "n" and t.first_name == nil)
+assert(t.subsById["7"].x == 7)
+t = rapidjson.decode(tojson("tj.M", data, {proto_names = true}))
+assert(t.first_name == "n" and t.firstName == nil and t.subs_by_id["7"].x == 7)
+assert(pb.decode("tj.M", fromjson("tj.M", '{"first_name":"a"}')).first_name == "a")
+assert(pb.decode("tj.M", fromjson("tj.M", '{"firstName":"b"}')).first_name == "b")
+
+-- 64 bit integers are strings, bytes are base64, enums are names
+t = rapidjson.decode(j)
+assert(t.i64 == "1099511627776" and t.u64 == "18446744073709551615" and t.s64 == "-3")
+assert(t.i32 == -5 and t.by == "AAH/" and t.color == "GREEN")
+assert(pb.decode("tj.M", fromjson("tj.M", '{"i64":"-12345678901234"}')).i64 == -12345678901234)
+assert(pb.decode("tj.M", fromjson("tj.M", '{"i64":12345678901234}')).i64 == 12345678901234)
+assert(pb.decode("tj.M", fromjson("tj.M", '{"by":"AAH_"}')).by == "\0\1\255")
+assert(pb.decode("tj.M", fromjson("tj.M", '{"by":"AAE"}')).by == "\0\1")
+assert(pb.decode("tj.M", fromjson("tj.M", '{"color":1}')).color == "GREEN")
+
+-- maps are objects keyed by strings
+assert(deepeq(t.counts, {a = 1, b = 2}))
+t = pb.decode("tj.M", fromjson("tj.M", '{"counts":{"x":3},"subsById":{"-2":{"s":"q"}}}'))
+assert(t.counts.x == 3 and t.subs_by_id[-2].s == "q")
+
+-- packed and unpacked repeated fields are both arrays, either wire form reads
+assert(deepeq(rapidjson.decode(j).packed, {1, 2, 300}))
+assert(deepeq(rapidjson.decode(j).unpacked, {4, 5}))
+assert(deepeq(rapidjson.decode(tojson("tj.M", "\104\1\104\2")).packed, {1, 2}))
+assert(deepeq(rapidjson.decode(tojson("tj.M", "\114\2\4\5")).unpacked, {4, 5}))
+assert(fromjson("tj.M", '{"packed":[1,2]}') == "\106\2\1\2")
+assert(fromjson("tj.M", '{"unpacked":[1,2]}') == "\112\1\112\2")
+assert(fromjson("tj.M", '{"packed":[]}') == "")
+
+-- NaN and the infinities are strings
+t = rapidjson.decode(tojson("tj.M", pb.encode("tj.M", {ds = {0/0, 1/0, -1/0}})))
+assert(deepeq(t.ds, {"NaN", "Infinity", "-Infinity"}))
+t = pb.decode("tj.M", fromjson("tj.M", '{"ds":["NaN","Infinity","-Infinity"],"f":"-Infinity"}'))
+assert(t.ds[1] ~= t.ds[1] and t.ds[2] == 1/0 and t.ds[3] == -1/0 and t.f == -1/0)
+
+-- unknown members are skipped, null is the default value
+assert(fromjson("tj.M", '{"zzz":[1,{"a":null}],"i32":null,"sub":null,"x":{}}') == "")
+t = pb.decode("tj.M", fromjson("tj.M", '{"i32":0,"str":"","b":false}'))
+assert(t.i32 == 0 and t.str == "" and t.b == false)
+assert(tojson("tj.M", "\200\6\1" .. data) == j)
+assert(tojson("tj.M", "") == "{}")
+
+-- nesting is limited both ways
+local function nest(open, mid, close, n) return open:rep(n) .. mid .. close:rep(n) end
+assert(fromjson("tj.Deep", nest('{"next":', '{}', '}', 50)))
+local r, err = fromjson("tj.Deep", nest('{"next":', '{}', '}', 200))
+assert(r == nil and err:find("nested too deep"))
+r, err = fromjson("tj.Deep", nest('{"nope":', '{}', '}', 200))
+assert(r == nil and err:find("nested too deep"))
+local deep = ""
+for _ = 1, 200 do deep = pb.encode("tj.Deep", {}) .. "\10" .. pb.pack("v", #deep) .. deep end
+r, err = tojson("tj.Deep", deep)
+assert(r == nil and err:find("nested too deep"))
+
+-- malformed input comes back as nil, message
+for _, case in ipairs{
+  {'{"i32":', "Invalid value"},
+  {'{"i32":"x"}', "invalid number"},
+  {'{"i32":1.5}', "integer expected"},
+  {'{"i32":3000000000}', "integer out of range"},
+  {'{"by":"!!"}', "invalid base64"},
+  {'{"color":"BLUE"}', "unknown enum value"},
+  {'[1]', "object expected"},
+  {'{"packed":[1,null]}', "null in array"},
+  {'{"sub":[]}', "unexpected array"},
+  {'{"subs":{}}', "array expected"},
+  {'{"str":1}', "string expected"},
+  {'{"b":1}', "boolean expected"},
+} do
+  r, err = fromjson("tj.M", case[1])
+  assert(r == nil and err:find(case[2], 1, true), err)
+end
+r, err = tojson("tj.M", "\255")
+assert(r == nil and err:find("invalid tag"))
+r, err = tojson("tj.M", "\8")
+assert(r == nil and err:find("invalid value"))
+for i = 1, #data do
+  tojson("tj.M", data:sub(1, i - 1))
+  tojson("tj.M", data:sub(1, i - 1) .. "\255" .. data:sub(i + 1))
+  fromjson("tj.M", j:sub(1, i - 1))
+end
+assert(not pcall(tojson, "tj.Nope", ""))
+
+-- a buffer gets the message appended, failures leave it as it was
+local buf = require "pb.buffer".new()
+buf:pack("s", "pre")
+assert(fromjson("tj.Sub", '{"x":1}', buf) == buf)
+assert(buf:result() == pb.pack("s", "pre") .. "\8\1")
+r, err = fromjson("tj.Sub", '{"x":"bad"}', buf)
+assert(r == nil and buf:result() == pb.pack("s", "pre") .. "\8\1")
+
+-- a map entry stripped of its value field is an error, not a crash
+pb.clear("tj.M.SubsByIdEntry", "value")
+r, err = fromjson("tj.M", '{"subsById":{"1":{}}}')
+assert(r == nil and err:find("invalid map type"))
+r, err = fromjson("tj.M", '{"subsById":{"1":2}}')
+assert(r == nil and err:find("invalid map type"))
+pb.clear("tj.M")
+
+
+print("OK")
@@ -0,0 +1,85 @@
+-- decode timings for protobuf.decode against lua-protobuf's pb.decode on
+-- the User message of LibsTestProj/Assets/Helloworld/idl. Only one of the
+-- two is built into a given xlua (the PBC option), so run this with each
+-- build from the binding/lua53 directory: lua bench.lua [iterations]
+package.path = "./?.lua;../../../lua-protobuf/?.lua;" .. package.path
+
+local function field(name, number, label, type, type_name)
+	return { name = name, number = number, label = "LABEL_" .. label,
+		type = "TYPE_" .. type, type_name = type_name }
+end
+
+-- the idl files as a FileDescriptorSet, so both libraries can load it
+-- without a compiled .pb file
+local descriptor = { file = {
+	{ name = "UserInfo.pb", message_type = { { name = "UserInfo", field = {
+		field("name", 1, "REQUIRED", "STRING"),
+		field("diamond", 2, "REQUIRED", "INT64"),
+		field("level", 3, "REQUIRED", "INT32"),
+	} } } },
+	{ name = "User.pb", dependency = { "UserInfo.pb" }, message_type = { { name = "User", field = {
+		field("id", 1, "REQUIRED", "INT32"),
+		field("status", 2, "REPEATED", "INT32"),
+		field("pwdMd5", 3, "REQUIRED", "STRING"),
+		field("regTime", 4, "REQUIRED", "STRING"),
+		field("info", 5, "REQUIRED", "MESSAGE", ".UserInfo"),
+	} } } },
+} }
+
+local user = {
+	id = 7,
+	status = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 },
+	pwdMd5 = "0123456789abcdef0123456789abcdef",
+	regTime = "2020-01-01 00:00:00",
+	info = { name = "player", diamond = 1 << 40, level = 30 },
+}
+
+local n = tonumber(arg and arg[1]) or 200000
+
+local function bench(name, f, data)
+	local best = math.huge
+	for _ = 1, 5 do
+		collectgarbage()
+		local c = os.clock()
+		for _ = 1, n do f(data) end
+		best = math.min(best, os.clock() - c)
+	end
+	print(("%-24s %.3fs"):format(name, best))
+end
+
+if package.preload["protobuf.c"] or package.searchpath("protobuf.c", package.cpath) then
+	local protobuf = require "protobuf"
+	local c = require "protobuf.c"
+	protobuf.register(protobuf.encode("google.protobuf.FileDescriptorSet", descriptor))
+	local data = protobuf.encode("User", user)
+
+	local env
+	for i = 1, math.huge do
+		local name, v = debug.getupvalue(protobuf.decode, i)
+		if name == nil then break end
+		if name == "P" then env = v end
+	end
+	local meta = {}
+	local function stub(t, b) return setmetatable({ t, b }, meta) end
+
+	bench("_decode (callback)", function(d)
+		local r = {}
+		c._decode(env, stub, r, "User", d)
+		return r
+	end, data)
+	bench("_decode_table", function(d)
+		return c._decode_table(env, meta, nil, "User", d)
+	end, data)
+	bench("protobuf.decode", function(d)
+		return protobuf.decode("User", d).info.level
+	end, data)
+else
+	local pb = require "pb"
+	require "protoc" -- loads descriptor.proto into pb
+	assert(pb.load(pb.encode("google.protobuf.FileDescriptorSet", descriptor)))
+	local data = pb.encode("User", user)
+
+	bench("lua-protobuf pb.decode", function(d)
+		return pb.decode("User", d).info.level
+	end, data)
+end
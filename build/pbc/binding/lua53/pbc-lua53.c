@@ -791,6 +791,209 @@ _decode(lua_State *L) {
 	return 1;
 }
 
+// repeated values are staged on the stack, and moved into an array of the
+// exact size when the run of the field ends (or the stage is full)
+#define DECODE_STAGE 256
+
+struct decode_table {
+	lua_State *L;
+	int meta;	// metatable of lazy sub messages
+	int keys;	// field id -> key string
+	int target;
+	int array;	// slot of the array of last_id, nil until first flush
+	int key;	// slot of the key of last_id
+	int last_id;
+	int last_n;
+	int staged;
+};
+
+static void
+push_key(struct decode_table *d, int id, const char *key) {
+	lua_State *L = d->L;
+	if (lua_rawgeti(L, d->keys, id) == LUA_TNIL) {
+		lua_pop(L,1);
+		lua_pushstring(L, key);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, d->keys, id);
+	}
+}
+
+static void
+push_field(struct decode_table *d, int type, const char * type_name, union pbc_value *v) {
+	lua_State *L = d->L;
+	if (type != PBC_MESSAGE) {
+		push_value(L, type, type_name, v);
+		return;
+	}
+	lua_createtable(L,2,0);
+	lua_pushstring(L, type_name);
+	lua_rawseti(L,-2,1);
+	lua_pushlstring(L, (const char *)v->s.buffer, v->s.len);
+	lua_rawseti(L,-2,2);
+	lua_pushvalue(L, d->meta);
+	lua_setmetatable(L,-2);
+}
+
+static void
+flush_staged(struct decode_table *d) {
+	lua_State *L = d->L;
+	int i, base = lua_gettop(L) - d->staged;
+	if (d->staged == 0)
+		return;
+	if (lua_isnil(L, d->array)) {
+		lua_pushvalue(L, d->key);
+		if (lua_rawget(L, d->target) == LUA_TNIL) {
+			lua_pop(L,1);
+			lua_createtable(L, d->staged, 0);
+			lua_pushvalue(L, d->key);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, d->target);
+		}
+		lua_replace(L, d->array);
+		d->last_n = (int)lua_rawlen(L, d->array);
+	}
+	for (i=1;i<=d->staged;i++) {
+		lua_pushvalue(L, base + i);
+		lua_rawseti(L, d->array, d->last_n + i);
+	}
+	d->last_n += d->staged;
+	lua_settop(L, base);
+	d->staged = 0;
+}
+
+static void
+decode_table_cb(void *ud, int type, const char * type_name, union pbc_value *v, int id, const char *key) {
+	struct decode_table *d = (struct decode_table *)ud;
+	lua_State *L = d->L;
+	if (key == NULL) {
+		// undefined field
+		return;
+	}
+
+	if (id != d->last_id) {
+		flush_staged(d);
+		d->last_id = 0;
+	}
+	if (type & PBC_REPEATED) {
+		if (d->last_id == 0) {
+			luaL_checkstack(L, DECODE_STAGE + 4, NULL);
+			push_key(d, id, key);
+			lua_replace(L, d->key);
+			lua_pushnil(L);
+			lua_replace(L, d->array);
+			d->last_id = id;
+		}
+		push_field(d, type & ~PBC_REPEATED, type_name, v);
+		if (++d->staged == DECODE_STAGE) {
+			flush_staged(d);
+		}
+	} else {
+		push_key(d, id, key);
+		push_field(d, type, type_name, v);
+		lua_rawset(L, d->target);
+	}
+}
+
+/*
+	push the key cache of message type, REGISTRY[keys][env][type]
+	returns the field count of type, or -1 if type is unknown
+ */
+static int
+push_key_cache(lua_State *L, struct pbc_env * env, const char * type) {
+	int n;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, "protobuf.c.keys") == LUA_TNIL) {
+		lua_pop(L,1);
+		lua_newtable(L);
+		lua_pushvalue(L,-1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "protobuf.c.keys");
+	}
+	if (lua_rawgetp(L, -1, env) == LUA_TNIL) {
+		lua_pop(L,1);
+		lua_newtable(L);
+		lua_pushvalue(L,-1);
+		lua_rawsetp(L, -3, env);
+	}
+	lua_remove(L,-2);
+	if (lua_getfield(L, -1, type) == LUA_TTABLE) {
+		lua_remove(L,-2);
+		lua_rawgeti(L, -1, 0);
+		n = (int)lua_tointeger(L,-1);
+		lua_pop(L,1);
+		return n;
+	}
+	lua_pop(L,1);
+	n = pbc_field_count(env, type);
+	if (n < 0) {
+		lua_pop(L,1);
+		return -1;
+	}
+	lua_createtable(L, 0, n+1);
+	lua_pushinteger(L, n);
+	lua_rawseti(L, -2, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, type);
+	lua_remove(L,-2);
+	return n;
+}
+
+/*
+	:1 lightuserdata env
+	:2 table metatable of sub messages, which are { type, data }
+	:3 table target or nil
+	:4 string type
+	:5 string data
+	:5 lightuserdata pointer
+	:6 integer len
+
+	table or false
+ */
+static int
+_decode_table(lua_State *L) {
+	struct pbc_env * env = (struct pbc_env *)checkuserdata(L,1);
+	luaL_checktype(L, 2 , LUA_TTABLE);
+	const char * type = luaL_checkstring(L,4);
+	struct pbc_slice slice;
+	if (lua_type(L,5) == LUA_TSTRING) {
+		size_t len;
+		slice.buffer = (void *)luaL_checklstring(L,5,&len);
+		slice.len = (int)len;
+	} else {
+		slice.buffer = checkuserdata(L,5);
+		slice.len = luaL_checkinteger(L,6);
+	}
+	lua_settop(L, 6);
+	int n = push_key_cache(L, env, type);
+	if (n < 0) {
+		lua_pushboolean(L,0);
+		return 1;
+	}
+	if (lua_istable(L,3)) {
+		lua_pushvalue(L,3);
+	} else {
+		lua_createtable(L, 0, n);
+	}
+	lua_pushnil(L);
+	lua_pushnil(L);
+
+	struct decode_table d;
+	d.L = L;
+	d.meta = 2;
+	d.keys = 7;
+	d.target = 8;
+	d.array = 9;
+	d.key = 10;
+	d.last_id = 0;
+	d.last_n = 0;
+	d.staged = 0;
+	if (pbc_decode(env, type, &slice, decode_table_cb, &d) < 0) {
+		lua_pushboolean(L,0);
+		return 1;
+	}
+	flush_staged(&d);
+	lua_settop(L, d.target);
+	return 1;
+}
+
 struct gcobj {
 	struct pbc_env * env;
 	int size_pat;
@@ -816,6 +1019,11 @@ _clear_gcobj(lua_State *L) {
 	obj->pat = NULL;
 	obj->msg = NULL;
 	if (obj->env) {
+		if (lua_getfield(L, LUA_REGISTRYINDEX, "protobuf.c.keys") == LUA_TTABLE) {
+			lua_pushnil(L);
+			lua_rawsetp(L, -2, obj->env);
+		}
+		lua_pop(L,1);
 		pbc_delete(obj->env);
 		obj->env = NULL;
 	}
@@ -896,6 +1104,7 @@ luaopen_protobuf_c(lua_State *L) {
 		{"_pattern_pack", _pattern_pack },
 		{"_last_error", _last_error },
 		{"_decode", _decode },
+		{"_decode_table", _decode_table },
 		{"_gc", _gc },
 		{"_add_pattern", _add_pattern },
 		{"_add_rmessage", _add_rmessage },
@@ -445,16 +445,12 @@ local function default_table(typename)
 	return v
 end
 
+-- sub messages are decoded lazily, as { typename, buffer } with this metatable
 local decode_message_mt = {}
 
-local function decode_message_cb(typename, buffer)
-	return setmetatable ( { typename, buffer } , decode_message_mt)
-end
-
 function M.decode(typename, buffer, length)
-	local ret = {}
-	local ok = c._decode(P, decode_message_cb , ret , typename, buffer, length)
-	if ok then
+	local ret = c._decode_table(P, decode_message_mt , nil , typename, buffer, length)
+	if ret then
 		return setmetatable(ret , default_table(typename))
 	else
 		return false , c._last_error(P)
@@ -465,7 +461,7 @@ local function expand(tbl)
 	local typename = rawget(tbl , 1)
 	local buffer = rawget(tbl , 2)
 	tbl[1] , tbl[2] = nil , nil
-	assert(c._decode(P, decode_message_cb , tbl , typename, buffer), typename)
+	assert(c._decode_table(P, decode_message_mt , tbl , typename, buffer), typename)
 	setmetatable(tbl , default_table(typename))
 end
 
@@ -44,3 +44,6 @@ end
 phonebuf = protobuf.pack("tutorial.Person.PhoneNumber number","87654321")
 buffer = protobuf.pack("tutorial.Person name id phone", "Alice", 123, { phonebuf })
 print(protobuf.unpack("tutorial.Person name id phone", buffer))
+
+ok, err = protobuf.decode("tutorial.Nope", code)
+assert(ok == false and err == "Proto not found", err)
@@ -46,6 +46,7 @@ struct pbc_env * pbc_new(void);
 void pbc_delete(struct pbc_env *);
 int pbc_register(struct pbc_env *, struct pbc_slice * slice);
 int pbc_type(struct pbc_env *, const char * type_name , const char * key , const char ** type);
+int pbc_field_count(struct pbc_env *, const char * type_name);
 const char * pbc_error(struct pbc_env *);
 
 // callback api
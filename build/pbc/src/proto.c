@@ -251,6 +251,23 @@ pbc_type(struct pbc_env * p, const char * type_name , const char * key , const c
 	return _pbcP_type(field, type);
 }
 
+static void
+_count_field(void *p, void *ud) {
+	++*(int *)ud;
+}
+
+int
+pbc_field_count(struct pbc_env * p, const char * type_name) {
+	struct _message *m = _pbcP_get_message(p, type_name);
+	if (m==NULL) {
+		p->lasterror = "Proto not found";
+		return -1;
+	}
+	int n = 0;
+	_pbcM_sp_foreach_ud(m->name, _count_field, &n);
+	return n;
+}
+
 int
 pbc_enum_id(struct pbc_env *env, const char *enum_type, const char *enum_name) {
 	struct _enum *enum_map = (struct _enum *)_pbcM_sp_query(env->enums, enum_type);